@@ -0,0 +1,145 @@
+/*
+ * Compare HTTP/1.1 and HTTP/2 for a batch of concurrent requests to one
+ * origin, against the loopback test server.
+ *
+ * Usage: bench_h2_multiplex [requests] [delay_ms] [max_connections]
+ *
+ * Defaults are 200 requests, 20 ms server delay and 6 connections, roughly
+ * what a browser allows per host. Prints one line per mode: the connections
+ * the server accepted per round, then wall time for the whole batch (best
+ * and median of several rounds). The HTTPS rows need the test server built
+ * with OpenSSL; HTTP/2 there is negotiated through ALPN. The h2c row uses
+ * prior knowledge over plain TCP, which libcurl releases before 8.0 cannot
+ * multiplex, so expect it to fail with those.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "requests.h"
+#include "server.h"
+
+#define ROUNDS 7
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * run - One batch of `n' GETs in a fresh batch, so no connections carry over
+ * from the previous round. Returns wall time in ms, or -1 if any failed.
+ */
+static double run(test_server_t *srv, req_t *reqv, int n,
+                  requests_http2_t mode, long max_conns, long max_streams)
+{
+    requests_batch_t batch;
+    double t;
+    int failed = 0;
+
+    if (requests_batch_init(&batch))
+        return -1;
+    requests_batch_set_max_connections(&batch, max_conns);
+    if (max_streams > 0)
+        requests_batch_set_max_streams(&batch, max_streams);
+
+    for (int i = 0; i < n; i++) {
+        requests_reset(&reqv[i]);
+        requests_set_http2(&reqv[i], mode);
+        requests_batch_get(&batch, &reqv[i], srv->url);
+        /* the server's certificate is self-signed */
+        curl_easy_setopt(reqv[i].curlhandle, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(reqv[i].curlhandle, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+
+    t = now();
+    requests_batch_perform(&batch);
+    t = now() - t;
+
+    for (int i = 0; i < n; i++)
+        if (requests_batch_result(&batch, i) != CURLE_OK ||
+            reqv[i].code != 200)
+            failed++;
+    requests_batch_close(&batch);
+
+    if (failed) {
+        fprintf(stderr, "%d of %d requests failed\n", failed, n);
+        return -1;
+    }
+    return t;
+}
+
+static void report(test_server_t *srv, req_t *reqv, int n, const char *name,
+                   requests_http2_t mode, long max_conns, long max_streams)
+{
+    double times[ROUNDS];
+    long conns = atomic_load(&srv->connections);
+
+    for (int r = 0; r < ROUNDS; r++) {
+        times[r] = run(srv, reqv, n, mode, max_conns, max_streams);
+        if (times[r] < 0) {
+            printf("%-28s failed\n", name);
+            return;
+        }
+    }
+    conns = (atomic_load(&srv->connections) - conns) / ROUNDS;
+
+    qsort(times, ROUNDS, sizeof(times[0]), cmp_double);
+    printf("%-28s %6ld %10.1f %10.1f\n", name, conns, times[0],
+           times[ROUNDS / 2]);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *body = "Simple test file for librequests.";
+    int n = argc > 1 ? atoi(argv[1]) : 200;
+    long delay = argc > 2 ? atol(argv[2]) : 20;
+    long max_conns = argc > 3 ? atol(argv[3]) : 6;
+    test_server_t srv, tls;
+    int have_tls;
+    char name[64];
+
+    if (n <= 0 || test_server_start(&srv, body, delay))
+        return 1;
+    have_tls = test_server_start_tls(&tls, body, delay) == 0;
+
+    req_t *reqv = calloc(n, sizeof(*reqv));
+    for (int i = 0; i < n; i++)
+        if (reqv == NULL || requests_init(&reqv[i]))
+            return 1;
+
+    printf("%d requests, %ld ms server delay\n", n, delay);
+    printf("%-28s %6s %10s %10s\n", "mode", "conns", "best_ms", "median_ms");
+
+    test_server_t *h1 = have_tls ? &tls : &srv;
+    const char *scheme = have_tls ? "https" : "http";
+
+    snprintf(name, sizeof(name), "%s/1.1, %ld conns", scheme, max_conns);
+    report(h1, reqv, n, name, REQUESTS_HTTP1, max_conns, 0);
+    snprintf(name, sizeof(name), "%s/1.1, unlimited", scheme);
+    report(h1, reqv, n, name, REQUESTS_HTTP1, 0, 0);
+    if (have_tls) {
+        snprintf(name, sizeof(name), "https/2, %ld conns", max_conns);
+        report(&tls, reqv, n, name, REQUESTS_HTTP2, max_conns, 0);
+        snprintf(name, sizeof(name), "https/2, %ld conns, 25 streams",
+                 max_conns);
+        report(&tls, reqv, n, name, REQUESTS_HTTP2, max_conns, 25);
+    }
+    snprintf(name, sizeof(name), "h2c, %ld conns", max_conns);
+    report(&srv, reqv, n, name, REQUESTS_HTTP2_PRIOR_KNOWLEDGE, max_conns, 0);
+
+    for (int i = 0; i < n; i++)
+        requests_close(&reqv[i]);
+    free(reqv);
+    if (have_tls)
+        test_server_stop(&tls);
+    test_server_stop(&srv);
+    return 0;
+}
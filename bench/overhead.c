@@ -0,0 +1,326 @@
+/*
+ * Measure what librequests costs on top of libcurl: the same requests to
+ * the loopback test server, once through requests_get_headers() and
+ * requests_post_headers() and once through hand-written curl_easy code that
+ * keeps the body and headers the same way a careful caller would.
+ *
+ * Usage: bench_overhead [--json] [requests]
+ *
+ * Each workload runs `requests' times (default 2000, a tenth of that for
+ * the 1 MiB body) on one reused handle and connection, for several rounds.
+ * Printed per workload and implementation:
+ *
+ *   ns/req      median wall time per request over the rounds
+ *   allocs/req  malloc(), calloc() and realloc() calls per request
+ *   copied/req  bytes copied per request: body and header bytes stored for
+ *               the caller, request header lines recorded, and bytes
+ *               realloc() had to move
+ *
+ * Allocations are counted on the benchmarking thread only, so the server's
+ * threads don't show up; they include libcurl's own. Counting needs glibc.
+ * With --json every row is printed as one JSON object per line instead of
+ * a table, for scripts that compare against a previous run.
+ */
+
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <time.h>
+#include "requests.h"
+#include "server.h"
+
+#define ROUNDS 5
+#define MANY_HEADERS 20
+#define LARGE_BODY (1 << 20)
+
+/*
+ * Allocation counting, by wrapping glibc's allocator for the whole process
+ */
+static _Thread_local int counting;
+static _Thread_local long allocs;
+static _Thread_local long moved;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocs += counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    allocs += counting;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    size_t old = ptr != NULL && counting ? malloc_usable_size(ptr) : 0;
+    void *p = __libc_realloc(ptr, size);
+
+    allocs += counting;
+    if (p != ptr && p != NULL && old > 0)
+        moved += old < size ? old : size;
+    return p;
+}
+#endif
+
+typedef struct {
+    const char *name;
+    const char *path;
+    int post;
+    int many_headers;
+    int large;
+} workload_t;
+
+typedef struct {
+    double ns;
+    double allocs;
+    double copied;
+} result_t;
+
+/* a growable buffer, as a hand-written caller would keep one */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} buf_t;
+
+static char *hdrv[MANY_HEADERS];
+static char post_body[] = "apple=red&banana=yellow";
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static size_t buf_append(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    buf_t *b = userdata;
+    size_t n = size * nmemb;
+
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 1024;
+        while (cap < b->len + n + 1)
+            cap *= 2;
+        char *tmp = realloc(b->buf, cap);
+        if (tmp == NULL)
+            return 0;
+        b->buf = tmp;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, ptr, n);
+    b->len += n;
+    b->buf[b->len] = '\0';
+    return n;
+}
+
+/*
+ * raw_once - One request by hand: the options a caller has to set, a
+ * header list built for the request, and the response kept in buffers that
+ * are reused from request to request. Returns the bytes it copied.
+ */
+static long raw_once(CURL *curl, const char *url, const workload_t *w,
+                     buf_t *body, buf_t *headers)
+{
+    struct curl_slist *slist = NULL;
+    long code = 0;
+
+    body->len = 0;
+    headers->len = 0;
+    if (w->many_headers)
+        for (int i = 0; i < MANY_HEADERS; i++)
+            slist = curl_slist_append(slist, hdrv[i]);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buf_append);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, body);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, buf_append);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, headers);
+    if (w->post) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t) strlen(post_body));
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_body);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    }
+
+    if (curl_easy_perform(curl) != CURLE_OK)
+        code = -1;
+    else
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_slist_free_all(slist);
+    return code == 200 ? (long) (body->len + headers->len) : -1;
+}
+
+/*
+ * lib_once - The same request through librequests. Returns the bytes it
+ * copied.
+ */
+static long lib_once(req_t *req, char *url, const workload_t *w)
+{
+    int hdrc = w->many_headers ? MANY_HEADERS : 0;
+    CURLcode rc;
+    long copied = 0;
+
+    requests_reset(req);
+    if (w->post)
+        rc = requests_post_headers(req, url, post_body, hdrv, hdrc);
+    else if (hdrc)
+        rc = requests_get_headers(req, url, hdrv, hdrc);
+    else
+        rc = requests_get(req, url);
+    if (rc != CURLE_OK || req->code != 200)
+        return -1;
+
+    copied += req->size;
+    for (int i = 0; i < req->resp_hdrc; i++)
+        copied += strlen(req->resp_hdrv[i]);
+    for (int i = 0; i < req->req_hdrc; i++)
+        copied += strlen(req->req_hdrv[i]);
+    return copied;
+}
+
+/*
+ * run - Times `n' requests of workload `w' per round, through librequests
+ * if `req' is given and by hand otherwise.
+ */
+static int run(const workload_t *w, const char *base, int n, req_t *req,
+               CURL *curl, result_t *res)
+{
+    char url[128];
+    double times[ROUNDS];
+    long total_allocs = 0, total_copied = 0;
+    buf_t body = { 0 }, headers = { 0 };
+
+    snprintf(url, sizeof(url), "%s%s", base, w->path);
+
+    /* the first request pays for the connection */
+    if ((req ? lib_once(req, url, w) : raw_once(curl, url, w, &body,
+                                                &headers)) < 0)
+        return -1;
+
+    for (int r = 0; r < ROUNDS; r++) {
+        allocs = 0;
+        moved = 0;
+        double t = now();
+        for (int i = 0; i < n; i++) {
+            counting = 1;
+            long copied = req ? lib_once(req, url, w) :
+                          raw_once(curl, url, w, &body, &headers);
+            counting = 0;
+            if (copied < 0)
+                return -1;
+            total_copied += copied;
+        }
+        times[r] = (now() - t) / n;
+        total_allocs += allocs;
+        total_copied += moved;
+    }
+
+    qsort(times, ROUNDS, sizeof(times[0]), cmp_double);
+    res->ns = times[ROUNDS / 2];
+    res->allocs = (double) total_allocs / (ROUNDS * n);
+    res->copied = (double) total_copied / (ROUNDS * n);
+    free(body.buf);
+    free(headers.buf);
+    return 0;
+}
+
+static void report(const workload_t *w, const char *impl,
+                   const result_t *res, int json)
+{
+    if (json)
+        printf("{\"workload\": \"%s\", \"impl\": \"%s\", \"ns_per_req\": "
+               "%.0f, \"allocs_per_req\": %.2f, \"bytes_copied_per_req\": "
+               "%.0f}\n", w->name, impl, res->ns, res->allocs, res->copied);
+    else
+        printf("%-22s %-12s %10.0f %10.2f %12.0f\n", w->name, impl, res->ns,
+               res->allocs, res->copied);
+}
+
+int main(int argc, const char *argv[])
+{
+    static const workload_t workloads[] = {
+        { "get_small",            "/few",  0, 0, 0 },
+        { "get_small_headers",    "/many", 0, 1, 0 },
+        { "get_large",            "/large", 0, 0, 1 },
+        { "get_large_headers",    "/large-many", 0, 1, 1 },
+        { "post_small",           "/few",  1, 0, 0 },
+        { "post_small_headers",   "/many", 1, 1, 0 },
+    };
+    int json = argc > 1 && strcmp(argv[1], "--json") == 0;
+    int n = argc > 1 + json ? atoi(argv[1 + json]) : 2000;
+    char resp_headers[MANY_HEADERS * 40 + 1] = "";
+    test_server_t srv;
+    req_t req;
+    CURL *curl;
+
+    /* the large routes get the pattern body of test_server_route() */
+    test_route_t routes[] = {
+        { .path = "/few", .body = "Simple test file for librequests." },
+        { .path = "/many", .body = "Simple test file for librequests.",
+          .headers = resp_headers },
+        { .path = "/large-many", .body_len = LARGE_BODY,
+          .headers = resp_headers },
+        { .path = "/large", .body_len = LARGE_BODY },
+    };
+
+    for (int i = 0; i < MANY_HEADERS; i++) {
+        char line[40];
+        snprintf(line, sizeof(line), "X-Bench-%02d: value-%02d\r\n", i, i);
+        strcat(resp_headers, line);
+        if (asprintf(&hdrv[i], "X-Bench-%02d: value-%02d", i, i) < 0)
+            return 1;
+    }
+
+    if (n <= 0 || test_server_start(&srv, "", 0))
+        return 1;
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++)
+        if (test_server_route(&srv, &routes[i]))
+            return 1;
+    curl = curl_easy_init();
+    if (curl == NULL || requests_init(&req))
+        return 1;
+#ifndef __GLIBC__
+    fprintf(stderr, "allocations are only counted with glibc\n");
+#endif
+
+    if (!json)
+        printf("%-22s %-12s %10s %10s %12s\n", "workload", "impl", "ns/req",
+               "allocs/req", "copied/req");
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        const workload_t *w = &workloads[i];
+        int iters = w->large ? (n + 9) / 10 : n;
+        result_t raw, lib;
+
+        if (run(w, srv.url, iters, NULL, curl, &raw) ||
+            run(w, srv.url, iters, &req, NULL, &lib)) {
+            fprintf(stderr, "%s: request failed\n", w->name);
+            return 1;
+        }
+        report(w, "curl_easy", &raw, json);
+        report(w, "librequests", &lib, json);
+    }
+
+    requests_close(&req);
+    curl_easy_cleanup(curl);
+    test_server_stop(&srv);
+    for (int i = 0; i < MANY_HEADERS; i++)
+        free(hdrv[i]);
+    return 0;
+}
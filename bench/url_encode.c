@@ -0,0 +1,136 @@
+/*
+ * Compare requests_url_encode against the encoder it replaced.
+ *
+ * Usage: bench_url_encode
+ *
+ * Prints one line per input size: bytes of raw input, then ns per call and
+ * MB/s for the old and the new encoder. The old one builds its output in
+ * stack arrays, so it is only run on inputs that fit comfortably.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "requests.h"
+
+#define LEGACY_MAX (64 * 1024)
+
+/*
+ * legacy_url_encode - requests_url_encode as it was: joins the pairs in a
+ * stack buffer, then escapes the whole string including separators. The
+ * buffer is sized for the separators here; the original was a byte short
+ * per pair and crashes when built with optimization.
+ */
+static char *legacy_url_encode(CURL *curl, char **data, int data_size)
+{
+    char *key, *val, *tmp;
+    int offset;
+    size_t term_size;
+    size_t tmp_len;
+
+    if (data_size % 2 != 0)
+        return NULL;
+
+    size_t total_size = 0;
+    for (int i = 0; i < data_size; i++) {
+        tmp = data[i];
+        tmp_len = strlen(tmp);
+        total_size += tmp_len;
+    }
+
+    char encoded[total_size + data_size];
+    encoded[0] = '\0';
+
+    for (int i = 0; i < data_size; i+=2) {
+        key = data[i];
+        val = data[i+1];
+        offset = i == 0 ? 2 : 3;
+        term_size = strlen(key) + strlen(val) + offset;
+        char term[term_size];
+        if (i == 0)
+            snprintf(term, term_size, "%s=%s", key, val);
+        else
+            snprintf(term, term_size, "&%s=%s", key, val);
+        strcat(encoded, term);
+    }
+
+    return curl_easy_escape(curl, encoded, strlen(encoded));
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * fill - Unreserved text with a byte that needs escaping every `every'
+ * bytes, or none if `every' is 0.
+ */
+static void fill(char *s, size_t len, size_t every)
+{
+    static const char alphabet[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.";
+    static const char escaped[] = " {}\":,/&=";
+
+    for (size_t i = 0; i < len; i++) {
+        if (every > 0 && i % every == every - 1)
+            s[i] = escaped[i % (sizeof(escaped) - 1)];
+        else
+            s[i] = alphabet[(i * 7919) % (sizeof(alphabet) - 1)];
+    }
+    s[len] = '\0';
+}
+
+int main(int argc, const char *argv[])
+{
+    size_t sizes[] = { 64, 1024, 16 * 1024, 60 * 1024, 1024 * 1024,
+                       8 * 1024 * 1024 };
+    size_t densities[] = { 0, 64, 8 };
+    CURL *curl = curl_easy_init();
+    req_t req;
+
+    if (curl == NULL || requests_init(&req))
+        return 1;
+
+    printf("%10s %8s %12s %10s %12s %10s\n", "bytes", "esc_every",
+           "legacy_ns", "legacy_MBs", "new_ns", "new_MBs");
+
+    for (size_t d = 0; d < sizeof(densities)/sizeof(densities[0]); d++) {
+        for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+            size_t len = sizes[s];
+            char *key = malloc(16), *val = malloc(len + 1);
+            fill(key, 15, 0);
+            fill(val, len, densities[d]);
+            char *data[] = { key, val };
+            int iters = len < 65536 ? 20000 : 50;
+            double legacy = 0, fresh, t;
+
+            if (len + 16 <= LEGACY_MAX) {
+                t = now();
+                for (int i = 0; i < iters; i++)
+                    curl_free(legacy_url_encode(curl, data, 2));
+                legacy = (now() - t) / iters;
+            }
+
+            t = now();
+            for (int i = 0; i < iters; i++)
+                requests_free(requests_url_encode(&req, data, 2));
+            fresh = (now() - t) / iters;
+
+            printf("%10zu %8zu ", len, densities[d]);
+            if (legacy > 0)
+                printf("%12.0f %10.1f ", legacy, len / legacy * 1e3);
+            else
+                printf("%12s %10s ", "-", "-");
+            printf("%12.0f %10.1f\n", fresh, len / fresh * 1e3);
+
+            free(key);
+            free(val);
+        }
+    }
+
+    requests_close(&req);
+    curl_easy_cleanup(curl);
+    return 0;
+}
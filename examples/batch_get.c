@@ -0,0 +1,42 @@
+/*
+ * Submit several GET requests concurrently.
+ */
+
+#include <stdio.h>
+#include "requests.h"
+
+int main(int argc, const char *argv[])
+{
+    char *urls[] = {
+        "http://example.com",
+        "http://example.org",
+        "http://example.net"
+    };
+    int n = sizeof(urls)/sizeof(char*);
+    req_t reqs[3];                    /* one struct per request */
+    requests_batch_t batch;
+
+    if (requests_batch_init(&batch))  /* setup */
+        return 1;
+
+    for (int i = 0; i < n; i++) {
+        if (requests_init(&reqs[i]))
+            return 1;
+        requests_batch_get(&batch, &reqs[i], urls[i]); /* queue GET request */
+    }
+
+    requests_batch_perform(&batch);   /* run them all at once */
+
+    for (int i = 0; i < n; i++) {
+        req_t *req = requests_batch_req(&batch, i);
+        printf("Request URL: %s\n", req->url);
+        printf("Result: %s\n", curl_easy_strerror(requests_batch_result(&batch, i)));
+        printf("Response Code: %lu\n", req->code);
+        printf("Response Size: %zu\n", req->size);
+    }
+
+    requests_batch_close(&batch);     /* clean up the batch first */
+    for (int i = 0; i < n; i++)
+        requests_close(&reqs[i]);
+    return 0;
+}
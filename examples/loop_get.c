@@ -0,0 +1,45 @@
+/*
+ * Submit several GET requests through the built-in event loop, following up
+ * on each one from its completion callback.
+ */
+
+#include <stdio.h>
+#include "requests.h"
+
+static requests_loop_t loop;
+
+static void done(req_t *req, CURLcode rc, void *userdata)
+{
+    printf("Request URL: %s\n", req->url);
+    printf("Result: %s\n", curl_easy_strerror(rc));
+    printf("Response Code: %lu\n", req->code);
+    printf("Response Size: %zu\n", req->size);
+
+    /* fetch the follow-up page on the same handle */
+    char *next = userdata;
+    if (next != NULL) {
+        requests_reset(req);
+        requests_loop_get(&loop, req, next, done, NULL);
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    req_t first, second;
+
+    if (requests_loop_init(&loop, NULL, NULL, NULL)) /* built-in driver */
+        return 1;
+    if (requests_init(&first) || requests_init(&second))
+        return 1;
+
+    requests_loop_get(&loop, &first, "http://example.com", done,
+                      "http://example.com/index.html");
+    requests_loop_get(&loop, &second, "http://example.org", done, NULL);
+
+    requests_loop_run(&loop);        /* returns once everything is done */
+
+    requests_loop_close(&loop);
+    requests_close(&first);
+    requests_close(&second);
+    return 0;
+}
@@ -19,12 +19,10 @@ int main(int argc, const char *argv[])
     printf("Response Size: %zu\n", req.size);
     printf("Response Body:\n%s", req.text);
 
-    requests_close(&req);
-
     puts("---");
 
-    // leaked the curl
-    ret = requests_init(&req);
+    /* clear out the last response but keep the connection around */
+    requests_reset(&req);
     requests_get(&req, "http://google.com");
     printf("Request URL: %s\n", req.url);
     printf("Response Code: %lu\n", req.code);
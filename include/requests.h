@@ -28,28 +28,496 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <curl/curl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
 #include <sys/utsname.h>
 
 #define __LIBREQ_VERS__ "v0.2"
 
+/*
+ * requests_allocator_t -- where librequests and libcurl get their memory,
+ * see requests_global_init(). The functions have the semantics of their C
+ * library namesakes.
+ */
+typedef struct {
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    char *(*strdup)(const char *str);
+    void *(*calloc)(size_t nmemb, size_t size);
+} requests_allocator_t;
+
+/*
+ * requests_mem_t -- the memory a req_t holds for its requests and
+ * responses: the body buffer, the header lines and their index, and the
+ * compressed request body. The buffers are kept from one request to the
+ * next, so `bytes' is what the handle costs while idle; `peak' is the most
+ * it held during the current request.
+ */
+typedef struct {
+    size_t bytes;
+    size_t peak;
+} requests_mem_t;
+
+/*
+ * requests_sink_fn -- receives the response body one chunk at a time as
+ * libcurl delivers it. Must return `len' to continue the transfer; any
+ * other value aborts it with CURLE_WRITE_ERROR.
+ */
+typedef size_t (*requests_sink_fn)(const char *chunk, size_t len,
+                                   void *userdata);
+
+/*
+ * requests_producer_fn -- writes up to `len' more bytes of a request body
+ * into `buf' as libcurl is ready to send them, see requests_post_producer().
+ * Returns the number of bytes written, 0 at the end of the body,
+ * REQUESTS_PRODUCE_PAUSE if none are ready yet, or REQUESTS_PRODUCE_ABORT
+ * to fail the request with CURLE_ABORTED_BY_CALLBACK.
+ */
+typedef size_t (*requests_producer_fn)(char *buf, size_t len, void *userdata);
+
+#define REQUESTS_PRODUCE_PAUSE CURL_READFUNC_PAUSE
+#define REQUESTS_PRODUCE_ABORT CURL_READFUNC_ABORT
+
+/*
+ * requests_multipart_t -- a multipart/form-data body, see
+ * requests_multipart_init(). Only the names of its parts are copied; their
+ * content stays in the caller's buffers and files, which are read while
+ * the body is sent. Any number of req_t handles may send the same one at
+ * once.
+ */
+typedef struct {
+    char *name;
+    char *type;         /* content type, NULL for none */
+    char *filename;     /* file name the server is told, NULL for none */
+    char *path;         /* file holding the content, NULL for a buffer */
+    const char *data;   /* the caller's buffer, if not from a file */
+    size_t len;
+} requests_part_t;
+
+typedef struct {
+    requests_part_t *partv;
+    int partc;
+    int partcap;
+} requests_multipart_t;
+
+/*
+ * requests_share_t -- DNS, TLS session and connection caches shared between
+ * any number of req_t handles, possibly living on different threads. Attach
+ * it with requests_init_shared(). It must outlive every req_t attached to it.
+ * libcurl can't share open connections between threads safely, so only
+ * handles on one thread may use a share with REQUESTS_SHARE_CONNECT.
+ */
 typedef struct {
+    CURLSH *sharehandle;
+    pthread_rwlock_t locks[CURL_LOCK_DATA_LAST];
+    int flags;                   /* REQUESTS_SHARE_* caches shared */
+} requests_share_t;
+
+#define REQUESTS_SHARE_DNS     (1 << 0)  /* resolved host names */
+#define REQUESTS_SHARE_SSL     (1 << 1)  /* TLS session ids */
+#define REQUESTS_SHARE_CONNECT (1 << 2)  /* open connections, one thread */
+#define REQUESTS_SHARE_ALL     (REQUESTS_SHARE_DNS | REQUESTS_SHARE_SSL)
+
+#define REQUESTS_DECODE      (1 << 0)  /* accept, decode compressed bodies */
+#define REQUESTS_ENCODE_GZIP (1 << 1)  /* gzip POST and PUT bodies */
+
+typedef enum {
+    REQUESTS_GET,
+    REQUESTS_POST,
+    REQUESTS_PUT
+} requests_method_t;
+
+/*
+ * HTTP versions a request may negotiate, see requests_set_http2().
+ */
+typedef enum {
+    REQUESTS_HTTP_DEFAULT,          /* whatever libcurl negotiates itself */
+    REQUESTS_HTTP1,                 /* HTTP/1.1 only */
+    REQUESTS_HTTP2,                 /* HTTP/2 over TLS via ALPN, else 1.1 */
+    REQUESTS_HTTP2_PRIOR_KNOWLEDGE  /* HTTP/2 without upgrade, also h2c */
+} requests_http2_t;
+
+/*
+ * requests_retry_t -- when and how often a failed request is tried again,
+ * see requests_set_retry(). requests_retry_init() fills in the defaults;
+ * change what you need afterwards. Leave `errv' or `statusv' NULL for the
+ * default lists.
+ */
+typedef struct {
+    int max_attempts;         /* tries in all, the first one included */
+    long base_ms;             /* backoff ceiling before the second try */
+    long max_backoff_ms;      /* the ceiling doubles per try up to this */
+    long max_retry_after_ms;  /* give up if Retry-After asks for longer */
+    int retry_unsafe;         /* also retry POST once it may have been sent */
+    const CURLcode *errv;     /* transfer errors worth retrying */
+    int errc;
+    const long *statusv;      /* response codes worth retrying */
+    int statusc;
+} requests_retry_t;
+
+/*
+ * requests_prepared_t -- a request whose method, URL, headers and body are
+ * set up once and then sent any number of times with
+ * requests_prepared_perform(). Everything is copied at prepare time, so the
+ * caller's arguments need not stay around.
+ */
+typedef struct {
+    requests_method_t method;
+    char *url;
+    char *data;
+    size_t data_size;
+    struct curl_slist *slist;
+    unsigned long generation;  /* private: unique to this preparation */
+} requests_prepared_t;
+
+/*
+ * requests_arena_t -- backing store for a header array such as resp_hdrv.
+ * Every line lives in one growing buffer, and `offv' records where each
+ * line starts so the array can be repointed when the buffer moves.
+ */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t *offv;
+    int linecap;
+    requests_mem_t *mem;   /* counts the arena's memory, may be NULL */
+} requests_arena_t;
+
+/*
+ * requests_hdr_index_t -- the response headers of the final response, parsed
+ * once as they arrive and hashed by lower-cased name. Headers that share a
+ * name are chained in arrival order. Strings are kept as offsets into the
+ * response header arena, see requests_header() and friends.
+ */
+typedef struct {
+    size_t name;     /* offset of the header line in the arena */
+    size_t name_len;
+    size_t value;    /* offset of the NULL terminated, trimmed value */
+    unsigned hash;
+    int next;        /* next header with the same name, -1 if none */
+    int last;        /* last header with this name if this is the first
+                        one, -1 otherwise */
+} requests_hdr_t;
+
+typedef struct {
+    requests_hdr_t *hdrv;
+    int hdrc;
+    int hdrcap;
+    int *slots;      /* open addressing table of first-of-name indices */
+    int slotc;       /* power of two, or 0 before first use */
+    int version;     /* HTTP version of the status line, e.g. 11 or 20 */
+    size_t reason;   /* offset of the NULL terminated reason phrase */
+    requests_mem_t *mem; /* counts the index's memory, may be NULL */
+} requests_hdr_index_t;
+
+/*
+ * requests_timing_t -- where the time of a request went, as libcurl
+ * measured it. Every time is in microseconds from the start of the
+ * request, so each includes the ones before it; with redirects, they
+ * cover the final request and `redirect_us' the ones before. Byte counts
+ * include headers. All zero if no transfer happened, e.g. a cache hit.
+ */
+typedef struct {
+    curl_off_t namelookup_us;    /* host name resolved */
+    curl_off_t connect_us;       /* TCP connection up */
+    curl_off_t appconnect_us;    /* TLS handshake done, 0 without TLS */
+    curl_off_t pretransfer_us;   /* about to send the request */
+    curl_off_t starttransfer_us; /* first response byte arrived */
+    curl_off_t total_us;         /* response complete */
+    curl_off_t redirect_us;      /* spent following redirects */
+    curl_off_t bytes_up;         /* request headers and body sent */
+    curl_off_t bytes_down;       /* response headers and body received */
+} requests_timing_t;
+
+/*
+ * The phases of requests_timing_t, for asking a requests_latency_t about
+ * one of them.
+ */
+typedef enum {
+    REQUESTS_PHASE_NAMELOOKUP,
+    REQUESTS_PHASE_CONNECT,
+    REQUESTS_PHASE_APPCONNECT,
+    REQUESTS_PHASE_PRETRANSFER,
+    REQUESTS_PHASE_STARTTRANSFER,
+    REQUESTS_PHASE_TOTAL,
+    REQUESTS_PHASE_REDIRECT,
+    REQUESTS_PHASE_COUNT
+} requests_phase_t;
+
+/*
+ * requests_latency_t -- folds the timings of finished requests into a
+ * latency histogram per host and phase, see requests_set_latency(). Any
+ * number of req_t handles, on any threads, may feed the same one. Hosts
+ * are opaque.
+ */
+typedef struct requests_latency_host requests_latency_host_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    requests_latency_host_t **buckets; /* hash table keyed by host */
+    size_t bucketc;
+    size_t hostc;
+} requests_latency_t;
+
+typedef struct {
+    unsigned long count;    /* requests recorded */
+    curl_off_t min_us;
+    curl_off_t max_us;
+    curl_off_t mean_us;
+    curl_off_t p50_us;      /* percentiles are accurate to within 1/4 */
+    curl_off_t p90_us;
+    curl_off_t p99_us;
+} requests_latency_summary_t;
+
+/*
+ * requests_done_fn -- called once a request submitted to a requests_loop_t
+ * has finished, with the same CURLcode requests_get() would have returned.
+ * It may submit further requests.
+ */
+typedef struct req_t req_t;
+typedef void (*requests_done_fn)(req_t *req, CURLcode rc, void *userdata);
+typedef struct requests_cache requests_cache_t;
+typedef struct requests_disk_cache requests_disk_cache_t;
+
+#define REQUESTS_HEDGE_SAMPLES 128
+
+/*
+ * requests_hedge_t -- settings and statistics for hedged GETs, shared by
+ * any number of req_t handles on any threads, see requests_set_hedge().
+ * `samples' holds the latencies of recent hedged GETs, from which the
+ * adaptive delay is derived.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    long delay_ms;              /* fixed hedge delay, 0 for adaptive */
+    long samples[REQUESTS_HEDGE_SAMPLES];
+    int samplec;
+    int samplei;                /* next slot to overwrite */
+    unsigned long requests;
+    unsigned long issued;
+    unsigned long won;
+} requests_hedge_t;
+
+typedef struct {
+    unsigned long requests; /* GETs run with hedging on */
+    unsigned long issued;   /* of those, how many sent a duplicate */
+    unsigned long won;      /* of those, how many the duplicate answered */
+    long delay_ms;          /* current hedge delay, -1 if none yet */
+} requests_hedge_stats_t;
+
+struct req_t {
     CURL* curlhandle;
     long code;
     char *url;
     char *text;
     size_t size;
+    size_t wire_size;          /* body bytes received before decoding */
+    size_t text_cap;           /* private: bytes allocated for text */
+    unsigned long text_reallocs; /* times text has been (re)allocated */
     char **req_hdrv;
     int req_hdrc;
     char **resp_hdrv;
     int resp_hdrc;
     int ok;
-} req_t;
+    CURLcode result;           /* result of the last transfer */
+    requests_timing_t timing;  /* phase timings of the last transfer */
+    int attempts;              /* tries the last request took */
+    long retry_wait_ms;        /* time it spent backing off between them */
+    requests_mem_t mem;        /* memory held for requests and responses */
+    struct curl_slist *slist;  /* private: request header list in flight */
+    requests_sink_fn sink;     /* private: body sink, see requests_set_sink */
+    void *sink_data;           /* private: userdata passed to sink */
+    requests_http2_t http2;    /* private: see requests_set_http2 */
+    int compression;           /* private: see requests_set_compression */
+    char *zbody;               /* private: compressed request body */
+    size_t zbody_size;
+    size_t zbody_cap;
+    int upload_fd;             /* private: file the body is read from, or -1 */
+    curl_off_t upload_start;   /* private: its offset where the body starts,
+                                  -1 if it can't seek */
+    curl_off_t upload_pos;     /* private: offset of the next byte to send */
+    curl_off_t upload_len;     /* private: body length, -1 if unknown */
+    void *upload_map;          /* private: mapped file being sent */
+    size_t upload_map_len;
+    requests_producer_fn producer; /* private: writes the body being sent */
+    void *producer_data;       /* private: userdata passed to producer */
+    int upload_paused;         /* private: producer had nothing ready */
+    CURLM *upload_multi;       /* private: runs a produced upload */
+    curl_mime *mime;           /* private: multipart body being sent */
+    const requests_retry_t *retry; /* private: see requests_set_retry */
+    requests_hedge_t *hedge;   /* private: see requests_set_hedge */
+    CURLM *hedge_multi;        /* private: runs a hedged GET's transfers */
+    req_t *hedge_req;          /* private: sends the duplicate */
+    requests_latency_t *latency; /* private: see requests_set_latency */
+    requests_cache_t *cache;   /* private: see requests_set_cache */
+    requests_disk_cache_t *disk_cache; /* private: see
+                                          requests_set_disk_cache */
+    void *map;                 /* private: mapped file `text' points into */
+    size_t map_len;
+    char *own_text;            /* private: `text' buffer while mapped */
+    requests_share_t *share;   /* private: shared caches, may be NULL */
+    requests_arena_t req_arena;  /* private: storage for req_hdrv */
+    requests_arena_t resp_arena; /* private: storage for resp_hdrv */
+    requests_hdr_index_t resp_index; /* private: parsed resp_hdrv */
+    requests_prepared_t *prepared; /* private: prepared request whose
+                                      options the handle currently holds */
+    unsigned long prepared_generation; /* private: its generation then */
+    requests_done_fn done;     /* private: completion callback in a loop */
+    void *done_data;           /* private: userdata passed to done */
+    req_t *async_next;         /* private: link in an async queue */
+};
+
+/*
+ * requests_batch_t -- drives many req_t transfers concurrently through a
+ * single curl multi handle. Each req_t added to a batch must have been
+ * initialized with requests_init() and must not be shared between batches.
+ */
+typedef struct {
+    CURLM *multihandle;
+    req_t **reqv;
+    int reqc;
+} requests_batch_t;
+
+/*
+ * requests_loop_t -- runs any number of requests without blocking, driven by
+ * socket readiness and timeouts. Either the caller's own event loop watches
+ * the sockets it is told about through requests_socket_fn and
+ * requests_timer_fn, or, on Linux, the built-in epoll driver does.
+ */
+typedef int (*requests_socket_fn)(curl_socket_t fd, int what, void *userdata);
+typedef void (*requests_timer_fn)(long timeout_ms, void *userdata);
+
+typedef struct {
+    CURLM *multihandle;
+    requests_socket_fn socket_fn;
+    requests_timer_fn timer_fn;
+    void *userdata;
+    int running;
+    int epfd;           /* built-in driver only, -1 otherwise */
+    long long deadline; /* built-in driver: ms on the monotonic clock at
+                           which curl wants a timeout, or -1 */
+} requests_loop_t;
+
+/*
+ * requests_async_t -- a background I/O thread that runs submitted requests
+ * and hands them back through a completion queue. Submitting never blocks;
+ * the submitted req_t is the future, and belongs to the I/O thread until it
+ * comes out of the queue with its result in `result'.
+ */
+typedef struct {
+    CURLM *multihandle;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    req_t *submit_head;  /* submitted, not yet picked up by the thread */
+    req_t *submit_tail;
+    req_t *done_head;    /* finished, not yet reaped */
+    req_t *done_tail;
+    int outstanding;     /* submitted and not yet reaped */
+    int stop;
+} requests_async_t;
+
+#define REQUESTS_POOL_SHARDS 8
+
+/*
+ * requests_pool_t -- a bounded set of req_t handles that threads borrow and
+ * return, so handles and their connections outlive any single request. The
+ * free handles are spread over several independently locked shards to keep
+ * threads from contending on one lock.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    req_t **freev;
+    int freec;
+} requests_pool_shard_t;
+
+typedef struct {
+    req_t *reqs;
+    int capacity;
+    requests_share_t *share;
+    requests_pool_shard_t shards[REQUESTS_POOL_SHARDS];
+    atomic_int created;
+    atomic_int in_use;
+    atomic_int high_water;
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong waits;
+    atomic_int waiters;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+} requests_pool_t;
+
+typedef struct {
+    unsigned long hits;   /* acquires served at once by an idle handle */
+    unsigned long misses; /* acquires that had to create a new handle */
+    unsigned long waits;  /* acquires that blocked on a full pool */
+    int in_use;           /* handles currently acquired */
+    int high_water;       /* most handles ever acquired at once */
+} requests_pool_stats_t;
 
+/*
+ * requests_cache_t -- an in-memory HTTP cache for GET responses, bounded by
+ * bytes and evicting the least recently used response first. Any number of
+ * req_t handles, on any threads, may use the same cache. Entries are opaque.
+ */
+typedef struct requests_cache_entry requests_cache_entry_t;
+
+struct requests_cache {
+    pthread_mutex_t lock;
+    size_t max_bytes;
+    size_t bytes;                      /* bytes held by entries */
+    requests_cache_entry_t **buckets;  /* hash table keyed by method+URL */
+    size_t bucketc;
+    size_t entryc;
+    requests_cache_entry_t *lru_head;  /* most recently used */
+    requests_cache_entry_t *lru_tail;  /* next to be evicted */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long revalidations;
+    unsigned long long bytes_saved;
+};
+
+/*
+ * requests_disk_cache_t -- an HTTP cache for GET responses kept in a
+ * directory, so separate processes share it. Each response is a content
+ * file, written to a temporary name and renamed into place. A memory-mapped
+ * index file holds freshness, sizes and counters, under a file lock.
+ * Bodies are served straight from the mapped content file.
+ */
+struct requests_disk_cache {
+    char *dir;
+    int index_fd;
+    void *index;            /* mapped index file */
+    size_t index_len;
+    size_t max_bytes;
+    pthread_mutex_t lock;   /* the file lock doesn't exclude threads */
+};
+
+typedef struct {
+    unsigned long hits;          /* served fresh, without a request */
+    unsigned long misses;        /* body had to be downloaded */
+    unsigned long revalidations; /* server answered 304, cached body served */
+    unsigned long long bytes_saved; /* body bytes served from the cache */
+    size_t entries;              /* responses currently cached */
+    size_t bytes;                /* bytes currently held */
+} requests_cache_stats_t;
+
+int requests_global_init(const requests_allocator_t *alloc);
+void requests_global_cleanup(void);
+void requests_free(void *ptr);
 int requests_init(req_t *req);
+int requests_init_shared(req_t *req, requests_share_t *share);
 void requests_close(req_t *req);
+void requests_reset(req_t *req);
 CURLcode requests_get(req_t *req, char *url);
 CURLcode requests_post(req_t *req, char *url, char *data);
 CURLcode requests_put(req_t *req, char *url, char *data);
@@ -59,6 +527,156 @@ CURLcode requests_post_headers(req_t *req, char *url, char *data,
                                char **custom_hdrv, int custom_hdrc);
 CURLcode requests_put_headers(req_t *req, char *url, char *data,
                               char **custom_hdrv, int custom_hdrc);
+CURLcode requests_post_data(req_t *req, char *url, const char *data,
+                            size_t len, char **custom_hdrv, int custom_hdrc);
+CURLcode requests_put_data(req_t *req, char *url, const char *data,
+                           size_t len, char **custom_hdrv, int custom_hdrc);
+CURLcode requests_post_fd(req_t *req, char *url, int fd, curl_off_t len,
+                          char **custom_hdrv, int custom_hdrc);
+CURLcode requests_put_fd(req_t *req, char *url, int fd, curl_off_t len,
+                         char **custom_hdrv, int custom_hdrc);
+CURLcode requests_post_producer(req_t *req, char *url,
+                                requests_producer_fn producer, void *userdata,
+                                char **custom_hdrv, int custom_hdrc);
+CURLcode requests_put_producer(req_t *req, char *url,
+                               requests_producer_fn producer, void *userdata,
+                               char **custom_hdrv, int custom_hdrc);
+void requests_resume_upload(req_t *req);
+CURLcode requests_post_file(req_t *req, char *url, const char *path,
+                            char **custom_hdrv, int custom_hdrc);
+CURLcode requests_put_file(req_t *req, char *url, const char *path,
+                           char **custom_hdrv, int custom_hdrc);
+
+int requests_multipart_init(requests_multipart_t *form);
+void requests_multipart_close(requests_multipart_t *form);
+int requests_multipart_add(requests_multipart_t *form, const char *name,
+                           const char *data, size_t len, const char *type);
+int requests_multipart_add_file(requests_multipart_t *form, const char *name,
+                                const char *path, const char *filename,
+                                const char *type);
+CURLcode requests_post_multipart(req_t *req, char *url,
+                                 requests_multipart_t *form,
+                                 char **custom_hdrv, int custom_hdrc);
+CURLcode requests_put_multipart(req_t *req, char *url,
+                                requests_multipart_t *form,
+                                char **custom_hdrv, int custom_hdrc);
+
 char *requests_url_encode(req_t *req, char **data, int data_size);
+ssize_t requests_form_encode(char *dst, size_t dst_size,
+                             char **data, int data_size);
+const char *requests_header(req_t *req, const char *name);
+int requests_header_first(req_t *req, const char *name);
+int requests_header_next(req_t *req, int i);
+const char *requests_header_value(req_t *req, int i);
+int requests_http_version(req_t *req);
+const char *requests_reason(req_t *req);
+void requests_set_sink(req_t *req, requests_sink_fn sink, void *userdata);
+void requests_set_http2(req_t *req, requests_http2_t mode);
+void requests_set_compression(req_t *req, int flags);
+void requests_retry_init(requests_retry_t *policy);
+void requests_set_retry(req_t *req, const requests_retry_t *policy);
+
+int requests_prepare(requests_prepared_t *prep, requests_method_t method,
+                     char *url, char *data,
+                     char **custom_hdrv, int custom_hdrc);
+void requests_prepared_close(requests_prepared_t *prep);
+CURLcode requests_prepared_perform(req_t *req, requests_prepared_t *prep);
+
+int requests_share_init(requests_share_t *share, int flags);
+void requests_share_close(requests_share_t *share);
+
+int requests_pool_init(requests_pool_t *pool, int capacity, int prewarm,
+                       requests_share_t *share);
+void requests_pool_close(requests_pool_t *pool);
+req_t *requests_pool_acquire(requests_pool_t *pool);
+void requests_pool_release(requests_pool_t *pool, req_t *req);
+void requests_pool_stats(requests_pool_t *pool, requests_pool_stats_t *stats);
+
+int requests_cache_init(requests_cache_t *cache, size_t max_bytes);
+void requests_cache_close(requests_cache_t *cache);
+void requests_cache_stats(requests_cache_t *cache,
+                          requests_cache_stats_t *stats);
+void requests_set_cache(req_t *req, requests_cache_t *cache);
+
+int requests_disk_cache_init(requests_disk_cache_t *cache, const char *dir,
+                             size_t max_bytes);
+void requests_disk_cache_close(requests_disk_cache_t *cache);
+void requests_disk_cache_stats(requests_disk_cache_t *cache,
+                               requests_cache_stats_t *stats);
+void requests_set_disk_cache(req_t *req, requests_disk_cache_t *cache);
+
+int requests_hedge_init(requests_hedge_t *hedge, long delay_ms);
+void requests_hedge_close(requests_hedge_t *hedge);
+void requests_hedge_stats(requests_hedge_t *hedge,
+                          requests_hedge_stats_t *stats);
+void requests_set_hedge(req_t *req, requests_hedge_t *hedge);
+
+int requests_latency_init(requests_latency_t *agg);
+void requests_latency_close(requests_latency_t *agg);
+void requests_set_latency(req_t *req, requests_latency_t *agg);
+int requests_latency_add(requests_latency_t *agg, const char *host,
+                         const requests_timing_t *timing);
+int requests_latency_summary(requests_latency_t *agg, const char *host,
+                             requests_phase_t phase,
+                             requests_latency_summary_t *summary);
+void requests_latency_dump(requests_latency_t *agg, FILE *out);
+
+int requests_loop_init(requests_loop_t *loop, requests_socket_fn socket_fn,
+                       requests_timer_fn timer_fn, void *userdata);
+void requests_loop_close(requests_loop_t *loop);
+CURLcode requests_loop_get(requests_loop_t *loop, req_t *req, char *url,
+                           requests_done_fn done, void *userdata);
+CURLcode requests_loop_post(requests_loop_t *loop, req_t *req, char *url,
+                            char *data, requests_done_fn done,
+                            void *userdata);
+CURLcode requests_loop_put(requests_loop_t *loop, req_t *req, char *url,
+                           char *data, requests_done_fn done, void *userdata);
+CURLcode requests_loop_prepared(requests_loop_t *loop, req_t *req,
+                                requests_prepared_t *prep,
+                                requests_done_fn done, void *userdata);
+void requests_loop_set_max_streams(requests_loop_t *loop, long max);
+CURLMcode requests_loop_socket_action(requests_loop_t *loop,
+                                      curl_socket_t fd, int events);
+int requests_loop_running(requests_loop_t *loop);
+int requests_loop_fd(requests_loop_t *loop);
+CURLMcode requests_loop_run_once(requests_loop_t *loop, long max_wait_ms);
+CURLMcode requests_loop_run(requests_loop_t *loop);
+
+int requests_async_init(requests_async_t *ctx);
+void requests_async_close(requests_async_t *ctx);
+CURLcode requests_submit_get(requests_async_t *ctx, req_t *req, char *url);
+CURLcode requests_submit_post(requests_async_t *ctx, req_t *req, char *url,
+                              char *data);
+CURLcode requests_submit_put(requests_async_t *ctx, req_t *req, char *url,
+                             char *data);
+CURLcode requests_submit_prepared(requests_async_t *ctx, req_t *req,
+                                  requests_prepared_t *prep);
+req_t *requests_async_poll(requests_async_t *ctx);
+req_t *requests_async_wait(requests_async_t *ctx, long timeout_ms);
+int requests_async_reap(requests_async_t *ctx, req_t **reqv, int max,
+                        long timeout_ms);
+int requests_async_outstanding(requests_async_t *ctx);
+
+int requests_batch_init(requests_batch_t *batch);
+void requests_batch_close(requests_batch_t *batch);
+void requests_batch_set_max_connections(requests_batch_t *batch, long max);
+void requests_batch_set_max_streams(requests_batch_t *batch, long max);
+CURLcode requests_batch_get(requests_batch_t *batch, req_t *req, char *url);
+CURLcode requests_batch_post(requests_batch_t *batch, req_t *req, char *url,
+                             char *data);
+CURLcode requests_batch_put(requests_batch_t *batch, req_t *req, char *url,
+                            char *data);
+CURLcode requests_batch_get_headers(requests_batch_t *batch, req_t *req,
+                                    char *url, char **custom_hdrv,
+                                    int custom_hdrc);
+CURLcode requests_batch_post_headers(requests_batch_t *batch, req_t *req,
+                                     char *url, char *data,
+                                     char **custom_hdrv, int custom_hdrc);
+CURLcode requests_batch_put_headers(requests_batch_t *batch, req_t *req,
+                                    char *url, char *data,
+                                    char **custom_hdrv, int custom_hdrc);
+CURLMcode requests_batch_perform(requests_batch_t *batch);
+req_t *requests_batch_req(requests_batch_t *batch, int i);
+CURLcode requests_batch_result(requests_batch_t *batch, int i);
 
 #endif
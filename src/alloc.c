@@ -0,0 +1,142 @@
+/*
+ * alloc.c -- librequests: the allocator behind all library memory, and
+ * accounting of what each req_t holds
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+static requests_allocator_t allocator = {
+    malloc, free, realloc, strdup, calloc
+};
+
+/*
+ * requests_global_init - Sets up libcurl, and optionally the allocator all
+ * memory of librequests and libcurl comes from from then on. Like
+ * curl_global_init(), which it replaces, it must be called before anything
+ * else in either library and while no other threads are running. Without
+ * it, libcurl sets itself up on first use and the C library's allocator is
+ * used.
+ *
+ * The functions must behave like their C library namesakes and be safe to
+ * call from any thread. The TLS and HTTP/2 libraries under libcurl keep
+ * their own allocators.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @alloc: allocator, which must stay around until requests_global_cleanup(),
+ *         or NULL for the C library's
+ */
+int requests_global_init(const requests_allocator_t *alloc)
+{
+    CURLcode rc;
+
+    if (alloc == NULL)
+        return curl_global_init(CURL_GLOBAL_ALL) == CURLE_OK ? 0 : -1;
+
+    if (alloc->malloc == NULL || alloc->free == NULL ||
+        alloc->realloc == NULL || alloc->strdup == NULL ||
+        alloc->calloc == NULL)
+        return -1;
+
+    rc = curl_global_init_mem(CURL_GLOBAL_ALL, alloc->malloc, alloc->free,
+                              alloc->realloc, alloc->strdup, alloc->calloc);
+    if (rc != CURLE_OK)
+        return -1;
+    allocator = *alloc;
+    return 0;
+}
+
+/*
+ * requests_global_cleanup - Releases libcurl's global state and goes back
+ * to the C library's allocator. Everything allocated through the library
+ * must have been freed by then.
+ */
+void requests_global_cleanup(void)
+{
+    curl_global_cleanup();
+    allocator.malloc = malloc;
+    allocator.free = free;
+    allocator.realloc = realloc;
+    allocator.strdup = strdup;
+    allocator.calloc = calloc;
+}
+
+/*
+ * requests_free - Frees memory the library hands to the caller to own, such
+ * as the string requests_url_encode() returns.
+ *
+ * @ptr: memory to free, may be NULL
+ */
+void requests_free(void *ptr)
+{
+    allocator.free(ptr);
+}
+
+void *mem_alloc(size_t size)
+{
+    return allocator.malloc(size);
+}
+
+void *mem_calloc(size_t nmemb, size_t size)
+{
+    return allocator.calloc(nmemb, size);
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    return allocator.realloc(ptr, size);
+}
+
+void mem_free(void *ptr)
+{
+    allocator.free(ptr);
+}
+
+char *mem_strdup(const char *str)
+{
+    return allocator.strdup(str);
+}
+
+char *mem_strndup(const char *str, size_t len)
+{
+    char *dup = allocator.malloc(len + 1);
+
+    if (dup == NULL)
+        return NULL;
+    memcpy(dup, str, len);
+    dup[len] = '\0';
+    return dup;
+}
+
+/*
+ * mem_grow - mem_realloc() for a buffer whose bytes count towards `mem',
+ * which may be NULL. `old_size' is what the buffer held before.
+ */
+void *mem_grow(requests_mem_t *mem, void *ptr, size_t old_size, size_t size)
+{
+    void *p = allocator.realloc(ptr, size);
+
+    if (p == NULL || mem == NULL)
+        return p;
+    mem->bytes += size - old_size;
+    if (mem->bytes > mem->peak)
+        mem->peak = mem->bytes;
+    return p;
+}
+
+/*
+ * mem_release - mem_free() for a buffer of `size' bytes counted in `mem'.
+ */
+void mem_release(requests_mem_t *mem, void *ptr, size_t size)
+{
+    if (ptr != NULL && mem != NULL)
+        mem->bytes -= size;
+    allocator.free(ptr);
+}
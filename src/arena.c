@@ -0,0 +1,197 @@
+/*
+ * arena.c -- librequests: contiguous storage for header lines
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+#define ARENA_MIN_BYTES 512
+#define ARENA_MIN_LINES 16
+
+/*
+ * Prototypes
+ */
+static int arena_grow_bytes(requests_arena_t *arena, char **hdrv, int hdrc,
+                            size_t need);
+static int arena_grow_lines(requests_arena_t *arena, char ***hdrv);
+
+/*
+ * arena_init - Initializes an empty arena. Nothing is allocated until the
+ * first line is appended.
+ *
+ * @arena: arena struct
+ * @mem:   counts the memory the arena and its char* array hold, or NULL
+ */
+void arena_init(requests_arena_t *arena, requests_mem_t *mem)
+{
+    arena->buf = NULL;
+    arena->len = 0;
+    arena->cap = 0;
+    arena->offv = NULL;
+    arena->linecap = 0;
+    arena->mem = mem;
+}
+
+/*
+ * arena_append - Copies `len' bytes of `line' into the arena as a NULL
+ * terminated string and appends a pointer to it to `hdrv'. All lines share
+ * one buffer; when it has to move, the pointers in `hdrv' are rebuilt from
+ * the arena's offset table.
+ *
+ * Returns 0 on success and -1 on memory error, in which case `hdrv' and
+ * `hdrc' are left untouched.
+ *
+ * @arena: arena struct
+ * @hdrv:  pointer to the char* array backed by `arena'
+ * @hdrc:  length of `hdrv' (NOTE: this value gets updated)
+ * @line:  bytes to append, need not be NULL terminated
+ * @len:   number of bytes in `line'
+ */
+int arena_append(requests_arena_t *arena, char ***hdrv, int *hdrc,
+                 const char *line, size_t len)
+{
+    if (*hdrc == arena->linecap && arena_grow_lines(arena, hdrv))
+        return -1;
+
+    if (arena_grow_bytes(arena, *hdrv, *hdrc, arena->len + len + 1))
+        return -1;
+
+    char *dst = arena->buf + arena->len;
+    memcpy(dst, line, len);
+    dst[len] = '\0';
+
+    arena->offv[*hdrc] = arena->len;
+    (*hdrv)[*hdrc] = dst;
+    (*hdrc)++;
+    arena->len += len + 1;
+    return 0;
+}
+
+/*
+ * arena_push - Copies `len' bytes of `str' into the arena as a NULL
+ * terminated string without adding it to `hdrv'. Since the buffer may move,
+ * the string is identified by its offset, valid until the arena is reset.
+ *
+ * Returns 0 on success and -1 on memory error.
+ *
+ * @arena: arena struct
+ * @hdrv:  char* array backed by `arena', repointed if the buffer moves
+ * @hdrc:  length of `hdrv'
+ * @str:   bytes to copy, need not be NULL terminated, may be in the arena
+ * @len:   number of bytes in `str'
+ * @off:   set to the offset of the copy within the arena
+ */
+int arena_push(requests_arena_t *arena, char **hdrv, int hdrc,
+               const char *str, size_t len, size_t *off)
+{
+    /* `str' may point into the arena itself, e.g. part of a line in it */
+    int inside = arena->buf != NULL && str >= arena->buf &&
+                 str < arena->buf + arena->len;
+    size_t str_off = inside ? (size_t) (str - arena->buf) : 0;
+
+    if (arena_grow_bytes(arena, hdrv, hdrc, arena->len + len + 1))
+        return -1;
+    if (inside)
+        str = arena->buf + str_off;
+
+    memcpy(arena->buf + arena->len, str, len);
+    arena->buf[arena->len + len] = '\0';
+
+    *off = arena->len;
+    arena->len += len + 1;
+    return 0;
+}
+
+/*
+ * arena_reset - Forgets every line in the arena in constant time. The
+ * memory is kept for the next request.
+ *
+ * @arena: arena struct
+ * @hdrc:  length of the char* array backed by `arena', set to 0
+ */
+void arena_reset(requests_arena_t *arena, int *hdrc)
+{
+    arena->len = 0;
+    *hdrc = 0;
+}
+
+/*
+ * arena_free - Frees the arena and the char* array backed by it.
+ *
+ * @arena: arena struct
+ * @hdrv:  char* array backed by `arena'
+ */
+void arena_free(requests_arena_t *arena, char **hdrv)
+{
+    mem_release(arena->mem, arena->buf, arena->cap);
+    mem_release(arena->mem, arena->offv, arena->linecap * sizeof(size_t));
+    mem_release(arena->mem, hdrv, arena->linecap * sizeof(char*));
+    arena_init(arena, arena->mem);
+}
+
+/*
+ * arena_grow_bytes - Makes room for at least `need' bytes of line data,
+ * doubling the buffer, and repoints the first `hdrc' entries of `hdrv' if
+ * the buffer moved.
+ */
+static int arena_grow_bytes(requests_arena_t *arena, char **hdrv, int hdrc,
+                            size_t need)
+{
+    size_t cap = arena->cap ? arena->cap : ARENA_MIN_BYTES;
+    char *buf;
+
+    if (need <= arena->cap)
+        return 0;
+
+    while (cap < need)
+        cap *= 2;
+
+    buf = mem_grow(arena->mem, arena->buf, arena->cap, cap);
+    if (buf == NULL)
+        return -1;
+
+    if (buf != arena->buf) {
+        for (int i = 0; i < hdrc; i++)
+            hdrv[i] = buf + arena->offv[i];
+    }
+
+    arena->buf = buf;
+    arena->cap = cap;
+    return 0;
+}
+
+/*
+ * arena_grow_lines - Doubles the number of lines the offset table and
+ * `hdrv' can hold.
+ */
+static int arena_grow_lines(requests_arena_t *arena, char ***hdrv)
+{
+    int linecap = arena->linecap ? arena->linecap * 2 : ARENA_MIN_LINES;
+    size_t *offv;
+    char **v;
+
+    v = mem_grow(arena->mem, *hdrv, arena->linecap * sizeof(char*),
+                 linecap * sizeof(char*));
+    if (v == NULL)
+        return -1;
+    *hdrv = v;
+
+    offv = mem_grow(arena->mem, arena->offv, arena->linecap * sizeof(size_t),
+                    linecap * sizeof(size_t));
+    if (offv == NULL) {
+        /* `hdrv' is counted by `linecap' like everything else, which stays */
+        if (arena->mem != NULL)
+            arena->mem->bytes -= (linecap - arena->linecap) * sizeof(char*);
+        return -1;
+    }
+    arena->offv = offv;
+
+    arena->linecap = linecap;
+    return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * async.c -- librequests: submit now, reap later on a background I/O thread
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include "requests.h"
+#include "internal.h"
+
+/*
+ * Prototypes
+ */
+static CURLcode async_submit(requests_async_t *ctx, req_t *req);
+static void *io_thread(void *arg);
+static void io_take_submissions(requests_async_t *ctx);
+static void io_drain(requests_async_t *ctx);
+static req_t *pop_done(requests_async_t *ctx);
+static int wait_done(requests_async_t *ctx, long timeout_ms);
+
+/*
+ * requests_async_init - Starts the I/O thread with an empty queue.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @ctx: reference to requests_async_t to be initialized
+ */
+int requests_async_init(requests_async_t *ctx)
+{
+    pthread_condattr_t attr;
+
+    ctx->submit_head = ctx->submit_tail = NULL;
+    ctx->done_head = ctx->done_tail = NULL;
+    ctx->outstanding = 0;
+    ctx->stop = 0;
+
+    ctx->multihandle = curl_multi_init();
+    if (ctx->multihandle == NULL)
+        return -1;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    /* timed waits are measured on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->done_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&ctx->thread, NULL, io_thread, ctx) != 0) {
+        pthread_cond_destroy(&ctx->done_cond);
+        pthread_mutex_destroy(&ctx->lock);
+        curl_multi_cleanup(ctx->multihandle);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * requests_async_close - Stops the I/O thread, abandoning any requests still
+ * in flight, and frees the context. Requests that were never reaped are
+ * left as they are; the req_t structs are owned by the caller and still need
+ * requests_close().
+ *
+ * @ctx: async context
+ */
+void requests_async_close(requests_async_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = 1;
+    pthread_mutex_unlock(&ctx->lock);
+    curl_multi_wakeup(ctx->multihandle);
+    pthread_join(ctx->thread, NULL);
+
+    /* detaches whatever easy handles are still in flight */
+    curl_multi_cleanup(ctx->multihandle);
+    pthread_cond_destroy(&ctx->done_cond);
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+/*
+ * requests_submit_get - Queues a GET request for the I/O thread and returns
+ * at once. `req' must not be touched until it has been reaped with
+ * requests_async_poll(), requests_async_wait() or requests_async_reap().
+ *
+ * Returns CURLE_OK on success. On failure nothing is queued.
+ *
+ * @ctx: async context
+ * @req: request struct, initialized with requests_init()
+ * @url: url to send request to
+ */
+CURLcode requests_submit_get(requests_async_t *ctx, req_t *req, char *url)
+{
+    CURLcode rc = req_prepare_get(req, url, NULL, 0);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return async_submit(ctx, req);
+}
+
+CURLcode requests_submit_post(requests_async_t *ctx, req_t *req, char *url,
+                              char *data)
+{
+    CURLcode rc = req_prepare_pt(req, url, data, NULL, 0, 0);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return async_submit(ctx, req);
+}
+
+CURLcode requests_submit_put(requests_async_t *ctx, req_t *req, char *url,
+                             char *data)
+{
+    CURLcode rc = req_prepare_pt(req, url, data, NULL, 0, 1);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return async_submit(ctx, req);
+}
+
+/*
+ * requests_submit_prepared - Queues a prepared request, which is also the
+ * way to send custom headers asynchronously. Clears the previous response on
+ * `req' first, like requests_prepared_perform().
+ */
+CURLcode requests_submit_prepared(requests_async_t *ctx, req_t *req,
+                                  requests_prepared_t *prep)
+{
+    req_prepare_prepared(req, prep);
+    return async_submit(ctx, req);
+}
+
+/*
+ * requests_async_poll - Takes the oldest finished request off the completion
+ * queue without waiting.
+ *
+ * Returns the request, with its CURLcode in `result', or NULL if none has
+ * finished yet.
+ *
+ * @ctx: async context
+ */
+req_t *requests_async_poll(requests_async_t *ctx)
+{
+    return requests_async_wait(ctx, 0);
+}
+
+/*
+ * requests_async_wait - Takes the oldest finished request off the
+ * completion queue, waiting up to `timeout_ms' for one to finish.
+ *
+ * Returns the request, with its CURLcode in `result', or NULL if none
+ * finished in time or nothing is outstanding.
+ *
+ * @ctx:        async context
+ * @timeout_ms: longest time to wait, 0 to not wait, -1 for no limit
+ */
+req_t *requests_async_wait(requests_async_t *ctx, long timeout_ms)
+{
+    req_t *req = NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (wait_done(ctx, timeout_ms))
+        req = pop_done(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return req;
+}
+
+/*
+ * requests_async_reap - Takes up to `max' finished requests off the
+ * completion queue in one go, waiting up to `timeout_ms' for the first.
+ *
+ * Returns the number of requests stored in `reqv'.
+ *
+ * @ctx:        async context
+ * @reqv:       array to store the requests in
+ * @max:        length of `reqv'
+ * @timeout_ms: longest time to wait, 0 to not wait, -1 for no limit
+ */
+int requests_async_reap(requests_async_t *ctx, req_t **reqv, int max,
+                        long timeout_ms)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (max > 0 && wait_done(ctx, timeout_ms)) {
+        while (n < max && ctx->done_head != NULL)
+            reqv[n++] = pop_done(ctx);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    return n;
+}
+
+/*
+ * requests_async_outstanding - Returns the number of requests submitted and
+ * not yet reaped, whether finished or not.
+ */
+int requests_async_outstanding(requests_async_t *ctx)
+{
+    int n;
+
+    pthread_mutex_lock(&ctx->lock);
+    n = ctx->outstanding;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return n;
+}
+
+/*
+ * async_submit - Appends a set up request to the submission queue and wakes
+ * the I/O thread.
+ */
+static CURLcode async_submit(requests_async_t *ctx, req_t *req)
+{
+    req->async_next = NULL;
+    curl_easy_setopt(req->curlhandle, CURLOPT_PRIVATE, req);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->submit_tail != NULL)
+        ctx->submit_tail->async_next = req;
+    else
+        ctx->submit_head = req;
+    ctx->submit_tail = req;
+    ctx->outstanding++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    curl_multi_wakeup(ctx->multihandle);
+    return CURLE_OK;
+}
+
+/*
+ * io_thread - Moves submitted requests into the multi handle, runs them and
+ * posts finished ones to the completion queue, sleeping in curl_multi_poll
+ * in between.
+ */
+static void *io_thread(void *arg)
+{
+    requests_async_t *ctx = arg;
+    int running;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        int stop = ctx->stop;
+        pthread_mutex_unlock(&ctx->lock);
+        if (stop)
+            break;
+
+        io_take_submissions(ctx);
+        curl_multi_perform(ctx->multihandle, &running);
+        io_drain(ctx);
+        curl_multi_poll(ctx->multihandle, NULL, 0, 1000, NULL);
+    }
+
+    return NULL;
+}
+
+/*
+ * io_take_submissions - Adds everything in the submission queue to the multi
+ * handle. A request the multi handle refuses is completed at once with
+ * CURLE_OUT_OF_MEMORY.
+ */
+static void io_take_submissions(requests_async_t *ctx)
+{
+    req_t *req, *next;
+
+    pthread_mutex_lock(&ctx->lock);
+    req = ctx->submit_head;
+    ctx->submit_head = ctx->submit_tail = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+
+    for (; req != NULL; req = next) {
+        next = req->async_next;
+        req->async_next = NULL;
+
+        if (curl_multi_add_handle(ctx->multihandle, req->curlhandle)
+                != CURLM_OK) {
+            req_finish(req, CURLE_OUT_OF_MEMORY);
+
+            pthread_mutex_lock(&ctx->lock);
+            if (ctx->done_tail != NULL)
+                ctx->done_tail->async_next = req;
+            else
+                ctx->done_head = req;
+            ctx->done_tail = req;
+            pthread_cond_broadcast(&ctx->done_cond);
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+}
+
+/*
+ * io_drain - Finishes every transfer the multi handle reports as done and
+ * posts it to the completion queue.
+ */
+static void io_drain(requests_async_t *ctx)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(ctx->multihandle, &left))) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        CURL *curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        req_t *req;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &req);
+
+        curl_multi_remove_handle(ctx->multihandle, curl);
+        req_finish(req, rc);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->done_tail != NULL)
+            ctx->done_tail->async_next = req;
+        else
+            ctx->done_head = req;
+        ctx->done_tail = req;
+        pthread_cond_broadcast(&ctx->done_cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+/*
+ * pop_done - Unlinks the head of the completion queue. The lock must be
+ * held and the queue must not be empty.
+ */
+static req_t *pop_done(requests_async_t *ctx)
+{
+    req_t *req = ctx->done_head;
+
+    ctx->done_head = req->async_next;
+    if (ctx->done_head == NULL)
+        ctx->done_tail = NULL;
+    req->async_next = NULL;
+    ctx->outstanding--;
+
+    return req;
+}
+
+/*
+ * wait_done - Waits with the lock held until the completion queue is not
+ * empty, `timeout_ms' passes or nothing is outstanding.
+ *
+ * Returns 1 if the queue is not empty, 0 otherwise.
+ */
+static int wait_done(requests_async_t *ctx, long timeout_ms)
+{
+    struct timespec deadline;
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    while (ctx->done_head == NULL && ctx->outstanding > 0 && timeout_ms != 0) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+        } else if (pthread_cond_timedwait(&ctx->done_cond, &ctx->lock,
+                                          &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    return ctx->done_head != NULL;
+}
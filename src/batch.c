@@ -0,0 +1,239 @@
+/*
+ * batch.c -- librequests: concurrent requests over a curl multi handle
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+/*
+ * Prototypes
+ */
+static CURLcode batch_add(requests_batch_t *batch, req_t *req);
+static void batch_drain(requests_batch_t *batch);
+
+/*
+ * requests_batch_init - Initializes an empty batch.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @batch: reference to requests_batch_t to be initialized
+ */
+int requests_batch_init(requests_batch_t *batch)
+{
+    batch->reqv = NULL;
+    batch->reqc = 0;
+
+    batch->multihandle = curl_multi_init();
+    if (batch->multihandle == NULL)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * requests_batch_close - Detaches every request from the batch and frees the
+ * batch. The req_t structs themselves are owned by the caller and still need
+ * requests_close().
+ *
+ * @batch: batch struct
+ */
+void requests_batch_close(requests_batch_t *batch)
+{
+    for (int i = 0; i < batch->reqc; i++)
+        curl_multi_remove_handle(batch->multihandle,
+                                 batch->reqv[i]->curlhandle);
+
+    mem_free(batch->reqv);
+    curl_multi_cleanup(batch->multihandle);
+}
+
+/*
+ * requests_batch_set_max_connections - Caps the number of connections the
+ * batch keeps open at once. Transfers beyond the cap are queued until a
+ * connection frees up. The default is no limit.
+ *
+ * @batch: batch struct
+ * @max:   maximum number of simultaneously open connections, 0 for no limit
+ */
+void requests_batch_set_max_connections(requests_batch_t *batch, long max)
+{
+    curl_multi_setopt(batch->multihandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, max);
+}
+
+/*
+ * requests_batch_set_max_streams - Caps the number of requests multiplexed
+ * over a single HTTP/2 connection. Requests beyond the cap wait for a stream
+ * to finish or, if the connection limit allows, open another connection. The
+ * server's own limit applies if it is lower. The default is 100.
+ *
+ * @batch: batch struct
+ * @max:   maximum number of concurrent streams per connection, 1 to 2^31-1
+ */
+void requests_batch_set_max_streams(requests_batch_t *batch, long max)
+{
+    curl_multi_setopt(batch->multihandle, CURLMOPT_MAX_CONCURRENT_STREAMS, max);
+}
+
+/*
+ * requests_batch_get - Queues a GET request on the batch. Nothing is sent
+ * until requests_batch_perform() is called.
+ *
+ * Returns CURLE_OK on success. On failure the request is not queued.
+ *
+ * @batch: batch struct
+ * @req:   request struct, initialized with requests_init()
+ * @url:   url to send request to
+ */
+CURLcode requests_batch_get(requests_batch_t *batch, req_t *req, char *url)
+{
+    return requests_batch_get_headers(batch, req, url, NULL, 0);
+}
+
+CURLcode requests_batch_post(requests_batch_t *batch, req_t *req, char *url,
+                             char *data)
+{
+    return requests_batch_post_headers(batch, req, url, data, NULL, 0);
+}
+
+CURLcode requests_batch_put(requests_batch_t *batch, req_t *req, char *url,
+                            char *data)
+{
+    return requests_batch_put_headers(batch, req, url, data, NULL, 0);
+}
+
+CURLcode requests_batch_get_headers(requests_batch_t *batch, req_t *req,
+                                    char *url, char **custom_hdrv,
+                                    int custom_hdrc)
+{
+    CURLcode rc = req_prepare_get(req, url, custom_hdrv, custom_hdrc);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return batch_add(batch, req);
+}
+
+CURLcode requests_batch_post_headers(requests_batch_t *batch, req_t *req,
+                                     char *url, char *data,
+                                     char **custom_hdrv, int custom_hdrc)
+{
+    CURLcode rc = req_prepare_pt(req, url, data, custom_hdrv, custom_hdrc, 0);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return batch_add(batch, req);
+}
+
+CURLcode requests_batch_put_headers(requests_batch_t *batch, req_t *req,
+                                    char *url, char *data,
+                                    char **custom_hdrv, int custom_hdrc)
+{
+    CURLcode rc = req_prepare_pt(req, url, data, custom_hdrv, custom_hdrc, 1);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return batch_add(batch, req);
+}
+
+/*
+ * requests_batch_perform - Runs every queued request concurrently and
+ * returns once all of them have completed. Each req_t is populated exactly
+ * as the blocking functions would populate it, and its CURLcode is available
+ * through requests_batch_result().
+ *
+ * Returns CURLM_OK on success, or the error from the multi interface.
+ *
+ * @batch: batch struct
+ */
+CURLMcode requests_batch_perform(requests_batch_t *batch)
+{
+    CURLM *multi = batch->multihandle;
+    CURLMcode mc;
+    int running;
+
+    for (;;) {
+        mc = curl_multi_perform(multi, &running);
+        batch_drain(batch);
+        if (mc != CURLM_OK || running == 0)
+            break;
+
+        mc = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+        if (mc != CURLM_OK)
+            break;
+    }
+
+    return mc;
+}
+
+/*
+ * requests_batch_req - Returns the i'th request added to the batch, or NULL
+ * if `i' is out of range.
+ */
+req_t *requests_batch_req(requests_batch_t *batch, int i)
+{
+    if (i < 0 || i >= batch->reqc)
+        return NULL;
+
+    return batch->reqv[i];
+}
+
+/*
+ * requests_batch_result - Returns the CURLcode of the i'th request added to
+ * the batch, i.e. what requests_get() and friends would have returned for
+ * it. Returns CURLE_BAD_FUNCTION_ARGUMENT if `i' is out of range.
+ */
+CURLcode requests_batch_result(requests_batch_t *batch, int i)
+{
+    if (i < 0 || i >= batch->reqc)
+        return CURLE_BAD_FUNCTION_ARGUMENT;
+
+    return batch->reqv[i]->result;
+}
+
+/*
+ * batch_add - Attaches a prepared request to the batch's multi handle.
+ *
+ * Returns CURLE_OK on success, or CURLE_OUT_OF_MEMORY on failure.
+ */
+static CURLcode batch_add(requests_batch_t *batch, req_t *req)
+{
+    req_t **reqv = mem_realloc(batch->reqv,
+                               (batch->reqc + 1) * sizeof(req_t*));
+    if (reqv == NULL)
+        return CURLE_OUT_OF_MEMORY;
+    batch->reqv = reqv;
+
+    curl_easy_setopt(req->curlhandle, CURLOPT_PRIVATE, req);
+    if (curl_multi_add_handle(batch->multihandle, req->curlhandle) != CURLM_OK)
+        return CURLE_OUT_OF_MEMORY;
+
+    batch->reqv[batch->reqc++] = req;
+    return CURLE_OK;
+}
+
+/*
+ * batch_drain - Finishes every transfer the multi handle reports as done.
+ */
+static void batch_drain(requests_batch_t *batch)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(batch->multihandle, &left))) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        CURL *curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        req_t *req;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &req);
+
+        curl_multi_remove_handle(batch->multihandle, curl);
+        req_finish(req, rc);
+    }
+}
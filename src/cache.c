@@ -0,0 +1,705 @@
+/*
+ * cache.c -- librequests: in-memory HTTP response cache
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <ctype.h>
+#include <time.h>
+#include "requests.h"
+#include "internal.h"
+
+#define CACHE_MIN_BUCKETS 64
+
+/*
+ * One cached response. The entry and every string it points to live in a
+ * single allocation of `cost' bytes. An entry that is evicted while a
+ * revalidation still holds a reference is unlinked at once but freed by the
+ * last cache_unref().
+ */
+struct requests_cache_entry {
+    requests_cache_entry_t *hnext;   /* hash chain */
+    requests_cache_entry_t *prev;    /* LRU list */
+    requests_cache_entry_t *next;
+    unsigned hash;
+    const char *key;                 /* "GET <url>" */
+    const char *vary;                /* lower-cased names the response
+                                        varies on, each NULL terminated,
+                                        ending with an empty one */
+    const char *vary_key;            /* request values of those headers */
+    const char *etag;                /* NULL if none */
+    const char *last_modified;       /* NULL if none */
+    const char *hdrs;                /* response header lines */
+    int hdrc;
+    const char *body;
+    size_t body_len;
+    long code;
+    long lifetime;                   /* seconds fresh after a response */
+    double fresh_until;              /* on the monotonic clock */
+    size_t cost;
+    int refs;
+    int linked;
+};
+
+/*
+ * Prototypes
+ */
+static unsigned hash_key(const char *key, size_t len);
+static char *make_key(req_t *req, size_t *len);
+static size_t vary_key(req_t *req, const char *vary, char *dst);
+static int vary_matches(req_t *req, const char *vary, const char *vkey);
+static size_t vary_names(req_t *req, char *dst);
+static const char *request_header(req_t *req, const char *name);
+static requests_cache_entry_t *cache_find(requests_cache_t *cache,
+                                          const char *key, unsigned hash,
+                                          req_t *req);
+static void cache_store(requests_cache_t *cache, req_t *req, const char *key,
+                        size_t key_len, unsigned hash, long lifetime);
+static void cache_link(requests_cache_t *cache, requests_cache_entry_t *e);
+static void cache_unlink(requests_cache_t *cache, requests_cache_entry_t *e);
+static void cache_touch(requests_cache_t *cache, requests_cache_entry_t *e);
+static void cache_unref(requests_cache_entry_t *e);
+static void cache_release(requests_cache_t *cache, requests_cache_entry_t *e);
+static int cache_grow(requests_cache_t *cache);
+static double now_s(void);
+
+/*
+ * requests_cache_init - Initializes an empty cache.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @cache:     cache struct
+ * @max_bytes: upper bound on the memory held by cached responses
+ */
+int requests_cache_init(requests_cache_t *cache, size_t max_bytes)
+{
+    cache->max_bytes = max_bytes;
+    cache->bytes = 0;
+    cache->entryc = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->revalidations = 0;
+    cache->bytes_saved = 0;
+
+    cache->bucketc = CACHE_MIN_BUCKETS;
+    cache->buckets = mem_calloc(cache->bucketc, sizeof(*cache->buckets));
+    if (cache->buckets == NULL)
+        return -1;
+
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        mem_free(cache->buckets);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * requests_cache_close - Frees the cache and everything in it. Requests
+ * using the cache must have finished.
+ *
+ * @cache: cache struct
+ */
+void requests_cache_close(requests_cache_t *cache)
+{
+    while (cache->lru_head != NULL)
+        cache_unlink(cache, cache->lru_head);
+    mem_free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+ * requests_cache_stats - Takes a snapshot of the cache's counters.
+ *
+ * @cache: cache struct
+ * @stats: filled in with the counters
+ */
+void requests_cache_stats(requests_cache_t *cache,
+                          requests_cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->revalidations = cache->revalidations;
+    stats->bytes_saved = cache->bytes_saved;
+    stats->entries = cache->entryc;
+    stats->bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * requests_set_cache - Serves subsequent requests_get() and
+ * requests_get_headers() calls on `req' through `cache'. A fresh response
+ * comes straight from memory. A stale one that has an ETag or Last-Modified
+ * is revalidated with If-None-Match or If-Modified-Since, and on a 304 the
+ * cached response is served as if the server had sent it again. Responses
+ * are kept according to Cache-Control (max-age, no-cache, no-store) or
+ * Expires, separately for each value of the request headers named by Vary.
+ * Responses that stream into a sink are not stored. Stays in effect across
+ * requests_reset() until cleared by passing NULL.
+ *
+ * @req:   request struct
+ * @cache: cache set up with requests_cache_init(), or NULL for none
+ */
+void requests_set_cache(req_t *req, requests_cache_t *cache)
+{
+    req->cache = cache;
+}
+
+/*
+ * cache_perform - Runs a GET set up by req_prepare_get() through the
+ * request's cache. Misses and revalidations go out through
+ * req_perform_get(), so they are hedged like any other GET.
+ *
+ * Returns CURLE_OK for a cache hit, otherwise what req_perform_get()
+ * returns.
+ */
+CURLcode cache_perform(req_t *req, char **custom_hdrv, int custom_hdrc)
+{
+    requests_cache_t *cache = req->cache;
+    requests_cache_entry_t *e;
+    size_t key_len;
+    CURLcode rc;
+    int replay = 0;
+
+    char *key = make_key(req, &key_len);
+    if (key == NULL)
+        return req_perform_get(req, custom_hdrv, custom_hdrc);
+    unsigned hash = hash_key(key, key_len);
+
+    pthread_mutex_lock(&cache->lock);
+    e = cache_find(cache, key, hash, req);
+    if (e != NULL && e->fresh_until > now_s()) {
+        cache->hits++;
+        cache->bytes_saved += e->body_len;
+        cache_touch(cache, e);
+        /* the reference keeps the entry around while a sink may take its
+           time over the body, or make requests through the cache itself */
+        e->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        mem_free(key);
+
+        int failed = req_replay(req, e->code, e->hdrs, e->hdrc, e->body,
+                                e->body_len);
+        cache_release(cache, e);
+
+        /* nothing went over the wire; drop what req_prepare_get set up */
+        req->wire_size = 0;
+        if (req->slist != NULL) {
+            curl_easy_setopt(req->curlhandle, CURLOPT_HTTPHEADER, NULL);
+            curl_slist_free_all(req->slist);
+            req->slist = NULL;
+        }
+        req->result = failed ? CURLE_WRITE_ERROR : CURLE_OK;
+        return req->result;
+    }
+
+    /* stale: ask the server whether it still holds */
+    if (e != NULL && (e->etag != NULL || e->last_modified != NULL)) {
+        if ((e->etag != NULL &&
+             cache_add_header(req, "If-None-Match", e->etag)) ||
+            (e->last_modified != NULL &&
+             cache_add_header(req, "If-Modified-Since", e->last_modified)))
+            e = NULL;
+        else
+            e->refs++;
+    } else {
+        e = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    rc = req_perform_get(req, custom_hdrv, custom_hdrc);
+
+    pthread_mutex_lock(&cache->lock);
+    if (rc == CURLE_OK && e != NULL && req->code == 304) {
+        cache_policy_t policy;
+        cache_policy(req, &policy);
+        /* a 304 may refresh the lifetime; if it says nothing, keep it */
+        if (policy.lifetime >= 0)
+            e->lifetime = policy.lifetime;
+        e->fresh_until = now_s() + e->lifetime;
+
+        cache->revalidations++;
+        cache->bytes_saved += e->body_len;
+        if (e->linked)
+            cache_touch(cache, e);
+        replay = 1;     /* after unlocking, still holding the reference */
+    } else {
+        cache->misses++;
+        if (rc == CURLE_OK && req->code == 200 && req->sink == NULL) {
+            cache_policy_t policy;
+            cache_policy(req, &policy);
+            if (!policy.no_store)
+                cache_store(cache, req, key, key_len, hash,
+                            policy.lifetime > 0 ? policy.lifetime : 0);
+        }
+    }
+    if (e != NULL && !replay && --e->refs == 0)
+        cache_unref(e);
+    pthread_mutex_unlock(&cache->lock);
+    mem_free(key);
+
+    if (replay) {
+        if (req_replay(req, e->code, e->hdrs, e->hdrc, e->body, e->body_len))
+            rc = CURLE_WRITE_ERROR;
+        cache_release(cache, e);
+    }
+    return rc;
+}
+
+/*
+ * cache_find - Looks up the entry for `key' whose Vary'd request headers
+ * match those of `req'. Called with the lock held.
+ */
+static requests_cache_entry_t *cache_find(requests_cache_t *cache,
+                                          const char *key, unsigned hash,
+                                          req_t *req)
+{
+    requests_cache_entry_t *e = cache->buckets[hash & (cache->bucketc - 1)];
+
+    for (; e != NULL; e = e->hnext) {
+        if (e->hash != hash || strcmp(e->key, key) != 0)
+            continue;
+        if (vary_matches(req, e->vary, e->vary_key))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * cache_store - Copies the response on `req' into a new entry, replacing
+ * any entry for the same key and Vary'd headers and evicting the least
+ * recently used ones until it fits. Called with the lock held.
+ */
+static void cache_store(requests_cache_t *cache, req_t *req, const char *key,
+                        size_t key_len, unsigned hash, long lifetime)
+{
+    requests_cache_entry_t *old, *e;
+    const char *etag = requests_header(req, "etag");
+    const char *lm = requests_header(req, "last-modified");
+    size_t hdrs_len = 0, vary_len, vkey_len, etag_len = 0, lm_len = 0;
+    int first;
+
+    /* nothing to serve later: neither fresh for a while nor revalidatable */
+    if (lifetime == 0 && etag == NULL && lm == NULL)
+        return;
+
+    vary_len = vary_names(req, NULL);
+    if (vary_len == 0)
+        return;                         /* "Vary: *" */
+    char *vary = mem_alloc(vary_len);
+    if (vary == NULL)
+        return;
+    vary_names(req, vary);
+    vkey_len = vary_key(req, vary, NULL);
+
+    /* only the final response's headers, not those of redirects */
+    first = 0;
+    for (int i = 0; i < req->resp_hdrc; i++)
+        if (strncmp(req->resp_hdrv[i], "HTTP/", 5) == 0)
+            first = i;
+    for (int i = first; i < req->resp_hdrc; i++)
+        hdrs_len += strlen(req->resp_hdrv[i]) + 1;
+    if (etag != NULL)
+        etag_len = strlen(etag) + 1;
+    if (lm != NULL)
+        lm_len = strlen(lm) + 1;
+
+    size_t cost = sizeof(*e) + key_len + 1 + vary_len + vkey_len + 1 +
+                  etag_len + lm_len + hdrs_len + req->size;
+    if (cost > cache->max_bytes || (e = mem_alloc(cost)) == NULL) {
+        mem_free(vary);
+        return;
+    }
+
+    char *p = (char *) (e + 1);
+    e->key = memcpy(p, key, key_len + 1);
+    p += key_len + 1;
+    e->vary = memcpy(p, vary, vary_len);
+    p += vary_len;
+    vary_key(req, vary, p);
+    e->vary_key = p;
+    p += vkey_len + 1;
+    e->etag = etag != NULL ? memcpy(p, etag, etag_len) : NULL;
+    p += etag_len;
+    e->last_modified = lm != NULL ? memcpy(p, lm, lm_len) : NULL;
+    p += lm_len;
+    e->hdrs = p;
+    for (int i = first; i < req->resp_hdrc; i++) {
+        size_t n = strlen(req->resp_hdrv[i]) + 1;
+        memcpy(p, req->resp_hdrv[i], n);
+        p += n;
+    }
+    e->hdrc = req->resp_hdrc - first;
+    e->body = memcpy(p, req->text, req->size);
+    e->body_len = req->size;
+    e->code = req->code;
+    e->lifetime = lifetime;
+    e->fresh_until = now_s() + lifetime;
+    e->hash = hash;
+    e->cost = cost;
+    e->refs = 1;
+    e->linked = 0;
+    mem_free(vary);
+
+    old = cache_find(cache, key, hash, req);
+    if (old != NULL)
+        cache_unlink(cache, old);
+    while (cache->bytes + cost > cache->max_bytes)
+        cache_unlink(cache, cache->lru_tail);
+
+    if (cache->entryc + 1 > cache->bucketc)
+        cache_grow(cache);              /* only a longer chain on failure */
+    cache_link(cache, e);
+}
+
+/*
+ * cache_link - Adds `e' to the hash table and the front of the LRU list.
+ */
+static void cache_link(requests_cache_t *cache, requests_cache_entry_t *e)
+{
+    requests_cache_entry_t **bucket =
+        &cache->buckets[e->hash & (cache->bucketc - 1)];
+
+    e->hnext = *bucket;
+    *bucket = e;
+
+    e->prev = NULL;
+    e->next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->prev = e;
+    cache->lru_head = e;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = e;
+
+    e->linked = 1;
+    cache->entryc++;
+    cache->bytes += e->cost;
+}
+
+/*
+ * cache_unlink - Takes `e' out of the cache and drops the cache's reference
+ * to it.
+ */
+static void cache_unlink(requests_cache_t *cache, requests_cache_entry_t *e)
+{
+    requests_cache_entry_t **pp =
+        &cache->buckets[e->hash & (cache->bucketc - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        cache->lru_head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        cache->lru_tail = e->prev;
+
+    e->linked = 0;
+    cache->entryc--;
+    cache->bytes -= e->cost;
+    if (--e->refs == 0)
+        cache_unref(e);
+}
+
+/*
+ * cache_touch - Moves `e' to the front of the LRU list.
+ */
+static void cache_touch(requests_cache_t *cache, requests_cache_entry_t *e)
+{
+    if (cache->lru_head == e)
+        return;
+
+    e->prev->next = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        cache->lru_tail = e->prev;
+
+    e->prev = NULL;
+    e->next = cache->lru_head;
+    cache->lru_head->prev = e;
+    cache->lru_head = e;
+}
+
+/*
+ * cache_unref - Frees an entry no longer referenced by the cache or any
+ * revalidation.
+ */
+static void cache_unref(requests_cache_entry_t *e)
+{
+    mem_free(e);
+}
+
+/*
+ * cache_release - Drops a reference taken on `e' while the lock was held,
+ * for use once it has been let go.
+ */
+static void cache_release(requests_cache_t *cache, requests_cache_entry_t *e)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (--e->refs == 0)
+        cache_unref(e);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * cache_grow - Doubles the hash table.
+ *
+ * Returns 0 on success, or -1 on memory error, leaving the table as is.
+ */
+static int cache_grow(requests_cache_t *cache)
+{
+    size_t bucketc = cache->bucketc * 2;
+    requests_cache_entry_t **buckets = mem_calloc(bucketc, sizeof(*buckets));
+    if (buckets == NULL)
+        return -1;
+
+    for (size_t i = 0; i < cache->bucketc; i++) {
+        requests_cache_entry_t *e = cache->buckets[i], *next;
+        for (; e != NULL; e = next) {
+            next = e->hnext;
+            e->hnext = buckets[e->hash & (bucketc - 1)];
+            buckets[e->hash & (bucketc - 1)] = e;
+        }
+    }
+
+    mem_free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucketc = bucketc;
+    return 0;
+}
+
+/*
+ * cache_policy - Works out from the response headers on `req' whether it
+ * may be stored and for how long it stays fresh. `lifetime' is -1 when the
+ * response says nothing about it.
+ */
+void cache_policy(req_t *req, cache_policy_t *policy)
+{
+    const char *expires, *age;
+    int no_cache = 0;
+
+    policy->no_store = 0;
+    policy->lifetime = -1;
+
+    for (int i = requests_header_first(req, "cache-control"); i >= 0;
+         i = requests_header_next(req, i)) {
+        const char *p = requests_header_value(req, i);
+        while (*p != '\0') {
+            while (*p == ' ' || *p == ',')
+                p++;
+            size_t n = strcspn(p, ",");
+            if (n >= 8 && strncasecmp(p, "no-store", 8) == 0)
+                policy->no_store = 1;
+            else if (n >= 8 && strncasecmp(p, "no-cache", 8) == 0)
+                no_cache = 1;
+            else if (n > 8 && strncasecmp(p, "max-age=", 8) == 0)
+                policy->lifetime = strtol(p + 8, NULL, 10);
+            p += n;
+        }
+    }
+
+    if (policy->lifetime < 0 &&
+        (expires = requests_header(req, "expires")) != NULL) {
+        const char *date = requests_header(req, "date");
+        time_t now = date != NULL ? curl_getdate(date, NULL) : time(NULL);
+        time_t until = curl_getdate(expires, NULL);
+        /* an unparseable Expires means already expired */
+        policy->lifetime = until > now && now >= 0 ? until - now : 0;
+    }
+
+    /* time the response already spent in caches upstream */
+    if (policy->lifetime > 0 && (age = requests_header(req, "age")) != NULL) {
+        long spent = strtol(age, NULL, 10);
+        policy->lifetime = spent < policy->lifetime ?
+                           policy->lifetime - spent : 0;
+    }
+
+    if (no_cache)
+        policy->lifetime = 0;
+}
+
+/*
+ * vary_names - Writes the lower-cased header names listed in Vary on the
+ * response to `dst', each NULL terminated and followed by an empty name.
+ * With `dst' NULL only the length is computed.
+ *
+ * Returns the number of bytes needed, or 0 if the response varies on "*".
+ */
+static size_t vary_names(req_t *req, char *dst)
+{
+    size_t len = 0;
+
+    for (int i = requests_header_first(req, "vary"); i >= 0;
+         i = requests_header_next(req, i)) {
+        const char *p = requests_header_value(req, i);
+        while (*p != '\0') {
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                p++;
+            size_t n = strcspn(p, " \t,");
+            if (n == 1 && *p == '*')
+                return 0;
+            if (n > 0) {
+                if (dst != NULL) {
+                    for (size_t j = 0; j < n; j++)
+                        dst[len + j] = tolower((unsigned char) p[j]);
+                    dst[len + n] = '\0';
+                }
+                len += n + 1;
+            }
+            p += n;
+        }
+    }
+
+    if (dst != NULL)
+        dst[len] = '\0';
+    return len + 1;
+}
+
+/*
+ * vary_matches - Whether the values `req' sends for the headers named in
+ * `vary' are the ones recorded in `vkey' by vary_key(), compared in place.
+ */
+static int vary_matches(req_t *req, const char *vary, const char *vkey)
+{
+    for (const char *name = vary; *name != '\0';
+         name += strlen(name) + 1) {
+        const char *value = request_header(req, name);
+        size_t n = value != NULL ? strcspn(value, "\r\n") : 0;
+
+        /* strncmp() stops at the end of a shorter `vkey' */
+        if (strncmp(vkey, value != NULL ? value : "", n) != 0 ||
+            vkey[n] != '\n')
+            return 0;
+        vkey += n + 1;
+    }
+    return *vkey == '\0';
+}
+
+/*
+ * vary_key - Writes the values `req' sends for the headers named in `vary'
+ * to `dst', one per line and NULL terminated. With `dst' NULL only the
+ * length is computed.
+ *
+ * Returns the length, not counting the NULL terminator.
+ */
+static size_t vary_key(req_t *req, const char *vary, char *dst)
+{
+    size_t len = 0;
+
+    for (const char *name = vary; *name != '\0';
+         name += strlen(name) + 1) {
+        const char *value = request_header(req, name);
+        size_t n = 0;
+        if (value != NULL) {
+            n = strcspn(value, "\r\n");
+            if (dst != NULL)
+                memcpy(dst + len, value, n);
+        }
+        if (dst != NULL)
+            dst[len + n] = '\n';
+        len += n + 1;
+    }
+
+    if (dst != NULL)
+        dst[len] = '\0';
+    return len;
+}
+
+/*
+ * request_header - Finds the value of header `name' among the custom
+ * headers of the request, or returns NULL.
+ */
+static const char *request_header(req_t *req, const char *name)
+{
+    size_t n = strlen(name);
+
+    for (int i = 0; i < req->req_hdrc; i++) {
+        const char *line = req->req_hdrv[i];
+        if (strncasecmp(line, name, n) == 0 && line[n] == ':') {
+            line += n + 1;
+            while (*line == ' ' || *line == '\t')
+                line++;
+            return line;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * cache_add_header - Adds a header to the request set up on `req'.
+ *
+ * Returns 0 on success, or -1 on memory error.
+ */
+int cache_add_header(req_t *req, const char *name, const char *value)
+{
+    size_t len = strlen(name) + 2 + strlen(value);
+    char *line = mem_alloc(len + 1);
+    struct curl_slist *slist;
+
+    if (line == NULL)
+        return -1;
+    snprintf(line, len + 1, "%s: %s", name, value);
+
+    slist = curl_slist_append(req->slist, line);
+    if (slist == NULL ||
+        arena_append(&req->req_arena, &req->req_hdrv, &req->req_hdrc,
+                     line, len)) {
+        if (slist != NULL)
+            req->slist = slist;
+        mem_free(line);
+        return -1;
+    }
+    mem_free(line);
+
+    req->slist = slist;
+    curl_easy_setopt(req->curlhandle, CURLOPT_HTTPHEADER, req->slist);
+    return 0;
+}
+
+/*
+ * make_key - "GET " followed by the URL of the request.
+ */
+static char *make_key(req_t *req, size_t *len)
+{
+    size_t url_len = strlen(req->url);
+    char *key = mem_alloc(4 + url_len + 1);
+
+    if (key != NULL) {
+        memcpy(key, "GET ", 4);
+        memcpy(key + 4, req->url, url_len + 1);
+        *len = 4 + url_len;
+    }
+    return key;
+}
+
+/*
+ * hash_key - FNV-1a, as for header names.
+ */
+static unsigned hash_key(const char *key, size_t len)
+{
+    unsigned hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,104 @@
+/*
+ * compress.c -- librequests: compressed request and response bodies
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <limits.h>
+#include <zlib.h>
+#include "requests.h"
+#include "internal.h"
+
+/*
+ * Prototypes
+ */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size);
+static void zlib_free(voidpf opaque, voidpf address);
+
+/*
+ * requests_set_compression - Turns compression on or off for subsequent
+ * requests on `req'. Stays in effect across requests_reset().
+ *
+ * With REQUESTS_DECODE, requests offer every encoding libcurl was built
+ * with (gzip and deflate, plus brotli and zstd when available) and decode
+ * the response as it arrives, so `text' or the sink still gets the plain
+ * body. `size' counts decoded bytes, `wire_size' the bytes that came over
+ * the network.
+ *
+ * With REQUESTS_ENCODE_GZIP, the bodies of POST and PUT requests are gzip
+ * compressed and sent with "Content-Encoding: gzip". Only turn this on for
+ * servers known to accept it. Prepared requests are sent as prepared.
+ *
+ * @req:   request struct
+ * @flags: REQUESTS_DECODE and/or REQUESTS_ENCODE_GZIP, or 0 for neither
+ */
+void requests_set_compression(req_t *req, int flags)
+{
+    req->compression = flags;
+    req->prepared = NULL;   /* a prepared request must pick up the change */
+}
+
+/*
+ * req_gzip_body - Gzip compresses `len' bytes of `data' into the request's
+ * body buffer, which is kept from one request to the next.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @req:  request struct
+ * @data: request body
+ * @len:  length of `data'
+ */
+int req_gzip_body(req_t *req, const char *data, size_t len)
+{
+    z_stream zs;
+    int rc;
+
+    /* zlib counts in 32 bits; bodies that large have no business in memory */
+    if (len > UINT_MAX / 2)
+        return -1;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zlib_alloc;
+    zs.zfree = zlib_free;
+    /* 16 + MAX_WBITS asks for a gzip wrapper rather than zlib's own */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    size_t bound = deflateBound(&zs, len);
+    if (bound > req->zbody_cap) {
+        char *buf = mem_grow(&req->mem, req->zbody, req->zbody_cap, bound);
+        if (buf == NULL) {
+            deflateEnd(&zs);
+            return -1;
+        }
+        req->zbody = buf;
+        req->zbody_cap = bound;
+    }
+
+    /* deflateBound() guarantees a single call is enough */
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *) req->zbody;
+    zs.avail_out = req->zbody_cap;
+    rc = deflate(&zs, Z_FINISH);
+
+    req->zbody_size = zs.total_out;
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+/* zlib's state comes from the library allocator like everything else */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    return mem_calloc(items, size);
+}
+
+static void zlib_free(voidpf opaque, voidpf address)
+{
+    mem_free(address);
+}
@@ -0,0 +1,653 @@
+/*
+ * disk_cache.c -- librequests: HTTP response cache shared between processes
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "requests.h"
+#include "internal.h"
+
+#define DISK_MAGIC   0x4351524cu    /* "LRQC" */
+#define DISK_VERSION 1
+#define DISK_SLOTS   4096
+#define DISK_SLOTS_MAX (1u << 20)  /* more than any index we lay out */
+#define DISK_PATH_MAX 4096
+
+#define SLOT_EMPTY   0
+#define SLOT_USED    1
+#define SLOT_DELETED 2
+
+/*
+ * The index file: this header followed by `slotc' slots, an open addressing
+ * table keyed by the hash of method+URL. Only touched with the lock held.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotc;
+    uint32_t pad;
+    uint64_t tick;          /* bumped on every use, orders the LRU */
+    uint64_t bytes;         /* bytes in content files */
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t revalidations;
+    uint64_t bytes_saved;
+} disk_index_t;
+
+typedef struct {
+    uint64_t hash;
+    int64_t fresh_until;    /* wall clock seconds */
+    int64_t lifetime;       /* seconds, kept for a 304 that doesn't say */
+    uint64_t last_used;     /* `tick' of the last use */
+    uint64_t size;          /* bytes of the content file */
+    uint32_t state;
+    uint32_t pad;
+} disk_slot_t;
+
+/*
+ * A content file, named after the hash in hex: this header, then the key,
+ * ETag and Last-Modified (each NULL terminated, the last two absent if their
+ * length is 0), `hdrc' NULL terminated header lines, and the body followed
+ * by a NULL so it can be served as a string. Content files are never
+ * modified, only replaced by rename(), so a mapping stays valid.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t code;
+    uint32_t key_len;
+    uint32_t etag_len;
+    uint32_t lm_len;
+    uint32_t hdrs_len;
+    int32_t hdrc;
+    uint32_t pad;
+    uint64_t body_len;
+} disk_file_t;
+
+/* a content file mapped for reading */
+typedef struct {
+    void *map;
+    size_t len;
+    const disk_file_t *hdr;
+    const char *etag;
+    const char *lm;
+    const char *hdrs;
+    const char *body;
+} disk_view_t;
+
+/*
+ * Prototypes
+ */
+static void disk_lock(requests_disk_cache_t *cache);
+static void disk_unlock(requests_disk_cache_t *cache);
+static disk_slot_t *disk_slot(requests_disk_cache_t *cache, uint64_t hash,
+                              int insert);
+static void disk_drop(requests_disk_cache_t *cache, disk_slot_t *slot);
+static int disk_evict(requests_disk_cache_t *cache, disk_slot_t *keep);
+static int disk_map(requests_disk_cache_t *cache, uint64_t hash,
+                    const char *key, disk_view_t *view);
+static int disk_write(requests_disk_cache_t *cache, req_t *req,
+                      const char *key, char *tmp, size_t *size);
+static CURLcode disk_serve(req_t *req, disk_view_t *view);
+static void disk_path(requests_disk_cache_t *cache, uint64_t hash, char *dst,
+                      size_t len);
+static int write_all(int fd, const void *buf, size_t len);
+static uint64_t hash_key(const char *key);
+
+/*
+ * requests_disk_cache_init - Opens the cache in `dir', creating the
+ * directory and its index if they don't exist yet. Any number of processes
+ * may have the same directory open.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @cache:     disk cache struct
+ * @dir:       directory holding the cache
+ * @max_bytes: upper bound on the size of the content files. Processes
+ *             sharing the directory should agree on it.
+ */
+int requests_disk_cache_init(requests_disk_cache_t *cache, const char *dir,
+                             size_t max_bytes)
+{
+    char path[DISK_PATH_MAX];
+    struct stat st;
+
+    cache->max_bytes = max_bytes;
+    cache->index = MAP_FAILED;
+    cache->index_fd = -1;
+    cache->dir = mem_strdup(dir);
+    if (cache->dir == NULL)
+        return -1;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        goto fail;
+    snprintf(path, sizeof(path), "%s/index", dir);
+    cache->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->index_fd < 0)
+        goto fail;
+
+    /* whoever gets here first lays the index out */
+    flock(cache->index_fd, LOCK_EX);
+    if (fstat(cache->index_fd, &st) < 0)
+        goto fail_locked;
+    if (st.st_size == 0) {
+        disk_index_t fresh = {
+            .magic = DISK_MAGIC, .version = DISK_VERSION,
+            .slotc = DISK_SLOTS
+        };
+        cache->index_len = sizeof(fresh) + DISK_SLOTS * sizeof(disk_slot_t);
+        if (ftruncate(cache->index_fd, cache->index_len) < 0 ||
+            pwrite(cache->index_fd, &fresh, sizeof(fresh), 0) !=
+            sizeof(fresh))
+            goto fail_locked;
+    } else {
+        disk_index_t head;
+        if (pread(cache->index_fd, &head, sizeof(head), 0) != sizeof(head) ||
+            head.magic != DISK_MAGIC || head.version != DISK_VERSION ||
+            head.slotc == 0 || (head.slotc & (head.slotc - 1)) != 0 ||
+            head.slotc > DISK_SLOTS_MAX)
+            goto fail_locked;
+        cache->index_len = sizeof(head) + head.slotc * sizeof(disk_slot_t);
+        if ((size_t) st.st_size != cache->index_len)
+            goto fail_locked;
+    }
+
+    cache->index = mmap(NULL, cache->index_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, cache->index_fd, 0);
+    if (cache->index == MAP_FAILED)
+        goto fail_locked;
+    flock(cache->index_fd, LOCK_UN);
+
+    if (pthread_mutex_init(&cache->lock, NULL) != 0)
+        goto fail;
+    return 0;
+
+fail_locked:
+    flock(cache->index_fd, LOCK_UN);
+fail:
+    if (cache->index != MAP_FAILED)
+        munmap(cache->index, cache->index_len);
+    if (cache->index_fd >= 0)
+        close(cache->index_fd);
+    mem_free(cache->dir);
+    return -1;
+}
+
+/*
+ * requests_disk_cache_close - Closes the cache. What is on disk stays for
+ * the next process. Bodies served as mapped views stay valid until their
+ * req_t moves on.
+ *
+ * @cache: disk cache struct
+ */
+void requests_disk_cache_close(requests_disk_cache_t *cache)
+{
+    munmap(cache->index, cache->index_len);
+    close(cache->index_fd);
+    mem_free(cache->dir);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+ * requests_disk_cache_stats - Takes a snapshot of the cache's counters,
+ * which cover every process using the directory.
+ *
+ * @cache: disk cache struct
+ * @stats: filled in with the counters
+ */
+void requests_disk_cache_stats(requests_disk_cache_t *cache,
+                               requests_cache_stats_t *stats)
+{
+    disk_index_t *idx = cache->index;
+
+    disk_lock(cache);
+    stats->hits = idx->hits;
+    stats->misses = idx->misses;
+    stats->revalidations = idx->revalidations;
+    stats->bytes_saved = idx->bytes_saved;
+    stats->entries = idx->entries;
+    stats->bytes = idx->bytes;
+    disk_unlock(cache);
+}
+
+/*
+ * requests_set_disk_cache - Serves subsequent requests_get() and
+ * requests_get_headers() calls on `req' through an on-disk cache, with the
+ * same freshness and revalidation rules as requests_set_cache(). On a hit,
+ * `text' points into the mapped content file rather than a copy of it,
+ * valid until the next request on `req', requests_reset() or
+ * requests_close(). Responses carrying Vary, other than on
+ * Accept-Encoding, are not stored. An in-memory cache set on the same
+ * `req' takes precedence. Passing NULL turns the disk cache off.
+ *
+ * @req:   request struct
+ * @cache: cache opened with requests_disk_cache_init(), or NULL for none
+ */
+void requests_set_disk_cache(req_t *req, requests_disk_cache_t *cache)
+{
+    req->disk_cache = cache;
+}
+
+/*
+ * disk_cache_perform - Runs a GET set up by req_prepare_get() through the
+ * request's disk cache. What has to go to the server is sent with
+ * req_perform_get(), hedge included.
+ *
+ * Returns CURLE_OK for a cache hit, otherwise what req_perform_get()
+ * returns.
+ */
+CURLcode disk_cache_perform(req_t *req, char **custom_hdrv,
+                            int custom_hdrc)
+{
+    requests_disk_cache_t *cache = req->disk_cache;
+    disk_index_t *idx = cache->index;
+    disk_slot_t *slot;
+    disk_view_t view = { .map = NULL };
+    char tmp[DISK_PATH_MAX];
+    size_t key_len = strlen(req->url) + 4;
+    CURLcode rc;
+
+    char *key = mem_alloc(key_len + 1);
+    if (key == NULL)
+        return req_perform_get(req, custom_hdrv, custom_hdrc);
+    snprintf(key, key_len + 1, "GET %s", req->url);
+    uint64_t hash = hash_key(key);
+
+    disk_lock(cache);
+    slot = disk_slot(cache, hash, 0);
+    if (slot != NULL && disk_map(cache, hash, key, &view)) {
+        /* gone or replaced by another key with the same hash */
+        disk_drop(cache, slot);
+        slot = NULL;
+    }
+
+    if (slot != NULL && slot->fresh_until > time(NULL)) {
+        idx->hits++;
+        idx->bytes_saved += view.hdr->body_len;
+        slot->last_used = ++idx->tick;
+        disk_unlock(cache);
+        mem_free(key);
+
+        /* nothing goes over the wire; drop what req_prepare_get set up */
+        if (req->slist != NULL) {
+            curl_easy_setopt(req->curlhandle, CURLOPT_HTTPHEADER, NULL);
+            curl_slist_free_all(req->slist);
+            req->slist = NULL;
+        }
+        req->wire_size = 0;
+        req->result = disk_serve(req, &view);
+        return req->result;
+    }
+
+    /* stale: ask the server whether it still holds */
+    if (slot == NULL || (view.etag == NULL && view.lm == NULL) ||
+        (view.etag != NULL &&
+         cache_add_header(req, "If-None-Match", view.etag)) ||
+        (view.lm != NULL &&
+         cache_add_header(req, "If-Modified-Since", view.lm))) {
+        if (view.map != NULL)
+            munmap(view.map, view.len);
+        view.map = NULL;
+    }
+    disk_unlock(cache);
+
+    rc = req_perform_get(req, custom_hdrv, custom_hdrc);
+
+    if (rc == CURLE_OK && view.map != NULL && req->code == 304) {
+        cache_policy_t policy;
+        cache_policy(req, &policy);
+
+        disk_lock(cache);
+        slot = disk_slot(cache, hash, 0);
+        if (slot != NULL) {
+            /* a 304 may refresh the lifetime; if it says nothing, keep it */
+            if (policy.lifetime >= 0)
+                slot->lifetime = policy.lifetime;
+            slot->fresh_until = time(NULL) + slot->lifetime;
+            slot->last_used = ++idx->tick;
+        }
+        idx->revalidations++;
+        idx->bytes_saved += view.hdr->body_len;
+        disk_unlock(cache);
+
+        mem_free(key);
+        return disk_serve(req, &view);
+    }
+
+    if (view.map != NULL)
+        munmap(view.map, view.len);
+
+    disk_lock(cache);
+    idx->misses++;
+    disk_unlock(cache);
+
+    if (rc == CURLE_OK && req->code == 200 && req->sink == NULL) {
+        cache_policy_t policy;
+        const char *vary = requests_header(req, "vary");
+        size_t size;
+
+        cache_policy(req, &policy);
+        if (policy.lifetime < 0)
+            policy.lifetime = 0;
+        if (!policy.no_store &&
+            (vary == NULL || strcasecmp(vary, "accept-encoding") == 0) &&
+            (policy.lifetime > 0 || requests_header(req, "etag") != NULL ||
+             requests_header(req, "last-modified") != NULL) &&
+            disk_write(cache, req, key, tmp, &size) == 0) {
+            char path[DISK_PATH_MAX];
+            disk_path(cache, hash, path, sizeof(path));
+
+            disk_lock(cache);
+            slot = disk_slot(cache, hash, 1);
+            if (slot == NULL || rename(tmp, path) < 0) {
+                unlink(tmp);
+            } else {
+                if (slot->state == SLOT_USED) {
+                    idx->bytes -= slot->size;
+                } else {
+                    slot->state = SLOT_USED;
+                    slot->hash = hash;
+                    idx->entries++;
+                }
+                slot->size = size;
+                slot->lifetime = policy.lifetime;
+                slot->fresh_until = time(NULL) + policy.lifetime;
+                slot->last_used = ++idx->tick;
+                idx->bytes += size;
+                while (idx->bytes > cache->max_bytes &&
+                       disk_evict(cache, slot) == 0)
+                    ;
+            }
+            disk_unlock(cache);
+        }
+    }
+
+    mem_free(key);
+    return rc;
+}
+
+/*
+ * disk_serve - Hands a mapped content file to `req' as its response. The
+ * mapping goes to `req', or is released here when a sink takes the body.
+ */
+static CURLcode disk_serve(req_t *req, disk_view_t *view)
+{
+    const disk_file_t *hdr = view->hdr;
+
+    if (req_replay(req, hdr->code, view->hdrs, hdr->hdrc, NULL, 0))
+        goto fail;
+
+    if (req->sink != NULL) {
+        if (hdr->body_len > 0 &&
+            req->sink(view->body, hdr->body_len, req->sink_data) !=
+            hdr->body_len)
+            goto fail;
+        req->size = hdr->body_len;
+        munmap(view->map, view->len);
+        return CURLE_OK;
+    }
+
+    req_map_body(req, view->map, view->len, view->body, hdr->body_len);
+    return CURLE_OK;
+
+fail:
+    munmap(view->map, view->len);
+    return CURLE_WRITE_ERROR;
+}
+
+/*
+ * disk_map - Maps the content file for `hash' and checks that it is intact
+ * and holds `key'.
+ *
+ * Returns 0 on success, or -1 if there is no usable file.
+ */
+static int disk_map(requests_disk_cache_t *cache, uint64_t hash,
+                    const char *key, disk_view_t *view)
+{
+    char path[DISK_PATH_MAX];
+    struct stat st;
+    const disk_file_t *hdr;
+    int fd;
+
+    disk_path(cache, hash, path, sizeof(path));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+
+    view->len = st.st_size;
+    view->map = mmap(NULL, view->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view->map == MAP_FAILED) {
+        view->map = NULL;
+        return -1;
+    }
+
+    hdr = view->hdr = view->map;
+    if (hdr->magic != DISK_MAGIC || hdr->version != DISK_VERSION ||
+        sizeof(*hdr) + (uint64_t) hdr->key_len + hdr->etag_len +
+        hdr->lm_len + hdr->hdrs_len + hdr->body_len + 1 != view->len)
+        goto bad;
+
+    const char *p = (const char *) (hdr + 1);
+    if (hdr->key_len != strlen(key) + 1 || memcmp(p, key, hdr->key_len) != 0)
+        goto bad;
+    p += hdr->key_len;
+    view->etag = hdr->etag_len ? p : NULL;
+    p += hdr->etag_len;
+    view->lm = hdr->lm_len ? p : NULL;
+    p += hdr->lm_len;
+    view->hdrs = p;
+    view->body = p + hdr->hdrs_len;
+    return 0;
+
+bad:
+    munmap(view->map, view->len);
+    view->map = NULL;
+    return -1;
+}
+
+/*
+ * disk_write - Writes the response on `req' to a new temporary content
+ * file, whose name is left in `tmp' for the caller to rename into place.
+ * Runs without the lock; nothing else knows the name yet.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+static int disk_write(requests_disk_cache_t *cache, req_t *req,
+                      const char *key, char *tmp, size_t *size)
+{
+    static atomic_uint seq;
+    const char *etag = requests_header(req, "etag");
+    const char *lm = requests_header(req, "last-modified");
+    disk_file_t hdr = {
+        .magic = DISK_MAGIC, .version = DISK_VERSION, .code = req->code,
+        .key_len = strlen(key) + 1,
+        .etag_len = etag != NULL ? strlen(etag) + 1 : 0,
+        .lm_len = lm != NULL ? strlen(lm) + 1 : 0,
+        .body_len = req->size
+    };
+    int first = 0, fd, failed;
+
+    /* only the final response's headers, not those of redirects */
+    for (int i = 0; i < req->resp_hdrc; i++)
+        if (strncmp(req->resp_hdrv[i], "HTTP/", 5) == 0)
+            first = i;
+    for (int i = first; i < req->resp_hdrc; i++)
+        hdr.hdrs_len += strlen(req->resp_hdrv[i]) + 1;
+    hdr.hdrc = req->resp_hdrc - first;
+
+    *size = sizeof(hdr) + hdr.key_len + hdr.etag_len + hdr.lm_len +
+            hdr.hdrs_len + hdr.body_len + 1;
+    if (*size > cache->max_bytes)
+        return -1;
+
+    snprintf(tmp, DISK_PATH_MAX, "%s/.tmp.%ld.%u", cache->dir, (long) getpid(),
+             atomic_fetch_add(&seq, 1));
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    failed = write_all(fd, &hdr, sizeof(hdr)) ||
+             write_all(fd, key, hdr.key_len) ||
+             (etag != NULL && write_all(fd, etag, hdr.etag_len)) ||
+             (lm != NULL && write_all(fd, lm, hdr.lm_len));
+    for (int i = first; i < req->resp_hdrc && !failed; i++)
+        failed = write_all(fd, req->resp_hdrv[i],
+                           strlen(req->resp_hdrv[i]) + 1);
+    /* `text' is NULL terminated, which is the trailing NULL */
+    failed = failed || write_all(fd, req->text, req->size + 1);
+
+    if (close(fd) < 0 || failed) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * disk_slot - Finds the slot for `hash'. With `insert', returns a free slot
+ * for it if it has none, evicting the least recently used entry when the
+ * table is getting full. Called with the lock held.
+ *
+ * Returns the slot, or NULL.
+ */
+static disk_slot_t *disk_slot(requests_disk_cache_t *cache, uint64_t hash,
+                              int insert)
+{
+    disk_index_t *idx = cache->index;
+    disk_slot_t *slots = (disk_slot_t *) (idx + 1);
+    disk_slot_t *free_slot = NULL;
+
+    /* keep probes short */
+    if (insert && idx->entries >= idx->slotc / 4 * 3)
+        disk_evict(cache, NULL);
+
+    for (uint32_t i = 0; i < idx->slotc; i++) {
+        disk_slot_t *slot = &slots[(hash + i) % idx->slotc];
+        if (slot->state == SLOT_USED && slot->hash == hash)
+            return slot;
+        if (slot->state != SLOT_USED && free_slot == NULL)
+            free_slot = slot;
+        if (slot->state == SLOT_EMPTY)
+            break;
+    }
+    return insert ? free_slot : NULL;
+}
+
+/*
+ * disk_drop - Forgets a slot's entry and removes its content file. The slot
+ * is left as a tombstone only while a probe has to get past it: one just
+ * before an empty slot is emptied, along with the tombstones leading up to
+ * it, so lookups don't end up scanning the whole table after enough churn.
+ */
+static void disk_drop(requests_disk_cache_t *cache, disk_slot_t *slot)
+{
+    disk_index_t *idx = cache->index;
+    disk_slot_t *slots = (disk_slot_t *) (idx + 1);
+    uint32_t i = slot - slots;
+    char path[DISK_PATH_MAX];
+
+    disk_path(cache, slot->hash, path, sizeof(path));
+    unlink(path);
+    idx->bytes -= slot->size;
+    idx->entries--;
+    slot->state = SLOT_DELETED;
+
+    if (slots[(i + 1) % idx->slotc].state != SLOT_EMPTY)
+        return;
+    for (uint32_t n = 0; n < idx->slotc && slots[i].state == SLOT_DELETED;
+         n++) {
+        slots[i].state = SLOT_EMPTY;
+        i = (i + idx->slotc - 1) % idx->slotc;
+    }
+}
+
+/*
+ * disk_evict - Drops the least recently used entry other than `keep'.
+ *
+ * Returns 0 on success, or -1 if there was nothing to drop.
+ */
+static int disk_evict(requests_disk_cache_t *cache, disk_slot_t *keep)
+{
+    disk_index_t *idx = cache->index;
+    disk_slot_t *slots = (disk_slot_t *) (idx + 1);
+    disk_slot_t *lru = NULL;
+
+    for (uint32_t i = 0; i < idx->slotc; i++)
+        if (slots[i].state == SLOT_USED && &slots[i] != keep &&
+            (lru == NULL || slots[i].last_used < lru->last_used))
+            lru = &slots[i];
+
+    if (lru == NULL)
+        return -1;
+    disk_drop(cache, lru);
+    return 0;
+}
+
+static void disk_lock(requests_disk_cache_t *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    while (flock(cache->index_fd, LOCK_EX) < 0 && errno == EINTR)
+        ;
+}
+
+static void disk_unlock(requests_disk_cache_t *cache)
+{
+    flock(cache->index_fd, LOCK_UN);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void disk_path(requests_disk_cache_t *cache, uint64_t hash, char *dst,
+                      size_t len)
+{
+    snprintf(dst, len, "%s/%016llx", cache->dir, (unsigned long long) hash);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * hash_key - 64-bit FNV-1a. Unlike the in-memory cache's, the hash names
+ * files, so it gets the wider variant.
+ */
+static uint64_t hash_key(const char *key)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
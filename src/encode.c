@@ -0,0 +1,216 @@
+/*
+ * encode.c -- librequests: application/x-www-form-urlencoded encoder
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Prototypes
+ */
+static size_t unreserved_run(const unsigned char *s, size_t len);
+static size_t encoded_len(const char *s);
+static char *encode_into(char *dst, const char *s);
+
+/*
+ * Bytes that are sent as-is; every other byte is percent-encoded, except
+ * space which becomes '+'.
+ */
+#define U(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+              ((c) >= '0' && (c) <= '9') || (c) == '-' || (c) == '.' ||   \
+              (c) == '_' || (c) == '~')
+#define U4(c) U(c), U(c + 1), U(c + 2), U(c + 3)
+#define U16(c) U4(c), U4(c + 4), U4(c + 8), U4(c + 12)
+static const unsigned char unreserved[256] = {
+    U16(0x00), U16(0x10), U16(0x20), U16(0x30),
+    U16(0x40), U16(0x50), U16(0x60), U16(0x70),
+    /* 0x80 and up are all encoded */
+};
+
+static const char hex[] = "0123456789ABCDEF";
+
+/*
+ * requests_form_encode - Encodes key/value pairs as an
+ * application/x-www-form-urlencoded body, e.g. "apple=red&banana=yellow".
+ * Keys and values are escaped; the '=' and '&' separators are not. The
+ * array should consist of keys and the corresponding value immediately after
+ * in the array.
+ *
+ * Like snprintf, at most `dst_size' bytes including the NULL terminator are
+ * written, and the full length is returned so the caller can size `dst' with
+ * a first call passing NULL and 0.
+ *
+ * Returns the length of the encoded string, not counting the NULL
+ * terminator, or -1 if `data_size' is odd.
+ *
+ * @dst:       buffer to write to, may be NULL if `dst_size' is 0
+ * @dst_size:  size of `dst' in bytes
+ * @data:      char* array as described above
+ * @data_size: length of array
+ */
+ssize_t requests_form_encode(char *dst, size_t dst_size,
+                             char **data, int data_size)
+{
+    size_t len = 0;
+
+    if (data_size % 2 != 0)
+        return -1;
+
+    for (int i = 0; i < data_size; i++)
+        len += encoded_len(data[i]) + 1; /* '=' or '&' */
+    if (len > 0)
+        len--; /* no '&' after the last pair */
+
+    if (dst_size > len) {
+        char *p = dst;
+        for (int i = 0; i < data_size; i++) {
+            if (i > 0)
+                *p++ = i % 2 ? '=' : '&';
+            p = encode_into(p, data[i]);
+        }
+        *p = '\0';
+    } else if (dst_size > 0) {
+        dst[0] = '\0';
+    }
+
+    return len;
+}
+
+/*
+ * requests_url_encode - Url encoding function. Takes as input an array of
+ * char strings and the size of the array. The array should consist of keys
+ * and the corresponding value immediately after in the array. There must be
+ * an even number of array elements (one value for every key). See
+ * requests_form_encode() for the format, or to encode into a buffer of your
+ * own.
+ *
+ * Returns pointer to url encoded string if successful, or NULL if
+ * unsuccessful. Returned pointer must be free'd with requests_free()
+ *
+ * @req:  request struct (unused, kept for compatibility)
+ * @data:      char* array as described above
+ * @data-size: length of array
+ */
+char *requests_url_encode(req_t *req, char **data, int data_size)
+{
+    ssize_t len = requests_form_encode(NULL, 0, data, data_size);
+    if (len < 0)
+        return NULL;
+
+    char *encoded = mem_alloc(len + 1);
+    if (encoded == NULL)
+        return NULL;
+
+    requests_form_encode(encoded, len + 1, data, data_size);
+    return encoded;
+}
+
+/*
+ * unreserved_run - Returns how many bytes at the start of `s' need no
+ * escaping. Looks at 16 bytes at a time where SSE2 is available.
+ */
+static size_t unreserved_run(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* signed compares are fine: bytes >= 0x80 are negative and fall
+       outside every range below */
+    const __m128i lo_a = _mm_set1_epi8('a' - 1), hi_a = _mm_set1_epi8('z' + 1);
+    const __m128i lo_A = _mm_set1_epi8('A' - 1), hi_A = _mm_set1_epi8('Z' + 1);
+    const __m128i lo_0 = _mm_set1_epi8('0' - 1), hi_0 = _mm_set1_epi8('9' + 1);
+    const __m128i dash = _mm_set1_epi8('-'), dot = _mm_set1_epi8('.');
+    const __m128i under = _mm_set1_epi8('_'), tilde = _mm_set1_epi8('~');
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo_a),
+                                   _mm_cmplt_epi8(v, hi_a));
+        ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(v, lo_A),
+                                            _mm_cmplt_epi8(v, hi_A)));
+        ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(v, lo_0),
+                                            _mm_cmplt_epi8(v, hi_0)));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, dash));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, dot));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, under));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, tilde));
+
+        unsigned mask = _mm_movemask_epi8(ok);
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+
+    while (i < len && unreserved[s[i]])
+        i++;
+
+    return i;
+}
+
+/*
+ * encoded_len - Returns the length of `s' once escaped.
+ */
+static size_t encoded_len(const char *s)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    size_t left = strlen(s);
+    size_t len = 0;
+
+    while (left > 0) {
+        size_t run = unreserved_run(p, left);
+        len += run;
+        p += run;
+        left -= run;
+
+        /* escape bytes until the next unreserved one */
+        while (left > 0 && !unreserved[*p]) {
+            len += *p == ' ' ? 1 : 3;
+            p++;
+            left--;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * encode_into - Writes `s' escaped to `dst', which must be large enough, and
+ * returns a pointer just past the written bytes. Not NULL terminated.
+ */
+static char *encode_into(char *dst, const char *s)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    size_t left = strlen(s);
+
+    while (left > 0) {
+        size_t run = unreserved_run(p, left);
+        memcpy(dst, p, run);
+        dst += run;
+        p += run;
+        left -= run;
+
+        while (left > 0 && !unreserved[*p]) {
+            if (*p == ' ') {
+                *dst++ = '+';
+            } else {
+                *dst++ = '%';
+                *dst++ = hex[*p >> 4];
+                *dst++ = hex[*p & 0xf];
+            }
+            p++;
+            left--;
+        }
+    }
+
+    return dst;
+}
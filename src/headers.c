@@ -0,0 +1,343 @@
+/*
+ * headers.c -- librequests: parsed and indexed response headers
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <ctype.h>
+#include "requests.h"
+#include "internal.h"
+
+#define HDR_MIN_SLOTS 32
+#define HDR_MIN_HEADERS 16
+
+/*
+ * Prototypes
+ */
+static int parse_status(req_t *req, const char *line);
+static unsigned hash_name(const char *name, size_t len);
+static int lookup(req_t *req, const char *name, size_t len, unsigned hash,
+                  int **slot);
+static int grow_slots(requests_hdr_index_t *index);
+
+/*
+ * requests_header - Looks up a header of the last response by name, ignoring
+ * case.
+ *
+ * Returns the value with surrounding whitespace removed, or NULL if the
+ * response had no such header. If the header appeared more than once, the
+ * first value is returned; see requests_header_first() for the others. The
+ * string is valid until the next request on `req'.
+ *
+ * @req:  request struct
+ * @name: header name, e.g. "content-type"
+ */
+const char *requests_header(req_t *req, const char *name)
+{
+    return requests_header_value(req, requests_header_first(req, name));
+}
+
+/*
+ * requests_header_first - Finds the first header of the last response with
+ * the given name, ignoring case. Together with requests_header_next() and
+ * requests_header_value() this walks every value of a repeated header such
+ * as Set-Cookie:
+ *
+ *     for (int i = requests_header_first(req, "set-cookie"); i >= 0;
+ *          i = requests_header_next(req, i))
+ *         puts(requests_header_value(req, i));
+ *
+ * Returns a header index, or -1 if there is no such header.
+ *
+ * @req:  request struct
+ * @name: header name
+ */
+int requests_header_first(req_t *req, const char *name)
+{
+    size_t len = strlen(name);
+    int *slot;
+
+    return lookup(req, name, len, hash_name(name, len), &slot);
+}
+
+/*
+ * requests_header_next - Returns the index of the next header with the same
+ * name as header `i', or -1 if there is none.
+ */
+int requests_header_next(req_t *req, int i)
+{
+    if (i < 0 || i >= req->resp_index.hdrc)
+        return -1;
+
+    return req->resp_index.hdrv[i].next;
+}
+
+/*
+ * requests_header_value - Returns the value of header `i', or NULL if `i'
+ * is not a valid header index.
+ */
+const char *requests_header_value(req_t *req, int i)
+{
+    if (i < 0 || i >= req->resp_index.hdrc)
+        return NULL;
+
+    return req->resp_arena.buf + req->resp_index.hdrv[i].value;
+}
+
+/*
+ * requests_http_version - Returns the HTTP version of the last response as
+ * major * 10 + minor, e.g. 11 for HTTP/1.1 or 20 for HTTP/2, or 0 if no
+ * response was received.
+ */
+int requests_http_version(req_t *req)
+{
+    return req->resp_index.version;
+}
+
+/*
+ * requests_reason - Returns the reason phrase of the last response's status
+ * line, e.g. "Not Found", or NULL if no response was received. HTTP/2
+ * responses have an empty reason phrase.
+ */
+const char *requests_reason(req_t *req)
+{
+    if (req->resp_index.version == 0)
+        return NULL;
+
+    return req->resp_arena.buf + req->resp_index.reason;
+}
+
+/*
+ * hdr_index_init - Initializes an empty index. Nothing is allocated until
+ * the first header is added. `mem' counts its memory, if not NULL.
+ */
+void hdr_index_init(requests_hdr_index_t *index, requests_mem_t *mem)
+{
+    index->hdrv = NULL;
+    index->hdrc = 0;
+    index->hdrcap = 0;
+    index->slots = NULL;
+    index->slotc = 0;
+    index->version = 0;
+    index->reason = 0;
+    index->mem = mem;
+}
+
+/*
+ * hdr_index_add - Parses response header line `line' of `req' and adds it to
+ * the index. A status line starts a new response, so it clears the headers
+ * of any earlier one (a redirect or a 100 Continue). Lines without a colon
+ * are skipped.
+ *
+ * Returns 0 on success and -1 on memory error.
+ *
+ * @req:  request struct
+ * @line: index of the line in resp_hdrv
+ */
+int hdr_index_add(req_t *req, int line)
+{
+    requests_hdr_index_t *index = &req->resp_index;
+    const char *text = req->resp_hdrv[line];
+    const char *colon, *value, *end;
+    requests_hdr_t *hdr;
+    size_t name_len, value_off;
+    unsigned hash;
+    int first, *slot;
+
+    if (strncmp(text, "HTTP/", 5) == 0)
+        return parse_status(req, text);
+
+    colon = strchr(text, ':');
+    if (colon == NULL || colon == text)
+        return 0;
+    name_len = colon - text;
+
+    value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+        value++;
+    end = value + strlen(value);
+    while (end > value && isspace((unsigned char) end[-1]))
+        end--;
+
+    if (index->hdrc == index->hdrcap) {
+        int cap = index->hdrcap ? index->hdrcap * 2 : HDR_MIN_HEADERS;
+        requests_hdr_t *hdrv = mem_grow(index->mem, index->hdrv,
+                                        index->hdrcap * sizeof(*hdrv),
+                                        cap * sizeof(*hdrv));
+        if (hdrv == NULL)
+            return -1;
+        index->hdrv = hdrv;
+        index->hdrcap = cap;
+    }
+    /* keep the table at most half full, counting every header as a name */
+    if ((index->hdrc + 1) * 2 > index->slotc && grow_slots(index))
+        return -1;
+
+    /* `text' may move while the value is copied, so look it up after */
+    if (arena_push(&req->resp_arena, req->resp_hdrv, req->resp_hdrc,
+                   value, end - value, &value_off))
+        return -1;
+    text = req->resp_hdrv[line];
+
+    hash = hash_name(text, name_len);
+    hdr = &index->hdrv[index->hdrc];
+    hdr->name = req->resp_arena.offv[line];
+    hdr->name_len = name_len;
+    hdr->value = value_off;
+    hdr->hash = hash;
+    hdr->next = -1;
+    hdr->last = -1;
+
+    first = lookup(req, text, name_len, hash, &slot);
+    if (first < 0) {
+        *slot = index->hdrc;
+        hdr->last = index->hdrc;
+    } else {
+        index->hdrv[index->hdrv[first].last].next = index->hdrc;
+        index->hdrv[first].last = index->hdrc;
+    }
+
+    index->hdrc++;
+    return 0;
+}
+
+/*
+ * hdr_index_reset - Forgets every header in the index, keeping its memory.
+ */
+void hdr_index_reset(requests_hdr_index_t *index)
+{
+    index->hdrc = 0;
+    index->version = 0;
+    if (index->slotc > 0)
+        memset(index->slots, 0xff, index->slotc * sizeof(int));
+}
+
+/*
+ * hdr_index_free - Frees the index.
+ */
+void hdr_index_free(requests_hdr_index_t *index)
+{
+    mem_release(index->mem, index->hdrv,
+                index->hdrcap * sizeof(*index->hdrv));
+    mem_release(index->mem, index->slots, index->slotc * sizeof(int));
+    hdr_index_init(index, index->mem);
+}
+
+/*
+ * parse_status - Parses a status line such as "HTTP/1.1 404 Not Found" into
+ * the version and reason phrase, and starts a new set of headers.
+ */
+static int parse_status(req_t *req, const char *line)
+{
+    requests_hdr_index_t *index = &req->resp_index;
+    const char *p = line + 5;
+    const char *end;
+    int version = 0;
+
+    if (isdigit((unsigned char) *p)) {
+        version = (*p++ - '0') * 10;
+        if (*p == '.' && isdigit((unsigned char) p[1])) {
+            version += p[1] - '0';
+            p += 2;
+        }
+    }
+
+    /* skip the code, which curl already reports, to the reason phrase */
+    while (*p == ' ')
+        p++;
+    while (isdigit((unsigned char) *p))
+        p++;
+    while (*p == ' ')
+        p++;
+    end = p + strlen(p);
+    while (end > p && isspace((unsigned char) end[-1]))
+        end--;
+
+    hdr_index_reset(index);
+    if (arena_push(&req->resp_arena, req->resp_hdrv, req->resp_hdrc,
+                   p, end - p, &index->reason))
+        return -1;
+    index->version = version;
+    return 0;
+}
+
+/*
+ * hash_name - FNV-1a over the lower-cased bytes of a header name.
+ */
+static unsigned hash_name(const char *name, size_t len)
+{
+    unsigned hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) tolower((unsigned char) name[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * lookup - Probes the table for a header name.
+ *
+ * Returns the index of the first header with that name, or -1 if there is
+ * none, in which case `slot' points at the empty slot where it belongs.
+ */
+static int lookup(req_t *req, const char *name, size_t len, unsigned hash,
+                  int **slot)
+{
+    requests_hdr_index_t *index = &req->resp_index;
+    unsigned mask;
+
+    *slot = NULL;
+    if (index->slotc == 0)
+        return -1;
+
+    mask = index->slotc - 1;
+    for (unsigned i = hash & mask; ; i = (i + 1) & mask) {
+        int h = index->slots[i];
+        if (h < 0) {
+            *slot = &index->slots[i];
+            return -1;
+        }
+
+        requests_hdr_t *hdr = &index->hdrv[h];
+        if (hdr->hash == hash && hdr->name_len == len &&
+            strncasecmp(req->resp_arena.buf + hdr->name, name, len) == 0)
+            return h;
+    }
+}
+
+/*
+ * grow_slots - Doubles the hash table and reinserts the first header of
+ * every name.
+ */
+static int grow_slots(requests_hdr_index_t *index)
+{
+    int slotc = index->slotc ? index->slotc * 2 : HDR_MIN_SLOTS;
+    unsigned mask = slotc - 1;
+    int *slots = mem_grow(index->mem, NULL, 0, slotc * sizeof(int));
+
+    if (slots == NULL)
+        return -1;
+    memset(slots, 0xff, slotc * sizeof(int));
+
+    for (int h = 0; h < index->hdrc; h++) {
+        requests_hdr_t *hdr = &index->hdrv[h];
+        if (hdr->last < 0)
+            continue; /* not the first of its name */
+
+        unsigned i = hdr->hash & mask;
+        while (slots[i] >= 0)
+            i = (i + 1) & mask;
+        slots[i] = h;
+    }
+
+    mem_release(index->mem, index->slots, index->slotc * sizeof(int));
+    index->slots = slots;
+    index->slotc = slotc;
+    return 0;
+}
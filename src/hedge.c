@@ -0,0 +1,325 @@
+/*
+ * hedge.c -- librequests: hedged GETs, racing a late duplicate against a
+ * slow request
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <time.h>
+#include "requests.h"
+#include "internal.h"
+
+/* the adaptive delay needs this many samples before hedging starts */
+#define HEDGE_MIN_SAMPLES 20
+
+/*
+ * Prototypes
+ */
+static long hedge_delay(requests_hedge_t *hedge);
+static void hedge_record(requests_hedge_t *hedge, long latency_ms,
+                         int issued, int won);
+static int hedge_start(req_t *req, char **custom_hdrv, int custom_hdrc);
+static int hedge_adopt(req_t *req, req_t *spare);
+static int cmp_long(const void *a, const void *b);
+static long long now_ms(void);
+
+/*
+ * requests_hedge_init - Sets up hedging for GETs. A hedged GET that hasn't
+ * completed after the hedge delay is sent a second time on another handle,
+ * and whichever copy answers first is the response.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @hedge:    hedge struct
+ * @delay_ms: how long to wait before sending the duplicate, or 0 to use
+ *            the 95th percentile of recent latencies, which hedges about
+ *            one request in twenty. Adaptive hedging starts once enough
+ *            latencies have been seen.
+ */
+int requests_hedge_init(requests_hedge_t *hedge, long delay_ms)
+{
+    if (delay_ms < 0)
+        return -1;
+
+    hedge->delay_ms = delay_ms;
+    hedge->samplec = 0;
+    hedge->samplei = 0;
+    hedge->requests = 0;
+    hedge->issued = 0;
+    hedge->won = 0;
+    return pthread_mutex_init(&hedge->lock, NULL) == 0 ? 0 : -1;
+}
+
+/*
+ * requests_hedge_close - Releases the hedge struct. No req_t may still be
+ * using it.
+ *
+ * @hedge: hedge struct
+ */
+void requests_hedge_close(requests_hedge_t *hedge)
+{
+    pthread_mutex_destroy(&hedge->lock);
+}
+
+/*
+ * requests_hedge_stats - Takes a snapshot of the hedging counters.
+ *
+ * @hedge: hedge struct
+ * @stats: filled in with the counters
+ */
+void requests_hedge_stats(requests_hedge_t *hedge,
+                          requests_hedge_stats_t *stats)
+{
+    stats->delay_ms = hedge_delay(hedge);
+    pthread_mutex_lock(&hedge->lock);
+    stats->requests = hedge->requests;
+    stats->issued = hedge->issued;
+    stats->won = hedge->won;
+    pthread_mutex_unlock(&hedge->lock);
+}
+
+/*
+ * requests_set_hedge - Hedges subsequent requests_get() and
+ * requests_get_headers() calls on `req'. Only GETs are hedged, since they
+ * are safe to send twice. The duplicate goes out on a second handle that
+ * `req' keeps for the purpose, with the same headers, HTTP version and
+ * compression; the copy that loses is cancelled. A copy that fails only
+ * wins if the other one fails too. The response lands in `req' as usual.
+ *
+ * Hedged GETs are not retried, and a `req' with a sink is not hedged,
+ * since the sink would see both bodies. Caches set on `req' are consulted
+ * first: a hit isn't hedged, but a miss or a revalidation is, the duplicate
+ * of a revalidation asking for the whole response. Passing NULL turns
+ * hedging off.
+ *
+ * @req:   request struct
+ * @hedge: hedge struct set up with requests_hedge_init(), or NULL
+ */
+void requests_set_hedge(req_t *req, requests_hedge_t *hedge)
+{
+    req->hedge = hedge;
+}
+
+/*
+ * hedge_perform - Runs a GET set up by req_prepare_get() on the calling
+ * thread, sending a duplicate once the hedge delay passes.
+ *
+ * Returns the CURLcode of the winning transfer.
+ */
+CURLcode hedge_perform(req_t *req, char **custom_hdrv, int custom_hdrc)
+{
+    requests_hedge_t *hedge = req->hedge;
+    req_t *winner = NULL;
+    CURLcode rc = CURLE_OK, spare_rc = CURLE_OK;
+    int running = 0, issued = 0, failed = 0;
+    long long start, deadline;
+    long delay;
+
+    if (req->sink != NULL)
+        return req_perform(req);
+    if (req->hedge_multi == NULL) {
+        req->hedge_multi = curl_multi_init();
+        if (req->hedge_multi == NULL)
+            return req_perform(req);
+    }
+
+    delay = hedge_delay(hedge);
+    start = now_ms();
+    deadline = delay < 0 ? -1 : start + delay;
+    if (curl_multi_add_handle(req->hedge_multi, req->curlhandle) != CURLM_OK)
+        return req_perform(req);
+
+    while (winner == NULL) {
+        CURLMsg *msg;
+        int left;
+
+        if (curl_multi_perform(req->hedge_multi, &running) != CURLM_OK) {
+            rc = CURLE_OUT_OF_MEMORY;
+            winner = req;
+            break;
+        }
+
+        while ((msg = curl_multi_info_read(req->hedge_multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            req_t *done = msg->easy_handle == req->curlhandle ?
+                          req : req->hedge_req;
+            if (done == req)
+                rc = msg->data.result;
+            else
+                spare_rc = msg->data.result;
+
+            /* a failure only wins if there's nothing left to wait for */
+            if (msg->data.result == CURLE_OK || !issued || failed) {
+                winner = done;
+                break;
+            }
+            failed = 1;
+        }
+        if (winner != NULL)
+            break;
+
+        if (!issued && deadline >= 0 && now_ms() >= deadline) {
+            if (hedge_start(req, custom_hdrv, custom_hdrc) == 0)
+                issued = 1;
+            deadline = -1;
+            continue;
+        }
+
+        long long wait = deadline < 0 ? 1000 : deadline - now_ms();
+        if (wait > 0)
+            curl_multi_poll(req->hedge_multi, NULL, 0, (int) wait, NULL);
+    }
+
+    /* cancels whichever copy is still running */
+    curl_multi_remove_handle(req->hedge_multi, req->curlhandle);
+    if (issued)
+        curl_multi_remove_handle(req->hedge_multi,
+                                 req->hedge_req->curlhandle);
+
+    if (winner == req) {
+        req_finish(req, rc);
+    } else {
+        req_t *spare = winner;
+        requests_latency_t *latency = req->latency;
+        req_finish(spare, spare_rc);
+        /* the cancelled copy's timings would only skew the histograms */
+        req->latency = NULL;
+        req_finish(req, spare_rc);
+        req->latency = latency;
+        if (hedge_adopt(req, spare))
+            spare_rc = CURLE_OUT_OF_MEMORY;
+        req->result = rc = spare_rc;
+    }
+
+    hedge_record(hedge, (long) (now_ms() - start), issued, winner != req);
+    return rc;
+}
+
+/*
+ * hedge_start - Sets up the duplicate of the GET on `req' on the spare
+ * handle, creating that first if need be, and adds it to the race.
+ *
+ * Returns 0 on success, or -1 on failure, in which case the GET simply
+ * goes unhedged.
+ */
+static int hedge_start(req_t *req, char **custom_hdrv, int custom_hdrc)
+{
+    req_t *spare = req->hedge_req;
+
+    if (spare == NULL) {
+        spare = mem_alloc(sizeof(*spare));
+        if (spare == NULL || requests_init_shared(spare, req->share)) {
+            mem_free(spare);
+            return -1;
+        }
+        req->hedge_req = spare;
+    }
+
+    requests_reset(spare);
+    spare->http2 = req->http2;
+    spare->compression = req->compression;
+    spare->latency = req->latency;
+    if (req_prepare_get(spare, req->url, custom_hdrv, custom_hdrc) !=
+        CURLE_OK ||
+        curl_multi_add_handle(req->hedge_multi, spare->curlhandle) !=
+        CURLM_OK) {
+        req_finish(spare, CURLE_OUT_OF_MEMORY);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * hedge_adopt - Copies the response the spare handle won with into `req'.
+ *
+ * Returns 0 on success, or -1 on memory error.
+ */
+static int hedge_adopt(req_t *req, req_t *spare)
+{
+    size_t len = 0;
+    char *hdrs, *p;
+    int rc;
+
+    /* req_replay() wants the header lines back to back */
+    for (int i = 0; i < spare->resp_hdrc; i++)
+        len += strlen(spare->resp_hdrv[i]) + 1;
+    hdrs = p = mem_alloc(len + 1);
+    if (hdrs == NULL)
+        return -1;
+    for (int i = 0; i < spare->resp_hdrc; i++) {
+        size_t n = strlen(spare->resp_hdrv[i]) + 1;
+        memcpy(p, spare->resp_hdrv[i], n);
+        p += n;
+    }
+
+    rc = req_replay(req, spare->code, hdrs, spare->resp_hdrc, spare->text,
+                    spare->size);
+    req->wire_size = spare->wire_size;
+    req->timing = spare->timing;
+    mem_free(hdrs);
+    return rc;
+}
+
+/*
+ * hedge_delay - The current hedge delay: the fixed one, or the 95th
+ * percentile of the latency samples.
+ *
+ * Returns the delay in ms, or -1 if there aren't enough samples yet.
+ */
+static long hedge_delay(requests_hedge_t *hedge)
+{
+    long sorted[REQUESTS_HEDGE_SAMPLES];
+    int n;
+
+    if (hedge->delay_ms > 0)
+        return hedge->delay_ms;
+
+    pthread_mutex_lock(&hedge->lock);
+    n = hedge->samplec;
+    memcpy(sorted, hedge->samples, n * sizeof(sorted[0]));
+    pthread_mutex_unlock(&hedge->lock);
+
+    if (n < HEDGE_MIN_SAMPLES)
+        return -1;
+    qsort(sorted, n, sizeof(sorted[0]), cmp_long);
+    return sorted[n * 95 / 100];
+}
+
+/*
+ * hedge_record - Counts a finished hedged GET and adds its latency to the
+ * samples.
+ */
+static void hedge_record(requests_hedge_t *hedge, long latency_ms,
+                         int issued, int won)
+{
+    pthread_mutex_lock(&hedge->lock);
+    hedge->requests++;
+    hedge->issued += issued;
+    hedge->won += won;
+    hedge->samples[hedge->samplei] = latency_ms;
+    hedge->samplei = (hedge->samplei + 1) % REQUESTS_HEDGE_SAMPLES;
+    if (hedge->samplec < REQUESTS_HEDGE_SAMPLES)
+        hedge->samplec++;
+    pthread_mutex_unlock(&hedge->lock);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * now_ms - Milliseconds on the monotonic clock.
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
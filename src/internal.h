@@ -0,0 +1,80 @@
+#ifndef REQUESTS_INTERNAL_H
+#define REQUESTS_INTERNAL_H
+
+/*
+ * internal.h -- librequests: declarations shared between the library's
+ * translation units. Nothing in here is part of the public API.
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+
+CURLcode req_prepare_get(req_t *req, char *url,
+                         char **custom_hdrv, int custom_hdrc);
+CURLcode req_prepare_pt(req_t *req, char *url, char *data,
+                        char **custom_hdrv, int custom_hdrc, int put_flag);
+CURLcode req_prepare_data(req_t *req, char *url, const char *data,
+                          size_t len, char **custom_hdrv, int custom_hdrc,
+                          int put_flag);
+CURLcode req_prepare_method(req_t *req, char **custom_hdrv, int custom_hdrc,
+                            int put_flag);
+void req_prepare_prepared(req_t *req, requests_prepared_t *prep);
+void req_finish(req_t *req, CURLcode rc);
+CURLcode req_perform(req_t *req);
+CURLcode req_perform_get(req_t *req, char **custom_hdrv, int custom_hdrc);
+void req_common_opt(req_t *req);
+void req_clear(req_t *req);
+void req_rewind(req_t *req);
+int req_gzip_body(req_t *req, const char *data, size_t len);
+int req_replay(req_t *req, long code, const char *hdrs, int hdrc,
+               const char *body, size_t len);
+void req_map_body(req_t *req, void *map, size_t map_len, const char *body,
+                  size_t len);
+void req_unmap(req_t *req);
+void req_clear_response(req_t *req);
+
+void upload_clear(req_t *req);
+int retry_wait(req_t *req, CURLcode rc);
+CURLcode hedge_perform(req_t *req, char **custom_hdrv, int custom_hdrc);
+void timing_collect(req_t *req);
+
+/* what a response says about caching it, see cache_policy() */
+typedef struct {
+    int no_store;
+    long lifetime;   /* seconds, -1 if the response doesn't say */
+} cache_policy_t;
+
+CURLcode cache_perform(req_t *req, char **custom_hdrv, int custom_hdrc);
+void cache_policy(req_t *req, cache_policy_t *policy);
+int cache_add_header(req_t *req, const char *name, const char *value);
+CURLcode disk_cache_perform(req_t *req, char **custom_hdrv,
+                            int custom_hdrc);
+
+void *mem_alloc(size_t size);
+void *mem_calloc(size_t nmemb, size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+char *mem_strdup(const char *str);
+char *mem_strndup(const char *str, size_t len);
+void *mem_grow(requests_mem_t *mem, void *ptr, size_t old_size, size_t size);
+void mem_release(requests_mem_t *mem, void *ptr, size_t size);
+
+void arena_init(requests_arena_t *arena, requests_mem_t *mem);
+int arena_append(requests_arena_t *arena, char ***hdrv, int *hdrc,
+                 const char *line, size_t len);
+int arena_push(requests_arena_t *arena, char **hdrv, int hdrc,
+               const char *str, size_t len, size_t *off);
+void arena_reset(requests_arena_t *arena, int *hdrc);
+void arena_free(requests_arena_t *arena, char **hdrv);
+
+void hdr_index_init(requests_hdr_index_t *index, requests_mem_t *mem);
+int hdr_index_add(req_t *req, int line);
+void hdr_index_reset(requests_hdr_index_t *index);
+void hdr_index_free(requests_hdr_index_t *index);
+
+#endif
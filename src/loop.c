@@ -0,0 +1,415 @@
+/*
+ * loop.c -- librequests: non-blocking requests driven by an event loop
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include "requests.h"
+#include "internal.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#define LOOP_MAX_EVENTS 256
+
+/*
+ * Prototypes
+ */
+static CURLcode loop_add(requests_loop_t *loop, req_t *req,
+                         requests_done_fn done, void *userdata);
+static void loop_drain(requests_loop_t *loop);
+static int socket_cb(CURL *curl, curl_socket_t fd, int what, void *userp,
+                     void *socketp);
+static int timer_cb(CURLM *multi, long timeout_ms, void *userp);
+static long long now_ms(void);
+
+/*
+ * requests_loop_init - Initializes an event loop with no requests.
+ *
+ * To drive it from your own event loop, pass `socket_fn' and `timer_fn'.
+ * `socket_fn' is told to start watching `fd' for CURL_POLL_IN, CURL_POLL_OUT
+ * or CURL_POLL_INOUT, or to stop watching it on CURL_POLL_REMOVE; report
+ * readiness with requests_loop_socket_action(). `timer_fn' asks for a single
+ * timeout `timeout_ms' from now, replacing any earlier one, or for none if
+ * it is -1; when it expires call requests_loop_socket_action() with
+ * CURL_SOCKET_TIMEOUT. Neither callback may call back into the loop.
+ *
+ * To use the built-in epoll driver instead (Linux only), pass NULL for both
+ * and call requests_loop_run() or requests_loop_run_once().
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @loop:      reference to requests_loop_t to be initialized
+ * @socket_fn: socket callback, or NULL for the built-in driver
+ * @timer_fn:  timer callback, or NULL for the built-in driver
+ * @userdata:  passed through to both callbacks untouched
+ */
+int requests_loop_init(requests_loop_t *loop, requests_socket_fn socket_fn,
+                       requests_timer_fn timer_fn, void *userdata)
+{
+    if ((socket_fn == NULL) != (timer_fn == NULL))
+        return -1;
+
+    loop->socket_fn = socket_fn;
+    loop->timer_fn = timer_fn;
+    loop->userdata = userdata;
+    loop->running = 0;
+    loop->epfd = -1;
+    loop->deadline = -1;
+
+    if (socket_fn == NULL) {
+#ifdef __linux__
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0)
+            return -1;
+#else
+        return -1;
+#endif
+    }
+
+    loop->multihandle = curl_multi_init();
+    if (loop->multihandle == NULL)
+        goto fail;
+
+    curl_multi_setopt(loop->multihandle, CURLMOPT_SOCKETFUNCTION, socket_cb);
+    curl_multi_setopt(loop->multihandle, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->multihandle, CURLMOPT_TIMERFUNCTION, timer_cb);
+    curl_multi_setopt(loop->multihandle, CURLMOPT_TIMERDATA, loop);
+
+    return 0;
+
+fail:
+#ifdef __linux__
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+#endif
+    return -1;
+}
+
+/*
+ * requests_loop_close - Abandons any requests still in flight and frees the
+ * loop. Their done callbacks are not called. The req_t structs themselves
+ * are owned by the caller and still need requests_close().
+ *
+ * @loop: loop struct
+ */
+void requests_loop_close(requests_loop_t *loop)
+{
+    /* detaches whatever easy handles are still in flight */
+    curl_multi_cleanup(loop->multihandle);
+#ifdef __linux__
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+#endif
+}
+
+/*
+ * requests_loop_set_max_streams - Caps the number of requests multiplexed
+ * over a single HTTP/2 connection, as requests_batch_set_max_streams() does
+ * for a batch.
+ *
+ * @loop: loop struct
+ * @max:  maximum number of concurrent streams per connection, 1 to 2^31-1
+ */
+void requests_loop_set_max_streams(requests_loop_t *loop, long max)
+{
+    curl_multi_setopt(loop->multihandle, CURLMOPT_MAX_CONCURRENT_STREAMS, max);
+}
+
+/*
+ * requests_loop_get - Starts a GET request and returns at once. `done' is
+ * called from requests_loop_socket_action() or the built-in driver once it
+ * has finished; until then `req' must be left alone.
+ *
+ * Returns CURLE_OK on success. On failure the request is not started and
+ * `done' is never called.
+ *
+ * @loop:     loop struct
+ * @req:      request struct, initialized with requests_init()
+ * @url:      url to send request to
+ * @done:     completion callback, may be NULL
+ * @userdata: passed through to `done' untouched
+ */
+CURLcode requests_loop_get(requests_loop_t *loop, req_t *req, char *url,
+                           requests_done_fn done, void *userdata)
+{
+    CURLcode rc = req_prepare_get(req, url, NULL, 0);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return loop_add(loop, req, done, userdata);
+}
+
+CURLcode requests_loop_post(requests_loop_t *loop, req_t *req, char *url,
+                            char *data, requests_done_fn done,
+                            void *userdata)
+{
+    CURLcode rc = req_prepare_pt(req, url, data, NULL, 0, 0);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return loop_add(loop, req, done, userdata);
+}
+
+CURLcode requests_loop_put(requests_loop_t *loop, req_t *req, char *url,
+                           char *data, requests_done_fn done, void *userdata)
+{
+    CURLcode rc = req_prepare_pt(req, url, data, NULL, 0, 1);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return loop_add(loop, req, done, userdata);
+}
+
+/*
+ * requests_loop_prepared - Starts a prepared request, which is also the way
+ * to send custom headers through the loop. Clears the previous response on
+ * `req' first, like requests_prepared_perform().
+ */
+CURLcode requests_loop_prepared(requests_loop_t *loop, req_t *req,
+                                requests_prepared_t *prep,
+                                requests_done_fn done, void *userdata)
+{
+    req_prepare_prepared(req, prep);
+    return loop_add(loop, req, done, userdata);
+}
+
+/*
+ * requests_loop_socket_action - Lets the loop make progress after `fd'
+ * became ready, or after the timeout requested through the timer callback
+ * expired if `fd' is CURL_SOCKET_TIMEOUT. Calls the done callback of every
+ * request that finished as a result.
+ *
+ * Returns CURLM_OK on success, or the error from the multi interface.
+ *
+ * @loop:   loop struct
+ * @fd:     the ready socket, or CURL_SOCKET_TIMEOUT
+ * @events: CURL_CSELECT_IN, CURL_CSELECT_OUT and/or CURL_CSELECT_ERR, or 0
+ *          if unknown
+ */
+CURLMcode requests_loop_socket_action(requests_loop_t *loop,
+                                      curl_socket_t fd, int events)
+{
+    CURLMcode mc = curl_multi_socket_action(loop->multihandle, fd, events,
+                                            &loop->running);
+    loop_drain(loop);
+    return mc;
+}
+
+/*
+ * requests_loop_running - Returns the number of requests still in flight.
+ */
+int requests_loop_running(requests_loop_t *loop)
+{
+    return loop->running;
+}
+
+/*
+ * requests_loop_fd - Returns the built-in driver's epoll descriptor, which
+ * becomes readable whenever one of the loop's sockets is ready. Watching it
+ * from another event loop and calling requests_loop_run_once() with a zero
+ * wait nests the driver inside that loop. Returns -1 when the loop uses
+ * caller-supplied callbacks.
+ *
+ * Note that timeouts are not visible through this descriptor; call
+ * requests_loop_run_once() at least every few hundred milliseconds.
+ */
+int requests_loop_fd(requests_loop_t *loop)
+{
+    return loop->epfd;
+}
+
+/*
+ * requests_loop_run_once - Waits up to `max_wait_ms' for sockets or the
+ * pending timeout with the built-in driver and processes whatever is ready.
+ *
+ * Returns CURLM_OK on success, CURLM_BAD_HANDLE if the loop doesn't use the
+ * built-in driver, CURLM_INTERNAL_ERROR if epoll fails, or the error from
+ * the multi interface.
+ *
+ * @loop:        loop struct
+ * @max_wait_ms: longest time to block, 0 to only poll, -1 for no limit
+ */
+CURLMcode requests_loop_run_once(requests_loop_t *loop, long max_wait_ms)
+{
+#ifdef __linux__
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    long long wait = max_wait_ms;
+    CURLMcode mc = CURLM_OK;
+    int n;
+
+    if (loop->epfd < 0)
+        return CURLM_BAD_HANDLE;
+
+    if (loop->deadline >= 0) {
+        long long left = loop->deadline - now_ms();
+        if (left < 0)
+            left = 0;
+        if (wait < 0 || left < wait)
+            wait = left;
+    }
+
+    n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, (int) wait);
+    if (n < 0)
+        return errno == EINTR ? CURLM_OK : CURLM_INTERNAL_ERROR;
+
+    for (int i = 0; i < n && mc == CURLM_OK; i++) {
+        int ev = 0;
+        if (events[i].events & EPOLLIN)
+            ev |= CURL_CSELECT_IN;
+        if (events[i].events & EPOLLOUT)
+            ev |= CURL_CSELECT_OUT;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            ev |= CURL_CSELECT_ERR;
+        mc = requests_loop_socket_action(loop, events[i].data.fd, ev);
+    }
+
+    if (mc == CURLM_OK && loop->deadline >= 0 && now_ms() >= loop->deadline) {
+        loop->deadline = -1;
+        mc = requests_loop_socket_action(loop, CURL_SOCKET_TIMEOUT, 0);
+    }
+
+    return mc;
+#else
+    return CURLM_BAD_HANDLE;
+#endif
+}
+
+/*
+ * requests_loop_run - Runs the built-in driver until every request in the
+ * loop, including ones submitted from done callbacks, has finished.
+ *
+ * Returns CURLM_OK on success, or the error from requests_loop_run_once().
+ *
+ * @loop: loop struct
+ */
+CURLMcode requests_loop_run(requests_loop_t *loop)
+{
+    CURLMcode mc = CURLM_OK;
+
+    while (mc == CURLM_OK && loop->running > 0)
+        mc = requests_loop_run_once(loop, -1);
+
+    return mc;
+}
+
+/*
+ * loop_add - Attaches a prepared request to the loop's multi handle.
+ *
+ * Returns CURLE_OK on success, or CURLE_OUT_OF_MEMORY on failure.
+ */
+static CURLcode loop_add(requests_loop_t *loop, req_t *req,
+                         requests_done_fn done, void *userdata)
+{
+    req->done = done;
+    req->done_data = userdata;
+
+    curl_easy_setopt(req->curlhandle, CURLOPT_PRIVATE, req);
+    if (curl_multi_add_handle(loop->multihandle, req->curlhandle) != CURLM_OK)
+        return CURLE_OUT_OF_MEMORY;
+
+    /* counted now so requests_loop_run() doesn't return before curl has
+       had a chance to start it; the next socket action corrects it */
+    loop->running++;
+    return CURLE_OK;
+}
+
+/*
+ * loop_drain - Finishes every transfer the multi handle reports as done and
+ * calls its done callback.
+ */
+static void loop_drain(requests_loop_t *loop)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(loop->multihandle, &left))) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        CURL *curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        req_t *req;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &req);
+
+        curl_multi_remove_handle(loop->multihandle, curl);
+        req_finish(req, rc);
+        if (req->done != NULL)
+            req->done(req, rc, req->done_data);
+    }
+}
+
+/*
+ * socket_cb - libcurl socket callback. Forwards to the caller's callback, or
+ * keeps the built-in driver's epoll set in sync. Sockets already in the
+ * epoll set are marked with curl_multi_assign().
+ */
+static int socket_cb(CURL *curl, curl_socket_t fd, int what, void *userp,
+                     void *socketp)
+{
+    requests_loop_t *loop = userp;
+
+    if (loop->socket_fn != NULL)
+        return loop->socket_fn(fd, what, loop->userdata);
+
+#ifdef __linux__
+    if (what == CURL_POLL_REMOVE) {
+        /* the socket may already be closed, in which case epoll has
+           dropped it on its own */
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+        return 0;
+    }
+
+    struct epoll_event ev = { 0 };
+    ev.data.fd = fd;
+    if (what & CURL_POLL_IN)
+        ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT)
+        ev.events |= EPOLLOUT;
+
+    if (socketp == NULL) {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            return -1;
+        curl_multi_assign(loop->multihandle, fd, loop);
+    } else if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * timer_cb - libcurl timer callback. Forwards to the caller's callback, or
+ * records the deadline for the built-in driver.
+ */
+static int timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    requests_loop_t *loop = userp;
+
+    if (loop->timer_fn != NULL) {
+        loop->timer_fn(timeout_ms, loop->userdata);
+        return 0;
+    }
+
+    loop->deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+    return 0;
+}
+
+/*
+ * now_ms - Milliseconds on the monotonic clock.
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,309 @@
+/*
+ * multipart.c -- librequests: multipart/form-data bodies whose parts are read
+ * from the caller's buffers and files as they are sent
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <unistd.h>
+#include "requests.h"
+#include "internal.h"
+
+/* where sending a buffer part has got to */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t pos;
+} part_reader_t;
+
+/*
+ * Prototypes
+ */
+static requests_part_t *multipart_add(requests_multipart_t *form,
+                                      const char *name, const char *type);
+static void part_free(requests_part_t *part);
+static CURLcode send_multipart(req_t *req, char *url,
+                               requests_multipart_t *form,
+                               char **custom_hdrv, int custom_hdrc,
+                               int put_flag);
+static CURLcode build_mime(req_t *req, requests_multipart_t *form);
+static size_t part_read(char *buf, size_t size, size_t nitems, void *arg);
+static int part_seek(void *arg, curl_off_t offset, int origin);
+
+/*
+ * requests_multipart_init - Starts an empty multipart form. Parts are
+ * added with requests_multipart_add() and requests_multipart_add_file(),
+ * and sent with requests_post_multipart() or requests_put_multipart().
+ *
+ * Returns 0.
+ *
+ * @form: form to initialize
+ */
+int requests_multipart_init(requests_multipart_t *form)
+{
+    form->partv = NULL;
+    form->partc = 0;
+    form->partcap = 0;
+    return 0;
+}
+
+/*
+ * requests_multipart_close - Frees the form, but none of the buffers or
+ * files its parts refer to.
+ *
+ * @form: form to close
+ */
+void requests_multipart_close(requests_multipart_t *form)
+{
+    for (int i = 0; i < form->partc; i++)
+        part_free(&form->partv[i]);
+    mem_free(form->partv);
+    requests_multipart_init(form);
+}
+
+/*
+ * requests_multipart_add - Adds a part whose content is `len' bytes at
+ * `data', which may hold NULL bytes. The bytes aren't copied: they are read
+ * from `data' while the form is sent, so it must stay unchanged until the
+ * last request sending the form has returned.
+ *
+ * Returns 0 on success, or -1 on failure, leaving the form as it was.
+ *
+ * @form: form to add to
+ * @name: field name
+ * @data: part content
+ * @len:  length of `data'
+ * @type: content type of the part, e.g. "application/json", or NULL for
+ *        none, which means text/plain to most servers
+ */
+int requests_multipart_add(requests_multipart_t *form, const char *name,
+                           const char *data, size_t len, const char *type)
+{
+    requests_part_t *part = multipart_add(form, name, type);
+
+    if (part == NULL)
+        return -1;
+    part->data = data;
+    part->len = len;
+    form->partc++;
+    return 0;
+}
+
+/*
+ * requests_multipart_add_file - Adds a part whose content is the file at
+ * `path'. The file is opened and read only while the form is sent, a bit
+ * at a time, so its size doesn't matter. It has to be readable now, and
+ * still be there then.
+ *
+ * Returns 0 on success, or -1 if the file can't be read or on failure,
+ * leaving the form as it was.
+ *
+ * @form:     form to add to
+ * @name:     field name
+ * @path:     file to send
+ * @filename: file name the server is told, or NULL for the last component
+ *            of `path'
+ * @type:     content type of the part, or NULL to guess it from the
+ *            extension of the file name
+ */
+int requests_multipart_add_file(requests_multipart_t *form, const char *name,
+                                const char *path, const char *filename,
+                                const char *type)
+{
+    requests_part_t *part;
+
+    if (access(path, R_OK) < 0)
+        return -1;
+    part = multipart_add(form, name, type);
+    if (part == NULL)
+        return -1;
+    part->path = mem_strdup(path);
+    if (filename != NULL)
+        part->filename = mem_strdup(filename);
+    if (part->path == NULL || (filename != NULL && part->filename == NULL)) {
+        part_free(part);
+        return -1;
+    }
+    form->partc++;
+    return 0;
+}
+
+/*
+ * requests_post_multipart - Sends a POST whose body is `form', encoded as
+ * multipart/form-data. The Content-Type header, boundary included, is set
+ * unless `custom_hdrv' has one. The form must not change while it is being
+ * sent.
+ *
+ * Returns the CURLcode of the transfer, CURLE_READ_ERROR if a file part
+ * can't be read.
+ *
+ * @req:         request struct
+ * @url:         url to send request to
+ * @form:        form to send
+ * @custom_hdrv: char* array of custom headers, or NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode requests_post_multipart(req_t *req, char *url,
+                                 requests_multipart_t *form,
+                                 char **custom_hdrv, int custom_hdrc)
+{
+    return send_multipart(req, url, form, custom_hdrv, custom_hdrc, 0);
+}
+
+/*
+ * requests_put_multipart - Sends a PUT whose body is `form', encoded as
+ * multipart/form-data. The Content-Type header, boundary included, is set
+ * unless `custom_hdrv' has one. The form must not change while it is being
+ * sent.
+ *
+ * Returns the CURLcode of the transfer, CURLE_READ_ERROR if a file part
+ * can't be read.
+ *
+ * @req:         request struct
+ * @url:         url to send request to
+ * @form:        form to send
+ * @custom_hdrv: char* array of custom headers, or NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode requests_put_multipart(req_t *req, char *url,
+                                requests_multipart_t *form,
+                                char **custom_hdrv, int custom_hdrc)
+{
+    return send_multipart(req, url, form, custom_hdrv, custom_hdrc, 1);
+}
+
+/*
+ * multipart_add - Makes room for one more part and fills in its name and
+ * type. The part only counts once the caller bumps `partc'.
+ */
+static requests_part_t *multipart_add(requests_multipart_t *form,
+                                      const char *name, const char *type)
+{
+    requests_part_t *part;
+
+    if (form->partc == form->partcap) {
+        int cap = form->partcap ? form->partcap * 2 : 8;
+        requests_part_t *tmp = mem_realloc(form->partv, cap * sizeof(*tmp));
+        if (tmp == NULL)
+            return NULL;
+        form->partv = tmp;
+        form->partcap = cap;
+    }
+
+    part = &form->partv[form->partc];
+    memset(part, 0, sizeof(*part));
+    part->name = mem_strdup(name);
+    if (type != NULL)
+        part->type = mem_strdup(type);
+    if (part->name == NULL || (type != NULL && part->type == NULL)) {
+        part_free(part);
+        return NULL;
+    }
+    return part;
+}
+
+static void part_free(requests_part_t *part)
+{
+    mem_free(part->name);
+    mem_free(part->type);
+    mem_free(part->filename);
+    mem_free(part->path);
+}
+
+static CURLcode send_multipart(req_t *req, char *url,
+                               requests_multipart_t *form,
+                               char **custom_hdrv, int custom_hdrc,
+                               int put_flag)
+{
+    CURLcode rc;
+
+    req->url = url;
+    rc = req_prepare_method(req, custom_hdrv, custom_hdrc, put_flag);
+    if (rc != CURLE_OK)
+        return rc;
+    rc = build_mime(req, form);
+    if (rc != CURLE_OK)
+        return rc;
+
+    /* after the method, as CURLOPT_POST would turn this back into a plain
+       POST; libcurl rewinds the body itself for retries and redirects */
+    rc = curl_easy_setopt(req->curlhandle, CURLOPT_MIMEPOST, req->mime);
+    if (rc != CURLE_OK)
+        return rc;
+    return req_perform(req);
+}
+
+/*
+ * build_mime - Describes `form' to libcurl for one request. A curl_mime
+ * can't be rewound once the handle it was sent with is reset, so each
+ * request gets its own; it only points at the content.
+ */
+static CURLcode build_mime(req_t *req, requests_multipart_t *form)
+{
+    CURLcode rc = CURLE_OK;
+
+    req->mime = curl_mime_init(req->curlhandle);
+    if (req->mime == NULL)
+        return CURLE_OUT_OF_MEMORY;
+
+    for (int i = 0; i < form->partc && rc == CURLE_OK; i++) {
+        requests_part_t *p = &form->partv[i];
+        curl_mimepart *part = curl_mime_addpart(req->mime);
+        part_reader_t *reader;
+
+        if (part == NULL)
+            return CURLE_OUT_OF_MEMORY;
+        rc = curl_mime_name(part, p->name);
+        if (rc == CURLE_OK && p->type != NULL)
+            rc = curl_mime_type(part, p->type);
+        if (rc != CURLE_OK)
+            break;
+
+        if (p->path != NULL) {
+            rc = curl_mime_filedata(part, p->path);
+            if (rc == CURLE_OK && p->filename != NULL)
+                rc = curl_mime_filename(part, p->filename);
+            continue;
+        }
+
+        reader = mem_alloc(sizeof(*reader));
+        if (reader == NULL)
+            return CURLE_OUT_OF_MEMORY;
+        reader->data = p->data;
+        reader->len = p->len;
+        reader->pos = 0;
+        /* libcurl frees `reader' along with req->mime */
+        rc = curl_mime_data_cb(part, (curl_off_t) p->len, part_read,
+                               part_seek, mem_free, reader);
+    }
+    return rc;
+}
+
+/*
+ * part_read - libcurl's read callback for buffer parts.
+ */
+static size_t part_read(char *buf, size_t size, size_t nitems, void *arg)
+{
+    part_reader_t *reader = arg;
+    size_t n = size * nitems;
+
+    if (n > reader->len - reader->pos)
+        n = reader->len - reader->pos;
+    memcpy(buf, reader->data + reader->pos, n);
+    reader->pos += n;
+    return n;
+}
+
+static int part_seek(void *arg, curl_off_t offset, int origin)
+{
+    part_reader_t *reader = arg;
+
+    if (origin != SEEK_SET || offset < 0 || (size_t) offset > reader->len)
+        return CURL_SEEKFUNC_FAIL;
+    reader->pos = offset;
+    return CURL_SEEKFUNC_OK;
+}
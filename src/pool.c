@@ -0,0 +1,304 @@
+/*
+ * pool.c -- librequests: thread-safe pool of reusable request handles
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+/*
+ * Prototypes
+ */
+static int home_shard(void);
+static req_t *pool_pop(requests_pool_t *pool);
+static void pool_push(requests_pool_t *pool, req_t *req);
+static req_t *pool_create(requests_pool_t *pool);
+static void pool_note_acquire(requests_pool_t *pool);
+
+/*
+ * requests_pool_init - Initializes a pool that hands out at most `capacity'
+ * handles at a time. Handles are created on demand; `prewarm' of them are
+ * created up front so the first acquires don't pay for curl_easy_init.
+ *
+ * Returns 0 on success, or -1 on failure, including for a `share' with
+ * REQUESTS_SHARE_CONNECT, as pooled handles are used from many threads.
+ *
+ * @pool:     reference to requests_pool_t to be initialized
+ * @capacity: maximum number of handles, must be positive
+ * @prewarm:  number of handles to create now, at most `capacity'
+ * @share:    caches every pooled handle attaches to, or NULL for none
+ */
+int requests_pool_init(requests_pool_t *pool, int capacity, int prewarm,
+                       requests_share_t *share)
+{
+    int i;
+
+    if (capacity <= 0 || prewarm < 0 || prewarm > capacity)
+        return -1;
+    if (share != NULL && share->flags & REQUESTS_SHARE_CONNECT)
+        return -1;
+
+    pool->capacity = capacity;
+    pool->share = share;
+    atomic_init(&pool->created, 0);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->high_water, 0);
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+    atomic_init(&pool->waits, 0);
+    atomic_init(&pool->waiters, 0);
+
+    pool->reqs = mem_calloc(capacity, sizeof(req_t));
+    if (pool->reqs == NULL)
+        return -1;
+
+    for (i = 0; i < REQUESTS_POOL_SHARDS; i++) {
+        requests_pool_shard_t *shard = &pool->shards[i];
+
+        /* any thread may release into any shard, so each one needs room
+           for every handle */
+        shard->freev = mem_alloc(capacity * sizeof(req_t*));
+        shard->freec = 0;
+        if (shard->freev == NULL)
+            goto fail;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    pthread_mutex_init(&pool->wait_lock, NULL);
+    pthread_cond_init(&pool->wait_cond, NULL);
+
+    for (int j = 0; j < prewarm; j++) {
+        req_t *req = pool_create(pool);
+        if (req == NULL) {
+            requests_pool_close(pool);
+            return -1;
+        }
+        /* spread the handles out so every shard starts with some */
+        requests_pool_shard_t *shard = &pool->shards[j % REQUESTS_POOL_SHARDS];
+        shard->freev[shard->freec++] = req;
+    }
+
+    return 0;
+
+fail:
+    while (i-- > 0) {
+        pthread_mutex_destroy(&pool->shards[i].lock);
+        mem_free(pool->shards[i].freev);
+    }
+    mem_free(pool->reqs);
+    return -1;
+}
+
+/*
+ * requests_pool_close - Closes every handle the pool created and frees the
+ * pool. All acquired handles must have been released first.
+ *
+ * @pool: pool struct
+ */
+void requests_pool_close(requests_pool_t *pool)
+{
+    int created = atomic_load(&pool->created);
+
+    for (int i = 0; i < created; i++)
+        requests_close(&pool->reqs[i]);
+
+    for (int i = 0; i < REQUESTS_POOL_SHARDS; i++) {
+        pthread_mutex_destroy(&pool->shards[i].lock);
+        mem_free(pool->shards[i].freev);
+    }
+
+    pthread_mutex_destroy(&pool->wait_lock);
+    pthread_cond_destroy(&pool->wait_cond);
+    mem_free(pool->reqs);
+}
+
+/*
+ * requests_pool_acquire - Borrows a handle from the pool. The handle is
+ * freshly reset and ready for a request. If every handle is in use and the
+ * pool is at capacity, blocks until another thread releases one.
+ *
+ * Returns the handle, or NULL if a new handle was needed but could not be
+ * initialized.
+ *
+ * @pool: pool struct
+ */
+req_t *requests_pool_acquire(requests_pool_t *pool)
+{
+    req_t *req;
+
+    req = pool_pop(pool);
+    if (req != NULL) {
+        atomic_fetch_add(&pool->hits, 1);
+        pool_note_acquire(pool);
+        return req;
+    }
+
+    req = pool_create(pool);
+    if (req != NULL) {
+        atomic_fetch_add(&pool->misses, 1);
+        pool_note_acquire(pool);
+        return req;
+    }
+    if (atomic_load(&pool->created) < pool->capacity)
+        return NULL; /* requests_init failed */
+
+    /* full: wait for a release. The waiter count is raised before the
+       shards are searched again, so a release either lands before that
+       search or sees the waiter and signals. */
+    atomic_fetch_add(&pool->waits, 1);
+    pthread_mutex_lock(&pool->wait_lock);
+    atomic_fetch_add(&pool->waiters, 1);
+    while ((req = pool_pop(pool)) == NULL)
+        pthread_cond_wait(&pool->wait_cond, &pool->wait_lock);
+    atomic_fetch_sub(&pool->waiters, 1);
+    pthread_mutex_unlock(&pool->wait_lock);
+
+    pool_note_acquire(pool);
+    return req;
+}
+
+/*
+ * requests_pool_release - Returns a handle to the pool. Its response state
+ * and everything set with a requests_set_*() function are cleared, so the
+ * next borrower gets it as requests_init() made it; its connection stays
+ * open for them.
+ *
+ * @pool: pool struct
+ * @req:  handle previously returned by requests_pool_acquire()
+ */
+void requests_pool_release(requests_pool_t *pool, req_t *req)
+{
+    requests_set_sink(req, NULL, NULL);
+    requests_set_http2(req, REQUESTS_HTTP_DEFAULT);
+    requests_set_compression(req, 0);
+    requests_set_cache(req, NULL);
+    requests_set_disk_cache(req, NULL);
+    requests_set_retry(req, NULL);
+    requests_set_hedge(req, NULL);
+    requests_set_latency(req, NULL);
+    requests_reset(req);
+
+    atomic_fetch_sub(&pool->in_use, 1);
+    pool_push(pool, req);
+
+    if (atomic_load(&pool->waiters) > 0) {
+        pthread_mutex_lock(&pool->wait_lock);
+        pthread_cond_signal(&pool->wait_cond);
+        pthread_mutex_unlock(&pool->wait_lock);
+    }
+}
+
+/*
+ * requests_pool_stats - Takes a snapshot of the pool's counters.
+ *
+ * @pool:  pool struct
+ * @stats: filled in with the counters
+ */
+void requests_pool_stats(requests_pool_t *pool, requests_pool_stats_t *stats)
+{
+    stats->hits = atomic_load(&pool->hits);
+    stats->misses = atomic_load(&pool->misses);
+    stats->waits = atomic_load(&pool->waits);
+    stats->in_use = atomic_load(&pool->in_use);
+    stats->high_water = atomic_load(&pool->high_water);
+}
+
+/*
+ * home_shard - Returns the shard the calling thread prefers. Threads are
+ * assigned shards round robin the first time they touch any pool.
+ */
+static int home_shard(void)
+{
+    static atomic_int next;
+    static _Thread_local int shard = -1;
+
+    if (shard < 0)
+        shard = atomic_fetch_add(&next, 1) % REQUESTS_POOL_SHARDS;
+
+    return shard;
+}
+
+/*
+ * pool_pop - Takes an idle handle, trying the calling thread's own shard
+ * first and then the others.
+ *
+ * Returns the handle, or NULL if no handle is idle.
+ */
+static req_t *pool_pop(requests_pool_t *pool)
+{
+    int home = home_shard();
+
+    for (int i = 0; i < REQUESTS_POOL_SHARDS; i++) {
+        requests_pool_shard_t *shard =
+            &pool->shards[(home + i) % REQUESTS_POOL_SHARDS];
+        req_t *req = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+        if (shard->freec > 0)
+            req = shard->freev[--shard->freec];
+        pthread_mutex_unlock(&shard->lock);
+
+        if (req != NULL)
+            return req;
+    }
+
+    return NULL;
+}
+
+/*
+ * pool_push - Puts an idle handle on the calling thread's shard.
+ */
+static void pool_push(requests_pool_t *pool, req_t *req)
+{
+    requests_pool_shard_t *shard = &pool->shards[home_shard()];
+
+    pthread_mutex_lock(&shard->lock);
+    shard->freev[shard->freec++] = req;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * pool_create - Initializes a new handle if the pool is below capacity.
+ *
+ * Returns the handle, or NULL if the pool is full or initialization failed.
+ */
+static req_t *pool_create(requests_pool_t *pool)
+{
+    int slot = atomic_load(&pool->created);
+
+    do {
+        if (slot >= pool->capacity)
+            return NULL;
+    } while (!atomic_compare_exchange_weak(&pool->created, &slot, slot + 1));
+
+    req_t *req = &pool->reqs[slot];
+    if (requests_init_shared(req, pool->share)) {
+        /* give the slot back if nobody has created a handle since. If
+           somebody has, the slot stays empty; zeroing it makes closing it
+           in requests_pool_close() harmless */
+        int expect = slot + 1;
+        memset(req, 0, sizeof(*req));
+        atomic_compare_exchange_strong(&pool->created, &expect, slot);
+        return NULL;
+    }
+
+    return req;
+}
+
+/*
+ * pool_note_acquire - Bumps the in-use count and the high-water mark.
+ */
+static void pool_note_acquire(requests_pool_t *pool)
+{
+    int in_use = atomic_fetch_add(&pool->in_use, 1) + 1;
+    int high = atomic_load(&pool->high_water);
+
+    while (in_use > high &&
+           !atomic_compare_exchange_weak(&pool->high_water, &high, in_use))
+        ;
+}
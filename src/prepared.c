@@ -0,0 +1,171 @@
+/*
+ * prepared.c -- librequests: requests set up once and sent many times
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+/* hands out prepared request generations, 0 meaning none */
+static atomic_ulong generations = 1;
+
+/*
+ * Prototypes
+ */
+static void prepared_opt(req_t *req, requests_prepared_t *prep);
+
+/*
+ * requests_prepare - Captures a request so it can be sent repeatedly without
+ * rebuilding its URL, header list or body each time. Headers are handled
+ * like requests_get_headers() and friends, and a POST or PUT without data
+ * sends "Content-Length: 0" like requests_post() does.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @prep:   reference to requests_prepared_t to be initialized
+ * @method: REQUESTS_GET, REQUESTS_POST or REQUESTS_PUT
+ * @url:    url to send request to
+ * @data:   url encoded data to send in request body, NULL for none. Ignored
+ *          for GET.
+ * @custom_hdrv: char* array of custom headers, may be NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+int requests_prepare(requests_prepared_t *prep, requests_method_t method,
+                     char *url, char *data,
+                     char **custom_hdrv, int custom_hdrc)
+{
+    prep->method = method;
+    prep->data = NULL;
+    prep->data_size = 0;
+    prep->slist = NULL;
+    /* a struct prepared again at the same address is still a new request
+       to the handles that sent the old one */
+    prep->generation = atomic_fetch_add(&generations, 1);
+
+    prep->url = mem_strdup(url);
+    if (prep->url == NULL)
+        goto fail;
+
+    if (method != REQUESTS_GET) {
+        if (data != NULL) {
+            prep->data_size = strlen(data);
+            prep->data = mem_strndup(data, prep->data_size);
+            if (prep->data == NULL)
+                goto fail;
+        } else {
+            prep->slist = curl_slist_append(prep->slist,
+                                            "Content-Length: 0");
+            if (prep->slist == NULL)
+                goto fail;
+        }
+    }
+
+    for (int i = 0; i < custom_hdrc; i++) {
+        struct curl_slist *slist = curl_slist_append(prep->slist,
+                                                     custom_hdrv[i]);
+        if (slist == NULL)
+            goto fail;
+        prep->slist = slist;
+    }
+
+    return 0;
+
+fail:
+    requests_prepared_close(prep);
+    return -1;
+}
+
+/*
+ * requests_prepared_close - Frees a prepared request. No req_t may be
+ * performing it at the time.
+ *
+ * @prep: prepared request struct
+ */
+void requests_prepared_close(requests_prepared_t *prep)
+{
+    mem_free(prep->url);
+    mem_free(prep->data);
+    if (prep->slist != NULL)
+        curl_slist_free_all(prep->slist);
+
+    prep->url = NULL;
+    prep->data = NULL;
+    prep->slist = NULL;
+    prep->generation = 0;
+}
+
+/*
+ * requests_prepared_perform - Sends a prepared request on `req' and
+ * populates it like requests_get() would. The previous response on `req' is
+ * cleared first, so there is no need to call requests_reset() in between.
+ * When `req' last sent the same prepared request, its curl options are
+ * still in place and are not set again, so nothing is allocated on the
+ * library side. req_hdrv is left empty; the headers live in `prep'.
+ *
+ * Returns the CURLcode provided from curl_easy_perform.
+ *
+ * @req:  request struct
+ * @prep: prepared request, must outlive the transfer
+ */
+CURLcode requests_prepared_perform(req_t *req, requests_prepared_t *prep)
+{
+    req_prepare_prepared(req, prep);
+    return req_perform(req);
+}
+
+/*
+ * req_prepare_prepared - Clears the previous response on `req' and sets its
+ * curl handle up to send `prep', without performing it. Used by
+ * requests_prepared_perform() above as well as the event loop.
+ *
+ * @req:  request struct
+ * @prep: prepared request, must outlive the transfer
+ */
+void req_prepare_prepared(req_t *req, requests_prepared_t *prep)
+{
+    req_clear(req);
+    req->url = prep->url;
+
+    if (req->prepared != prep ||
+        req->prepared_generation != prep->generation)
+        prepared_opt(req, prep);
+}
+
+/*
+ * prepared_opt - Replaces whatever options the curl handle of `req' holds
+ * with the ones for `prep'.
+ */
+static void prepared_opt(req_t *req, requests_prepared_t *prep)
+{
+    CURL *curl = req->curlhandle;
+
+    req_rewind(req);
+    req_common_opt(req);
+
+    if (prep->slist != NULL)
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, prep->slist);
+
+    if (prep->data != NULL) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t) prep->data_size);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, prep->data);
+    } else if (prep->method != REQUESTS_GET) {
+        /* an empty body rather than one read from stdin */
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) 0);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+    }
+
+    if (prep->method == REQUESTS_PUT)
+        /* see requests_pt() for why this isn't a dedicated PUT */
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    else if (prep->method == REQUESTS_POST)
+        curl_easy_setopt(curl, CURLOPT_POST, 1);
+
+    req->prepared = prep;
+    req->prepared_generation = prep->generation;
+}
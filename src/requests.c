@@ -24,17 +24,19 @@
  * THE SOFTWARE.
  */
 
+#include <sys/mman.h>
 #include "requests.h"
+#include "internal.h"
 
 /*
  * Prototypes
  */
-static void common_opt(req_t *req);
-static char *user_agent(void);
+static const char *user_agent(void);
+static void user_agent_init(void);
 static int check_ok(long code);
 static CURLcode requests_pt(req_t *req, char *url, char *data,
                             char **custom_hdrv, int custom_hdrc, int put_flag);
-static int hdrv_append(char ***hdrv, int *hdrc, char *_new);
+static int text_reserve(req_t *req, size_t need);
 static CURLcode process_custom_headers(struct curl_slist **slist,
                                        req_t *req, char **custom_hdrv,
                                        int custom_hdrc);
@@ -47,40 +49,93 @@ static CURLcode process_custom_headers(struct curl_slist **slist,
  * @req: reference to req_t to be initialized
  */
 int requests_init(req_t *req)
+{
+    return requests_init_shared(req, NULL);
+}
+
+/*
+ * requests_init_shared - Initializes requests struct data members, same as
+ * requests_init(), and attaches the request to a set of shared caches so it
+ * reuses host names, TLS sessions and connections looked up or opened by
+ * other requests attached to `share'.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @req:   reference to req_t to be initialized
+ * @share: caches set up with requests_share_init(), or NULL for none
+ */
+int requests_init_shared(req_t *req, requests_share_t *share)
 {
     req->code = 0;
     req->url = NULL;
     req->size = 0;
+    req->wire_size = 0;
+    req->text_cap = 1;
+    req->text_reallocs = 0;
     req->req_hdrc = 0;
     req->resp_hdrc = 0;
     req->ok = -1;
-
-    req->text = calloc(1, 1);
+    req->result = CURLE_OK;
+    req->attempts = 0;
+    req->retry_wait_ms = 0;
+    memset(&req->timing, 0, sizeof(req->timing));
+    req->mem.bytes = 0;
+    req->mem.peak = 0;
+    req->slist = NULL;
+    req->prepared = NULL;
+    req->prepared_generation = 0;
+    req->sink = NULL;
+    req->sink_data = NULL;
+    req->http2 = REQUESTS_HTTP_DEFAULT;
+    req->compression = 0;
+    req->zbody = NULL;
+    req->zbody_size = 0;
+    req->zbody_cap = 0;
+    req->upload_fd = -1;
+    req->upload_start = 0;
+    req->upload_pos = 0;
+    req->upload_len = -1;
+    req->upload_map = NULL;
+    req->upload_map_len = 0;
+    req->producer = NULL;
+    req->producer_data = NULL;
+    req->upload_paused = 0;
+    req->upload_multi = NULL;
+    req->mime = NULL;
+    req->retry = NULL;
+    req->hedge = NULL;
+    req->hedge_multi = NULL;
+    req->hedge_req = NULL;
+    req->latency = NULL;
+    req->cache = NULL;
+    req->disk_cache = NULL;
+    req->map = NULL;
+    req->map_len = 0;
+    req->own_text = NULL;
+    req->share = share;
+
+    /* header arrays are allocated by their arenas on first use */
+    req->req_hdrv = NULL;
+    req->resp_hdrv = NULL;
+    arena_init(&req->req_arena, &req->mem);
+    arena_init(&req->resp_arena, &req->mem);
+    hdr_index_init(&req->resp_index, &req->mem);
+
+    req->text = mem_grow(&req->mem, NULL, 0, 1);
     if (req->text == NULL){
         goto fail;
     }
-
-    req->req_hdrv = calloc(1, 1);
-    if (req->req_hdrv == NULL) {
-        free(req->text);
-        goto fail;
-    }
-
-    req->resp_hdrv = calloc(1, 1);
-    if (req->resp_hdrv == NULL) {
-        free(req->text);
-        free(req->req_hdrv);
-        goto fail;
-    }
+    req->text[0] = '\0';
 
     req->curlhandle = curl_easy_init();
     if (req->curlhandle == NULL) {
-        free(req->text);
-        free(req->req_hdrv);
-        free(req->resp_hdrv);
+        mem_release(&req->mem, req->text, 1);
         goto fail;
     }
 
+    if (share != NULL)
+        curl_easy_setopt(req->curlhandle, CURLOPT_SHARE, share->sharehandle);
+
     return 0;
 
 fail:
@@ -94,22 +149,95 @@ fail:
  */
 void requests_close(req_t *req)
 {
-    for (int i = 0; i < req->resp_hdrc; i++)
-        free(req->resp_hdrv[i]);
+    req_unmap(req);
+    upload_clear(req);
+    mem_release(&req->mem, req->text, req->text_cap);
+    mem_release(&req->mem, req->zbody, req->zbody_cap);
+    arena_free(&req->resp_arena, req->resp_hdrv);
+    arena_free(&req->req_arena, req->req_hdrv);
+    hdr_index_free(&req->resp_index);
+
+    if (req->slist != NULL)
+        curl_slist_free_all(req->slist);
+
+    if (req->hedge_req != NULL) {
+        requests_close(req->hedge_req);
+        mem_free(req->hedge_req);
+    }
+    curl_easy_cleanup(req->curlhandle);
+    if (req->hedge_multi != NULL)
+        curl_multi_cleanup(req->hedge_multi);
+    if (req->upload_multi != NULL)
+        curl_multi_cleanup(req->upload_multi);
+}
 
-    for (int i = 0; i < req->req_hdrc; i++)
-        free(req->req_hdrv[i]);
+/*
+ * requests_reset - Clears the response and request state of `req' so it can
+ * be used for another request, without tearing down its curl handle. The
+ * handle keeps its open connections, DNS cache and TLS sessions, so repeated
+ * requests to the same host skip the handshakes. The response buffer is
+ * emptied but keeps its allocation, and a sink set with requests_set_sink()
+ * stays in place.
+ *
+ * @req: request struct, initialized with requests_init()
+ */
+void requests_reset(req_t *req)
+{
+    req_clear(req);
+    req_rewind(req);
+}
 
-    free(req->text);
-    free(req->resp_hdrv);
-    free(req->req_hdrv);
+/*
+ * req_clear - Forgets the response and request headers of the last request
+ * and empties the response buffer, keeping their memory for the next one and
+ * leaving the curl handle's options alone.
+ *
+ * @req: request struct
+ */
+void req_clear(req_t *req)
+{
+    req_unmap(req);
+    arena_reset(&req->resp_arena, &req->resp_hdrc);
+    arena_reset(&req->req_arena, &req->req_hdrc);
+    hdr_index_reset(&req->resp_index);
+    req->code = 0;
+    req->url = NULL;
+    req->size = 0;
+    req->wire_size = 0;
+    req->text[0] = '\0';
+    req->ok = -1;
+    req->result = CURLE_OK;
+    req->attempts = 0;
+    req->retry_wait_ms = 0;
+    memset(&req->timing, 0, sizeof(req->timing));
+    req->mem.peak = req->mem.bytes;
+
+    if (req->slist != NULL) {
+        curl_slist_free_all(req->slist);
+        req->slist = NULL;
+    }
+}
 
-    curl_easy_cleanup(req->curlhandle);
+/*
+ * req_rewind - Drops the options of the last request (POST, PUT, headers,
+ * ...) from the curl handle but leaves its connection, DNS and TLS session
+ * caches alone.
+ *
+ * @req: request struct
+ */
+void req_rewind(req_t *req)
+{
+    curl_easy_reset(req->curlhandle);
+    if (req->share != NULL)
+        curl_easy_setopt(req->curlhandle, CURLOPT_SHARE,
+                         req->share->sharehandle);
+    req->prepared = NULL;
 }
 
 /*
  * resp_callback - Callback function for requests, may be called multiple
- * times per request. Allocates memory and assembles response data.
+ * times per request. Grows the response buffer as needed and assembles
+ * response data.
  *
  * Note: `content' will not be NULL terminated.
  */
@@ -117,23 +245,32 @@ static size_t resp_callback(char *content, size_t size, size_t nmemb,
                             req_t *userdata)
 {
     size_t real_size = size * nmemb;
-    long original_userdata_size = userdata->size;
+
+    /* streaming: hand the chunk over and keep `text' empty */
+    if (userdata->sink != NULL) {
+        if (userdata->sink(content, real_size, userdata->sink_data)
+                != real_size)
+            return -1;
+        userdata->size += real_size;
+        return real_size;
+    }
 
     /* extra 1 is for NULL terminator */
-    userdata->text = (char*) realloc(userdata->text, userdata->size + real_size + 1);
-    if (userdata->text == NULL)
+    if (text_reserve(userdata, userdata->size + real_size + 1))
         return -1;
 
-    userdata->size += real_size;
     /* concatenate userdata->text with the response content */
-    memcpy(userdata->text + original_userdata_size, content, real_size);
-    userdata->text[original_userdata_size + real_size] = '\0';
+    memcpy(userdata->text + userdata->size, content, real_size);
+    userdata->size += real_size;
+    userdata->text[userdata->size] = '\0';
     return real_size;
 }
 
 /*
  * header_callback - Callback function for headers, called once for each 
- * header. Allocates memory and assembles headers into string array.
+ * header. Allocates memory, assembles headers into string array and indexes
+ * them for requests_header(). If the header is Content-Length, the response
+ * buffer is sized for the whole body up front.
  *
  * Note: `content' will not be NULL terminated.
  */
@@ -141,13 +278,25 @@ static size_t header_callback(char *content, size_t size, size_t nmemb,
                               req_t *userdata)
 {
     size_t real_size = size * nmemb;
+    static const char cl[] = "Content-Length:";
 
     /* the last header is always "\r\n" which we'll intentionally skip */
-    if (strcmp(content, "\r\n") == 0)
+    if (real_size == 2 && memcmp(content, "\r\n", 2) == 0)
         return real_size;
 
-    if (hdrv_append(&userdata->resp_hdrv, &userdata->resp_hdrc, content))
+    if (arena_append(&userdata->resp_arena, &userdata->resp_hdrv,
+                     &userdata->resp_hdrc, content, real_size))
         return -1;
+    if (hdr_index_add(userdata, userdata->resp_hdrc - 1))
+        return -1;
+
+    if (userdata->sink == NULL && real_size > sizeof(cl) - 1 &&
+        strncasecmp(content, cl, sizeof(cl) - 1) == 0) {
+        unsigned long long len = strtoull(content + sizeof(cl) - 1, NULL, 10);
+        /* only a hint: on failure resp_callback grows the buffer as usual */
+        if (len > 0 && len < SIZE_MAX - userdata->size - 1)
+            text_reserve(userdata, userdata->size + len + 1);
+    }
 
     return real_size;
 }
@@ -165,27 +314,7 @@ static size_t header_callback(char *content, size_t size, size_t nmemb,
  */
 CURLcode requests_get(req_t *req, char *url)
 {
-    CURLcode rc;
-    char *ua = user_agent();
-    req->url = url;
-    long code;
-    CURL *curl = req->curlhandle;
-
-
-    common_opt(req);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, ua);
-    rc = curl_easy_perform(curl);
-    if (rc != CURLE_OK)
-        return rc;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-
-    req->code = code;
-    req->ok = check_ok(code);
-    free(ua);
-
-    return rc;
+    return requests_get_headers(req, url, NULL, 0);
 }
 
 /*
@@ -203,91 +332,83 @@ CURLcode requests_get(req_t *req, char *url)
 CURLcode requests_get_headers(req_t *req, char *url, 
                               char **custom_hdrv, int custom_hdrc)
 {
-    CURLcode rc;
-    struct curl_slist *slist = NULL;
-    char *ua = user_agent();
-    req->url = url;
-    long code;
-    CURL *curl = req->curlhandle;
-
-    /* headers */
-    if (custom_hdrv != NULL) {
-        rc = process_custom_headers(&slist, req, custom_hdrv, custom_hdrc);
-        if (rc != CURLE_OK)
-            return rc;
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
-    }
-
-    common_opt(req);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, ua);
-    rc = curl_easy_perform(curl);
+    CURLcode rc = req_prepare_get(req, url, custom_hdrv, custom_hdrc);
     if (rc != CURLE_OK)
         return rc;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
 
-    req->code = code;
-    if (slist != NULL)
-        curl_slist_free_all(slist);
-    req->ok = check_ok(code);
-    free(ua);
-
-    return rc;
+    if (req->cache != NULL)
+        return cache_perform(req, custom_hdrv, custom_hdrc);
+    if (req->disk_cache != NULL)
+        return disk_cache_perform(req, custom_hdrv, custom_hdrc);
+    return req_perform_get(req, custom_hdrv, custom_hdrc);
 }
 
 /*
- * requests_url_encode - Url encoding function. Takes as input an array of
- * char strings and the size of the array. The array should consist of keys
- * and the corresponding value immediately after in the array. There must be
- * an even number of array elements (one value for every key).
+ * req_prepare_get - Sets up the curl handle of `req' for a GET request
+ * without performing it. Used by the blocking path above as well as the
+ * batch engine.
  *
- * Returns pointer to url encoded string if successful, or NULL if
- * unsuccessful. Returned pointer must be free'd with `curl_free`
+ * Returns CURLE_OK on success, or the error from processing the custom
+ * headers.
  *
  * @req:  request struct
- * @data:      char* array as described above
- * @data-size: length of array
+ * @url:  url to send request to
+ * @custom_hdrv: char* array of custom headers, may be NULL
+ * @custom_hdrc: length of `custom_hdrv`
  */
-char *requests_url_encode(req_t *req, char **data, int data_size)
+CURLcode req_prepare_get(req_t *req, char *url,
+                         char **custom_hdrv, int custom_hdrc)
 {
-    char *key, *val, *tmp;
-    int offset;
-    size_t term_size;
-    size_t tmp_len;
+    CURLcode rc;
     CURL *curl = req->curlhandle;
+    req->url = url;
 
-    if (data_size % 2 != 0)
-        return NULL;
-
-    /* loop through and get total sum of lengths */
-    size_t total_size = 0;
-    for (int i = 0; i < data_size; i++) {
-        tmp = data[i];
-        tmp_len = strlen(tmp);
-        total_size += tmp_len;
+    /* headers */
+    if (custom_hdrv != NULL) {
+        rc = process_custom_headers(&req->slist, req, custom_hdrv,
+                                    custom_hdrc);
+        if (rc != CURLE_OK)
+            return rc;
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->slist);
     }
 
-    char encoded[total_size]; /* clear junk bytes */
-    snprintf(encoded, total_size, "%s", "");
-
-    /* loop in groups of two, assembling key/val pairs */
-    for (int i = 0; i < data_size; i+=2) {
-        key = data[i];
-        val = data[i+1];
-        offset = i == 0 ? 2 : 3; /* =, \0 and maybe & */
-        term_size = strlen(key) + strlen(val) + offset;
-        char term[term_size];
-        if (i == 0)
-            snprintf(term, term_size, "%s=%s", key, val);
-        else
-            snprintf(term, term_size, "&%s=%s", key, val);
-        strncat(encoded, term, strlen(term));
-    }
+    req_common_opt(req);
+    return CURLE_OK;
+}
 
-    char *full_encoded = curl_easy_escape(curl, encoded, strlen(encoded));
+/*
+ * requests_set_sink - Streams response bodies of subsequent requests on `req'
+ * to `sink' instead of accumulating them in `text', which stays empty. `size'
+ * still counts the bytes received. Applies to GET, POST and PUT alike and
+ * stays in effect until cleared by passing NULL for `sink'.
+ *
+ * @req:      request struct
+ * @sink:     function called with each chunk of the body, or NULL
+ * @userdata: passed through to `sink' untouched
+ */
+void requests_set_sink(req_t *req, requests_sink_fn sink, void *userdata)
+{
+    req->sink = sink;
+    req->sink_data = userdata;
+}
 
-    return full_encoded;
+/*
+ * requests_set_http2 - Picks the HTTP version subsequent requests on `req'
+ * negotiate. With HTTP/2, requests to the same origin that run at the same
+ * time in a batch, loop or async context share one connection, each as its
+ * own stream, instead of opening a connection apiece. Stays in effect across
+ * requests_reset().
+ *
+ * @req:  request struct
+ * @mode: REQUESTS_HTTP_DEFAULT (the default) to leave the choice to libcurl,
+ *        REQUESTS_HTTP1 for HTTP/1.1 only, REQUESTS_HTTP2 to offer HTTP/2
+ *        through ALPN on https:// URLs, or REQUESTS_HTTP2_PRIOR_KNOWLEDGE to
+ *        speak HTTP/2 straight away, which is also how to reach h2c servers
+ */
+void requests_set_http2(req_t *req, requests_http2_t mode)
+{
+    req->http2 = mode;
+    req->prepared = NULL;   /* a prepared request must pick up the change */
 }
 
 CURLcode requests_post(req_t *req, char *url, char *data)
@@ -335,58 +456,275 @@ CURLcode requests_put_headers(req_t *req, char *url, char *data,
 static CURLcode requests_pt(req_t *req, char *url, char *data,
                             char **custom_hdrv, int custom_hdrc, int put_flag)
 {
-    CURLcode rc;
-    struct curl_slist *slist = NULL;
+    CURLcode rc = req_prepare_pt(req, url, data, custom_hdrv, custom_hdrc,
+                                 put_flag);
+    if (rc != CURLE_OK)
+        return rc;
+
+    return req_perform(req);
+}
+
+/*
+ * req_prepare_pt - Sets up the curl handle of `req' for a POST or PUT
+ * request without performing it. See requests_pt() for the parameters.
+ *
+ * Returns CURLE_OK on success, or -1 if libcurl's linked list append fails.
+ */
+CURLcode req_prepare_pt(req_t *req, char *url, char *data,
+                        char **custom_hdrv, int custom_hdrc, int put_flag)
+{
+    return req_prepare_data(req, url, data, data != NULL ? strlen(data) : 0,
+                            custom_hdrv, custom_hdrc, put_flag);
+}
+
+/*
+ * req_prepare_data - req_prepare_pt() for a body of `len' bytes, which may
+ * contain NULL bytes. libcurl sends it from `data' without copying, so it
+ * must stay around until the request is done. NULL sends an empty body.
+ */
+CURLcode req_prepare_data(req_t *req, char *url, const char *data,
+                          size_t len, char **custom_hdrv, int custom_hdrc,
+                          int put_flag)
+{
     req->url = url;
     CURL *curl = req->curlhandle;
 
     /* body data */
-    if (data != NULL) {
+    if (data != NULL && (req->compression & REQUESTS_ENCODE_GZIP)) {
+        char *ce_header = "Content-Encoding: gzip";
+        if (req_gzip_body(req, data, len))
+            return CURLE_OUT_OF_MEMORY;
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t) req->zbody_size);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->zbody);
+
+        req->slist = curl_slist_append(req->slist, ce_header);
+        if (req->slist == NULL)
+            return (CURLcode) -1;
+        if (custom_hdrv == NULL)
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->slist);
+
+        if (arena_append(&req->req_arena, &req->req_hdrv, &req->req_hdrc,
+                         ce_header, strlen(ce_header)))
+            return CURLE_OUT_OF_MEMORY;
+    } else if (data != NULL) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) len);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
     } else {
+        /* without any POSTFIELDS curl reads the body from stdin, so the
+           empty body has to be given explicitly */
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) 0);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+
         /* content length header defaults to -1, which causes request to fail
            sometimes, so we need to manually set it to 0 */
         char *cl_header = "Content-Length: 0";
-        slist = curl_slist_append(slist, cl_header);
-        if (slist == NULL)
+        req->slist = curl_slist_append(req->slist, cl_header);
+        if (req->slist == NULL)
             return (CURLcode) -1;
         if (custom_hdrv == NULL)
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->slist);
 
-        hdrv_append(&req->req_hdrv, &req->req_hdrc, cl_header);
+        if (arena_append(&req->req_arena, &req->req_hdrv, &req->req_hdrc,
+                         cl_header, strlen(cl_header)))
+            return CURLE_OUT_OF_MEMORY;
     }
 
+    return req_prepare_method(req, custom_hdrv, custom_hdrc, put_flag);
+}
+
+/*
+ * req_prepare_method - Finishes setting up a POST or PUT whose body options
+ * are in place: custom headers, common options and the method.
+ */
+CURLcode req_prepare_method(req_t *req, char **custom_hdrv, int custom_hdrc,
+                            int put_flag)
+{
+    CURL *curl = req->curlhandle;
+    CURLcode rc;
+
     /* headers */
     if (custom_hdrv != NULL) {
-        rc = process_custom_headers(&slist, req, custom_hdrv, custom_hdrc);
+        rc = process_custom_headers(&req->slist, req, custom_hdrv,
+                                    custom_hdrc);
         if (rc != CURLE_OK)
             return rc;
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->slist);
     }
 
-    common_opt(req);
+    req_common_opt(req);
     if (put_flag)
         /* use custom request instead of dedicated PUT, because dedicated
            PUT doesn't work with arbitrary request body data */
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
     else
         curl_easy_setopt(curl, CURLOPT_POST, 1);
-    char *ua = user_agent();
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, ua);
-    rc = curl_easy_perform(curl);
-    if (rc != CURLE_OK)
-        return rc;
 
-    long code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    return CURLE_OK;
+}
+
+/*
+ * req_perform - Runs a set up request to completion on the calling thread,
+ * trying again as the request's retry policy allows.
+ *
+ * Returns the CURLcode provided from the last curl_easy_perform.
+ */
+CURLcode req_perform(req_t *req)
+{
+    CURLcode rc;
+
+    for (;;) {
+        rc = curl_easy_perform(req->curlhandle);
+        if (req->retry == NULL || retry_wait(req, rc))
+            break;
+        /* the handle keeps its options and connection for the next try */
+        req->attempts++;
+        req->upload_pos = req->upload_start;
+        req_clear_response(req);
+    }
+    req_finish(req, rc);
+    return rc;
+}
+
+/*
+ * req_perform_get - Sends a GET set up by req_prepare_get() over the
+ * network, hedged if `req' has a hedge set. The caches use this for their
+ * misses and revalidations.
+ *
+ * Returns the CURLcode of the transfer.
+ *
+ * @req:         request struct
+ * @custom_hdrv: the custom headers the GET was set up with, for the hedge
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode req_perform_get(req_t *req, char **custom_hdrv, int custom_hdrc)
+{
+    if (req->hedge != NULL)
+        return hedge_perform(req, custom_hdrv, custom_hdrc);
+    return req_perform(req);
+}
+
+/*
+ * req_replay - Replaces the response on `req' with a stored one, passing it
+ * through the same header and body handling as a response off the network,
+ * sink included.
+ *
+ * Returns 0 on success, or -1 on memory error or if the sink gives up.
+ *
+ * @req:  request struct
+ * @code: response code
+ * @hdrs: `hdrc' NULL terminated header lines, back to back
+ * @body: response body
+ * @len:  length of `body'
+ */
+int req_replay(req_t *req, long code, const char *hdrs, int hdrc,
+               const char *body, size_t len)
+{
+    req_clear_response(req);
+
+    for (int i = 0; i < hdrc; i++) {
+        size_t n = strlen(hdrs);
+        if (header_callback((char *) hdrs, 1, n, req) != n)
+            return -1;
+        hdrs += n + 1;
+    }
+    if (len > 0 && resp_callback((char *) body, 1, len, req) != len)
+        return -1;
+
     req->code = code;
     req->ok = check_ok(code);
+    req->result = CURLE_OK;
+    return 0;
+}
 
-    if (slist != NULL)
-        curl_slist_free_all(slist);
-    free(ua);
+/*
+ * req_clear_response - Forgets the response headers and body received so
+ * far, keeping their memory, so another response can take their place.
+ *
+ * @req: request struct
+ */
+void req_clear_response(req_t *req)
+{
+    req_unmap(req);
+    arena_reset(&req->resp_arena, &req->resp_hdrc);
+    hdr_index_reset(&req->resp_index);
+    req->size = 0;
+    req->text[0] = '\0';
+}
 
-    return rc;
+/*
+ * req_map_body - Points `text' at a body inside a mapped file instead of
+ * copying it. The mapping belongs to `req' from now on and goes away with
+ * the next request, requests_reset() or requests_close().
+ *
+ * @req:     request struct
+ * @map:     start of the mapping
+ * @map_len: length of the mapping
+ * @body:    NULL terminated body inside the mapping
+ * @len:     length of `body'
+ */
+void req_map_body(req_t *req, void *map, size_t map_len, const char *body,
+                  size_t len)
+{
+    req_unmap(req);
+    req->own_text = req->text;
+    req->map = map;
+    req->map_len = map_len;
+    req->text = (char *) body;
+    req->size = len;
+}
+
+/*
+ * req_unmap - Drops a mapped body, if any, and gives `text' its own buffer
+ * back, empty.
+ *
+ * @req: request struct
+ */
+void req_unmap(req_t *req)
+{
+    if (req->map == NULL)
+        return;
+
+    munmap(req->map, req->map_len);
+    req->map = NULL;
+    req->map_len = 0;
+    req->text = req->own_text;
+    req->own_text = NULL;
+    req->text[0] = '\0';
+    req->size = 0;
+}
+
+/*
+ * req_finish - Populates the response code fields of `req' once its transfer
+ * has completed, whether by curl_easy_perform or through a multi handle, and
+ * releases the per-transfer header list.
+ *
+ * @req: request struct
+ * @rc:  result of the transfer
+ */
+void req_finish(req_t *req, CURLcode rc)
+{
+    long code;
+    curl_off_t wire;
+
+    req->result = rc;
+    req->attempts++;
+    if (rc == CURLE_OK) {
+        curl_easy_getinfo(req->curlhandle, CURLINFO_RESPONSE_CODE, &code);
+        req->code = code;
+        req->ok = check_ok(code);
+    }
+    /* counted before any content decoding, unlike `size' */
+    if (curl_easy_getinfo(req->curlhandle, CURLINFO_SIZE_DOWNLOAD_T,
+                          &wire) == CURLE_OK)
+        req->wire_size = wire;
+    timing_collect(req);
+
+    if (req->slist != NULL) {
+        curl_easy_setopt(req->curlhandle, CURLOPT_HTTPHEADER, NULL);
+        curl_slist_free_all(req->slist);
+        req->slist = NULL;
+    }
 }
 
 /*
@@ -410,7 +748,8 @@ static CURLcode process_custom_headers(struct curl_slist **slist, req_t *req,
         *slist = curl_slist_append(*slist, custom_hdrv[i]);
         if (*slist == NULL)
             return (CURLcode) -1;
-        if (hdrv_append(&req->req_hdrv, &req->req_hdrc, custom_hdrv[i]))
+        if (arena_append(&req->req_arena, &req->req_hdrv, &req->req_hdrc,
+                         custom_hdrv[i], strlen(custom_hdrv[i])))
             return CURLE_OUT_OF_MEMORY;
     }
 
@@ -418,54 +757,112 @@ static CURLcode process_custom_headers(struct curl_slist **slist, req_t *req,
 }
 
 /*
- * hdrv_append - Appends to an arbitrary char* array and increments the given
- * array length.
+ * text_reserve - Ensures the response buffer can hold at least `need' bytes.
+ * The buffer grows geometrically so that a body delivered in many chunks
+ * costs a logarithmic number of reallocs rather than one per chunk.
  *
- * Returns 0 on success and -1 on memory error.
+ * Returns 0 on success and -1 on memory error, in which case the buffer is
+ * left untouched.
  *
- * @hdrv: pointer to the char* array
- * @hdrc: length of `hdrv' (NOTE: this value gets updated)
- * @_new: char* to append
+ * @req:  request struct
+ * @need: required capacity in bytes, including the NULL terminator
  */
-static int hdrv_append(char ***hdrv, int *hdrc, char *_new)
+static int text_reserve(req_t *req, size_t need)
 {
-    /* current array size in bytes */
-    size_t current_size = *hdrc * sizeof(char*);
-    char *newdup = strndup(_new, strlen(_new));
-    if (newdup == NULL)
-        return -1;
+    size_t cap = req->text_cap;
+    char *text;
 
-    *hdrv = (char**) realloc(*hdrv, current_size + sizeof(char*));
-    if (*hdrv == NULL)
+    if (need <= cap)
+        return 0;
+
+    /* at least double, or jump straight to `need' if that's larger */
+    if (cap > SIZE_MAX / 2 || cap * 2 < need)
+        cap = need;
+    else
+        cap *= 2;
+
+    text = mem_grow(&req->mem, req->text, req->text_cap, cap);
+    if (text == NULL)
         return -1;
-    (*hdrc)++;
-    (*hdrv)[*hdrc - 1] = newdup;
+
+    req->text = text;
+    req->text_cap = cap;
+    req->text_reallocs++;
     return 0;
 }
 
 /*
- * common_opt - Sets common libcurl options.
+ * req_common_opt - Sets common libcurl options.
  *
- * @curl: libcurl handle
  * @req: request struct
  */
-static void common_opt(req_t *req)
+void req_common_opt(req_t *req)
 {
     CURL *curl = req->curlhandle;
+
+    /* the response is about to be written into `text' */
+    req_unmap(req);
+    upload_clear(req);
+    req->attempts = 0;
+    req->retry_wait_ms = 0;
+    memset(&req->timing, 0, sizeof(req->timing));
+
     curl_easy_setopt(curl, CURLOPT_URL, req->url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, req);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent());
+
+    switch (req->http2) {
+    case REQUESTS_HTTP2:
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        break;
+    case REQUESTS_HTTP2_PRIOR_KNOWLEDGE:
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                         CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        break;
+    case REQUESTS_HTTP1:
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        break;
+    default:
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_NONE);
+        break;
+    }
+
+    /* "" offers every encoding this libcurl can decode */
+    if (req->compression & REQUESTS_DECODE)
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    /* concurrent HTTP/2 requests wait for a connection that is still being
+     * set up so they can multiplex on it rather than opening their own */
+    if (req->http2 == REQUESTS_HTTP2 ||
+        req->http2 == REQUESTS_HTTP2_PRIOR_KNOWLEDGE)
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+
+    /* the handle no longer holds a prepared request's options as-is */
+    req->prepared = NULL;
 }
 
+static pthread_once_t ua_once = PTHREAD_ONCE_INIT;
+static char ua_buf[256];
+
 /*
- * user_agent - Creates custom user agent.
- *
- * Returns a char* containing the user agent, or NULL on failure.
+ * user_agent - Returns the custom user agent. It only depends on the running
+ * kernel, so it is built once per process and shared by every request.
  */
-static char *user_agent(void)
+static const char *user_agent(void)
+{
+    pthread_once(&ua_once, user_agent_init);
+    return ua_buf;
+}
+
+/*
+ * user_agent_init - Builds the custom user agent into `ua_buf'. Called once
+ * through user_agent().
+ */
+static void user_agent_init(void)
 {
     struct utsname name;
     uname(&name);
@@ -473,12 +870,7 @@ static char *user_agent(void)
     char *version = name.release;
 
     const char* fmt = "librequests/%s %s/%s";
-    size_t len = snprintf(NULL, 0, fmt, __LIBREQ_VERS__, kernel, version);
-
-    char *ua = malloc(len + 1);
-    snprintf(ua, len + 1, fmt, __LIBREQ_VERS__, kernel, version);
-
-    return ua;
+    snprintf(ua_buf, sizeof(ua_buf), fmt, __LIBREQ_VERS__, kernel, version);
 }
 
 /*
@@ -0,0 +1,258 @@
+/*
+ * retry.c -- librequests: trying failed requests again, with backoff
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "requests.h"
+#include "internal.h"
+
+static const CURLcode default_errv[] = {
+    CURLE_COULDNT_RESOLVE_HOST,
+    CURLE_COULDNT_CONNECT,
+    CURLE_OPERATION_TIMEDOUT,
+    CURLE_SSL_CONNECT_ERROR,
+    CURLE_SEND_ERROR,
+    CURLE_RECV_ERROR,
+    CURLE_GOT_NOTHING,
+    CURLE_PARTIAL_FILE,
+    CURLE_HTTP2,
+    CURLE_HTTP2_STREAM
+};
+
+static const long default_statusv[] = { 408, 429, 500, 502, 503, 504 };
+
+/*
+ * Prototypes
+ */
+static int retryable(const requests_retry_t *policy, CURLcode rc, long code);
+static int may_resend(req_t *req, CURLcode rc);
+static long backoff(const requests_retry_t *policy, int attempt);
+static long retry_after(req_t *req);
+static void sleep_ms(long ms);
+static uint64_t random_u64(void);
+
+/*
+ * requests_retry_init - Fills in the default retry policy: three tries in
+ * all, with backoff ceilings of 100 ms and then 200 ms, on connection
+ * failures, timeouts, broken transfers and the responses 408, 429, 500,
+ * 502, 503 and 504. Retry-After is honoured up to 30 s. Only idempotent
+ * methods are tried again once the request may have reached the server.
+ *
+ * @policy: retry policy struct
+ */
+void requests_retry_init(requests_retry_t *policy)
+{
+    policy->max_attempts = 3;
+    policy->base_ms = 100;
+    policy->max_backoff_ms = 10000;
+    policy->max_retry_after_ms = 30000;
+    policy->retry_unsafe = 0;
+    policy->errv = NULL;
+    policy->errc = 0;
+    policy->statusv = NULL;
+    policy->statusc = 0;
+}
+
+/*
+ * requests_set_retry - Tries subsequent blocking requests on `req' again
+ * when they fail in a way `policy' calls retryable. Before each new try the
+ * calling thread sleeps for a random time between 0 and a ceiling that
+ * doubles from try to try ("full jitter"), so clients that failed together
+ * don't come back together. A Retry-After header on the response stretches
+ * the wait to at least what it asks for. Each try reuses the handle, and
+ * with it the connection if the server kept it open.
+ *
+ * The response of the last try is what `req' ends up with; `attempts' and
+ * `retry_wait_ms' tell how it got there. A response already handed to a
+ * sink is never retried. Requests run by a batch, loop or async context
+ * are not retried. `policy' must stay around while set. Stays in effect
+ * across requests_reset(); passing NULL turns retries off.
+ *
+ * @req:    request struct
+ * @policy: policy set up with requests_retry_init(), or NULL for none
+ */
+void requests_set_retry(req_t *req, const requests_retry_t *policy)
+{
+    req->retry = policy;
+}
+
+/*
+ * retry_wait - Decides whether the try `req' just finished with `rc' should
+ * be repeated, and if so sleeps the backoff first.
+ *
+ * Returns 0 if the request should be tried again, or -1 if not.
+ */
+int retry_wait(req_t *req, CURLcode rc)
+{
+    const requests_retry_t *policy = req->retry;
+    long code = 0, wait;
+
+    /* `attempts' doesn't count the try that just finished yet */
+    if (req->attempts + 1 >= policy->max_attempts)
+        return -1;
+    /* there's no taking back what a sink has already passed on */
+    if (req->sink != NULL && req->size > 0)
+        return -1;
+    /* nor reading a body from a pipe a second time */
+    if (req->upload_fd >= 0 && req->upload_start < 0)
+        return -1;
+
+    if (rc == CURLE_OK)
+        curl_easy_getinfo(req->curlhandle, CURLINFO_RESPONSE_CODE, &code);
+    if (!retryable(policy, rc, code) || !may_resend(req, rc))
+        return -1;
+
+    wait = backoff(policy, req->attempts + 1);
+    if (rc == CURLE_OK) {
+        long after = retry_after(req);
+        if (after > policy->max_retry_after_ms)
+            return -1;
+        if (after > wait)
+            wait = after;
+    }
+
+    sleep_ms(wait);
+    req->retry_wait_ms += wait;
+    return 0;
+}
+
+/*
+ * retryable - Whether a transfer error, or else the response code, is on
+ * the policy's list.
+ */
+static int retryable(const requests_retry_t *policy, CURLcode rc, long code)
+{
+    if (rc != CURLE_OK) {
+        const CURLcode *errv = policy->errv ? policy->errv : default_errv;
+        int errc = policy->errv ? policy->errc :
+                   (int) (sizeof(default_errv) / sizeof(default_errv[0]));
+        for (int i = 0; i < errc; i++)
+            if (errv[i] == rc)
+                return 1;
+        return 0;
+    }
+
+    const long *statusv = policy->statusv ? policy->statusv : default_statusv;
+    int statusc = policy->statusv ? policy->statusc :
+                  (int) (sizeof(default_statusv) / sizeof(default_statusv[0]));
+    for (int i = 0; i < statusc; i++)
+        if (statusv[i] == code)
+            return 1;
+    return 0;
+}
+
+/*
+ * may_resend - Whether sending the request again is safe: always for
+ * idempotent methods, and for the others only if the failure came before
+ * any of the request could have left, or the policy says so.
+ */
+static int may_resend(req_t *req, CURLcode rc)
+{
+    char *method = NULL;
+
+    if (req->retry->retry_unsafe)
+        return 1;
+
+    switch (rc) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+        return 1;
+    default:
+        break;
+    }
+
+    curl_easy_getinfo(req->curlhandle, CURLINFO_EFFECTIVE_METHOD, &method);
+    if (method == NULL)
+        return 0;
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 ||
+           strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0 ||
+           strcmp(method, "OPTIONS") == 0;
+}
+
+/*
+ * backoff - A random wait before try number `attempt' + 1, uniform between
+ * 0 and base_ms * 2^(attempt - 1), capped at max_backoff_ms.
+ */
+static long backoff(const requests_retry_t *policy, int attempt)
+{
+    long ceiling = policy->base_ms;
+
+    if (ceiling <= 0)
+        return 0;
+    for (int i = 1; i < attempt && ceiling < policy->max_backoff_ms; i++)
+        ceiling *= 2;
+    if (ceiling > policy->max_backoff_ms)
+        ceiling = policy->max_backoff_ms;
+    return (long) (random_u64() % ((uint64_t) ceiling + 1));
+}
+
+/*
+ * retry_after - Reads the response's Retry-After header, either a number
+ * of seconds or an HTTP date.
+ *
+ * Returns the wait it asks for in ms, or -1 if there is none.
+ */
+static long retry_after(req_t *req)
+{
+    const char *value = requests_header(req, "retry-after");
+    char *end;
+
+    if (value == NULL)
+        return -1;
+
+    if (isdigit((unsigned char) *value)) {
+        long secs = strtol(value, &end, 10);
+        if (*end != '\0')
+            return -1;
+        return secs > LONG_MAX / 1000 ? LONG_MAX : secs * 1000;
+    }
+
+    time_t when = curl_getdate(value, NULL);
+    if (when < 0)
+        return -1;
+    time_t now = time(NULL);
+    return when > now ? (long) (when - now) * 1000 : 0;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * random_u64 - xorshift64*, one generator per thread, seeded from the clock
+ * and the address of its state so threads and processes started together
+ * don't draw the same waits.
+ */
+static uint64_t random_u64(void)
+{
+    static _Thread_local uint64_t state;
+
+    if (state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        state = ((uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec) ^
+                (uint64_t) (uintptr_t) &state ^ (uint64_t) getpid() << 32;
+        if (state == 0)
+            state = 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+}
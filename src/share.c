@@ -0,0 +1,111 @@
+/*
+ * share.c -- librequests: caches shared between request handles
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+
+/*
+ * Prototypes
+ */
+static void share_lock(CURL *curl, curl_lock_data data,
+                       curl_lock_access access, void *userptr);
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr);
+
+/*
+ * requests_share_init - Creates a set of caches that req_t handles can share
+ * through requests_init_shared(). Access is guarded by a read-write lock per
+ * cache, so handles on different threads may use it concurrently, except
+ * with REQUESTS_SHARE_CONNECT: libcurl's shared connection cache isn't safe
+ * across threads, so it is left out of REQUESTS_SHARE_ALL and is for
+ * handles on a single thread only.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @share: reference to requests_share_t to be initialized
+ * @flags: which caches to share, any of the REQUESTS_SHARE_* flags or'd
+ *         together, or REQUESTS_SHARE_ALL for all that threads may share
+ */
+int requests_share_init(requests_share_t *share, int flags)
+{
+    CURLSH *sh;
+    int i;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        if (pthread_rwlock_init(&share->locks[i], NULL) != 0)
+            goto fail_locks;
+    }
+
+    sh = curl_share_init();
+    if (sh == NULL)
+        goto fail_locks;
+
+    curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(sh, CURLSHOPT_USERDATA, share);
+
+    if (flags & REQUESTS_SHARE_DNS &&
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS))
+        goto fail_share;
+    if (flags & REQUESTS_SHARE_SSL &&
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION))
+        goto fail_share;
+    if (flags & REQUESTS_SHARE_CONNECT &&
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT))
+        goto fail_share;
+
+    share->sharehandle = sh;
+    share->flags = flags;
+    return 0;
+
+fail_share:
+    curl_share_cleanup(sh);
+fail_locks:
+    while (i-- > 0)
+        pthread_rwlock_destroy(&share->locks[i]);
+    return -1;
+}
+
+/*
+ * requests_share_close - Frees the shared caches. Every req_t attached to
+ * `share' must have been closed with requests_close() first.
+ *
+ * @share: share struct
+ */
+void requests_share_close(requests_share_t *share)
+{
+    curl_share_cleanup(share->sharehandle);
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_rwlock_destroy(&share->locks[i]);
+}
+
+/*
+ * share_lock - libcurl lock callback. Readers of a cache share its lock,
+ * writers take it exclusively.
+ */
+static void share_lock(CURL *curl, curl_lock_data data,
+                       curl_lock_access access, void *userptr)
+{
+    requests_share_t *share = userptr;
+
+    if (access == CURL_LOCK_ACCESS_SHARED)
+        pthread_rwlock_rdlock(&share->locks[data]);
+    else
+        pthread_rwlock_wrlock(&share->locks[data]);
+}
+
+/*
+ * share_unlock - libcurl unlock callback.
+ */
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+    requests_share_t *share = userptr;
+
+    pthread_rwlock_unlock(&share->locks[data]);
+}
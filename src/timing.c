@@ -0,0 +1,439 @@
+/*
+ * timing.c -- librequests: per-request phase timings and per-host latency
+ * histograms
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include "requests.h"
+#include "internal.h"
+
+#define LATENCY_MIN_BUCKETS 16
+
+/*
+ * Histogram buckets are exact below 8 us, then split every power of two
+ * into 4, so a bucket is never wider than 1/4 of its lower bound. 160
+ * buckets reach past 2^41 us, about 25 days.
+ */
+#define HIST_BUCKETS 160
+
+typedef struct {
+    unsigned long count;
+    curl_off_t sum;
+    curl_off_t min;
+    curl_off_t max;
+    unsigned long hist[HIST_BUCKETS];
+} latency_phase_t;
+
+struct requests_latency_host {
+    requests_latency_host_t *next;   /* hash chain */
+    unsigned hash;
+    latency_phase_t phases[REQUESTS_PHASE_COUNT];
+    char name[];
+};
+
+static const char *phase_names[REQUESTS_PHASE_COUNT] = {
+    "namelookup", "connect", "appconnect", "pretransfer",
+    "starttransfer", "total", "redirect"
+};
+
+/*
+ * Prototypes
+ */
+static int latency_record(requests_latency_t *agg, const char *host,
+                          size_t host_len, const requests_timing_t *timing);
+static requests_latency_host_t *latency_host(requests_latency_t *agg,
+                                             const char *host, size_t len,
+                                             int create);
+static int latency_grow(requests_latency_t *agg);
+static void latency_summarize(const latency_phase_t *phase,
+                              requests_latency_summary_t *summary);
+static curl_off_t phase_value(const requests_timing_t *timing,
+                              requests_phase_t phase);
+static int hist_bucket(curl_off_t us);
+static curl_off_t hist_upper(int bucket);
+static const char *url_host(const char *url, size_t *len);
+static unsigned hash_host(const char *host, size_t len);
+
+/*
+ * timing_collect - Reads the phase timings and byte counts of the transfer
+ * `req' just finished into `timing', and folds them into the request's
+ * latency aggregator, if it has one.
+ *
+ * @req: request struct
+ */
+void timing_collect(req_t *req)
+{
+    requests_timing_t *t = &req->timing;
+    CURL *curl = req->curlhandle;
+    curl_off_t up = 0, down = 0, body;
+    long hdrs;
+
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &t->namelookup_us);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &t->connect_us);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &t->appconnect_us);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &t->pretransfer_us);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T,
+                      &t->starttransfer_us);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &t->total_us);
+    curl_easy_getinfo(curl, CURLINFO_REDIRECT_TIME_T, &t->redirect_us);
+
+    if (curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &hdrs) == CURLE_OK)
+        up += hdrs;
+    if (curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &body) == CURLE_OK)
+        up += body;
+    if (curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &hdrs) == CURLE_OK)
+        down += hdrs;
+    if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &body) == CURLE_OK)
+        down += body;
+    t->bytes_up = up;
+    t->bytes_down = down;
+
+    if (req->latency != NULL && req->result == CURLE_OK) {
+        char *url = NULL;
+        size_t len;
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+        const char *host = url != NULL ? url_host(url, &len) : NULL;
+        if (host != NULL)
+            latency_record(req->latency, host, len, t);
+    }
+}
+
+/*
+ * requests_latency_init - Sets up an empty latency aggregator.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @agg: latency aggregator struct
+ */
+int requests_latency_init(requests_latency_t *agg)
+{
+    agg->hostc = 0;
+    agg->bucketc = LATENCY_MIN_BUCKETS;
+    agg->buckets = mem_calloc(agg->bucketc, sizeof(*agg->buckets));
+    if (agg->buckets == NULL)
+        return -1;
+    if (pthread_mutex_init(&agg->lock, NULL) != 0) {
+        mem_free(agg->buckets);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * requests_latency_close - Frees the aggregator's hosts. No req_t may still
+ * be feeding it.
+ *
+ * @agg: latency aggregator struct
+ */
+void requests_latency_close(requests_latency_t *agg)
+{
+    for (size_t i = 0; i < agg->bucketc; i++) {
+        requests_latency_host_t *h = agg->buckets[i], *next;
+        for (; h != NULL; h = next) {
+            next = h->next;
+            mem_free(h);
+        }
+    }
+    mem_free(agg->buckets);
+    pthread_mutex_destroy(&agg->lock);
+}
+
+/*
+ * requests_set_latency - Folds the timings of every transfer `req' completes
+ * from now on into `agg', under the host (and port, if the URL names one)
+ * the request ended up at. Failed transfers are left out. Works for
+ * blocking requests as well as batches, loops and async contexts. Passing
+ * NULL stops it.
+ *
+ * @req: request struct
+ * @agg: aggregator set up with requests_latency_init(), or NULL
+ */
+void requests_set_latency(req_t *req, requests_latency_t *agg)
+{
+    req->latency = agg;
+}
+
+/*
+ * requests_latency_add - Folds a timing into `agg' by hand, e.g. one kept
+ * from a request made elsewhere.
+ *
+ * Returns 0 on success, or -1 on memory error.
+ *
+ * @agg:    latency aggregator struct
+ * @host:   host to file it under
+ * @timing: the timing
+ */
+int requests_latency_add(requests_latency_t *agg, const char *host,
+                         const requests_timing_t *timing)
+{
+    return latency_record(agg, host, strlen(host), timing);
+}
+
+/*
+ * requests_latency_summary - Summarizes one phase of the requests made to
+ * `host', as passed to requests_latency_add() or, for requests fed in by
+ * requests_set_latency(), as in the URL: "example.com" or
+ * "127.0.0.1:8080".
+ *
+ * Returns 0 on success, or -1 if nothing was recorded for `host'.
+ *
+ * @agg:     latency aggregator struct
+ * @host:    host to summarize
+ * @phase:   which phase
+ * @summary: filled in with the summary
+ */
+int requests_latency_summary(requests_latency_t *agg, const char *host,
+                             requests_phase_t phase,
+                             requests_latency_summary_t *summary)
+{
+    if ((unsigned) phase >= REQUESTS_PHASE_COUNT)
+        return -1;
+
+    pthread_mutex_lock(&agg->lock);
+    requests_latency_host_t *h = latency_host(agg, host, strlen(host), 0);
+    if (h != NULL)
+        latency_summarize(&h->phases[phase], summary);
+    pthread_mutex_unlock(&agg->lock);
+    return h != NULL && summary->count > 0 ? 0 : -1;
+}
+
+/*
+ * requests_latency_dump - Writes a table of every host and phase recorded
+ * so far to `out', times in milliseconds, for reading during an incident.
+ *
+ * @agg: latency aggregator struct
+ * @out: where to write it, e.g. stderr
+ */
+void requests_latency_dump(requests_latency_t *agg, FILE *out)
+{
+    requests_latency_summary_t s;
+
+    fprintf(out, "%-24s %-14s %8s %9s %9s %9s %9s %9s\n", "host", "phase",
+            "count", "min_ms", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+
+    pthread_mutex_lock(&agg->lock);
+    for (size_t i = 0; i < agg->bucketc; i++) {
+        for (requests_latency_host_t *h = agg->buckets[i]; h != NULL;
+             h = h->next) {
+            for (int p = 0; p < REQUESTS_PHASE_COUNT; p++) {
+                latency_summarize(&h->phases[p], &s);
+                if (s.count == 0)
+                    continue;
+                fprintf(out, "%-24s %-14s %8lu %9.3f %9.3f %9.3f %9.3f "
+                        "%9.3f\n", h->name, phase_names[p], s.count,
+                        s.min_us / 1e3, s.p50_us / 1e3, s.p90_us / 1e3,
+                        s.p99_us / 1e3, s.max_us / 1e3);
+            }
+        }
+    }
+    pthread_mutex_unlock(&agg->lock);
+}
+
+/*
+ * latency_record - Adds a timing to the histograms of `host'. Phases that
+ * didn't happen (a reused connection does no lookup, plain HTTP does no
+ * TLS, most requests aren't redirected) are left out of their phase.
+ *
+ * Returns 0 on success, or -1 on memory error.
+ */
+static int latency_record(requests_latency_t *agg, const char *host,
+                          size_t host_len, const requests_timing_t *timing)
+{
+    pthread_mutex_lock(&agg->lock);
+    requests_latency_host_t *h = latency_host(agg, host, host_len, 1);
+    if (h == NULL) {
+        pthread_mutex_unlock(&agg->lock);
+        return -1;
+    }
+
+    for (int p = 0; p < REQUESTS_PHASE_COUNT; p++) {
+        latency_phase_t *ph = &h->phases[p];
+        curl_off_t us = phase_value(timing, p);
+        if (us <= 0 && p != REQUESTS_PHASE_TOTAL)
+            continue;
+
+        if (ph->count == 0 || us < ph->min)
+            ph->min = us;
+        if (ph->count == 0 || us > ph->max)
+            ph->max = us;
+        ph->count++;
+        ph->sum += us;
+        ph->hist[hist_bucket(us)]++;
+    }
+    pthread_mutex_unlock(&agg->lock);
+    return 0;
+}
+
+/*
+ * latency_host - Looks `host' up, adding it with empty histograms if
+ * `create' is set. Called with the lock held.
+ *
+ * Returns the host, or NULL if it isn't there or can't be added.
+ */
+static requests_latency_host_t *latency_host(requests_latency_t *agg,
+                                             const char *host, size_t len,
+                                             int create)
+{
+    unsigned hash = hash_host(host, len);
+    requests_latency_host_t **bucket =
+        &agg->buckets[hash & (agg->bucketc - 1)];
+
+    for (requests_latency_host_t *h = *bucket; h != NULL; h = h->next)
+        if (h->hash == hash && strncmp(h->name, host, len) == 0 &&
+            h->name[len] == '\0')
+            return h;
+    if (!create)
+        return NULL;
+
+    requests_latency_host_t *h = mem_calloc(1, sizeof(*h) + len + 1);
+    if (h == NULL)
+        return NULL;
+    memcpy(h->name, host, len);
+    h->hash = hash;
+
+    /* a failed grow just leaves the chains longer */
+    if (agg->hostc + 1 > agg->bucketc)
+        latency_grow(agg);
+    bucket = &agg->buckets[hash & (agg->bucketc - 1)];
+    h->next = *bucket;
+    *bucket = h;
+    agg->hostc++;
+    return h;
+}
+
+/*
+ * latency_grow - Doubles the hash table.
+ *
+ * Returns 0 on success, or -1 on memory error.
+ */
+static int latency_grow(requests_latency_t *agg)
+{
+    size_t bucketc = agg->bucketc * 2;
+    requests_latency_host_t **buckets = mem_calloc(bucketc, sizeof(*buckets));
+    if (buckets == NULL)
+        return -1;
+
+    for (size_t i = 0; i < agg->bucketc; i++) {
+        requests_latency_host_t *h = agg->buckets[i], *next;
+        for (; h != NULL; h = next) {
+            next = h->next;
+            h->next = buckets[h->hash & (bucketc - 1)];
+            buckets[h->hash & (bucketc - 1)] = h;
+        }
+    }
+    mem_free(agg->buckets);
+    agg->buckets = buckets;
+    agg->bucketc = bucketc;
+    return 0;
+}
+
+/*
+ * latency_summarize - Reads count, extremes, mean and percentiles off a
+ * phase's histogram. A percentile is reported as the upper bound of its
+ * bucket, clamped to the largest value seen.
+ */
+static void latency_summarize(const latency_phase_t *phase,
+                              requests_latency_summary_t *summary)
+{
+    static const int pct[] = { 50, 90, 99 };
+    curl_off_t *out[] = { &summary->p50_us, &summary->p90_us,
+                          &summary->p99_us };
+
+    memset(summary, 0, sizeof(*summary));
+    if (phase->count == 0)
+        return;
+
+    summary->count = phase->count;
+    summary->min_us = phase->min;
+    summary->max_us = phase->max;
+    summary->mean_us = phase->sum / (curl_off_t) phase->count;
+
+    for (int i = 0; i < 3; i++) {
+        /* the rank of the percentile, counting from 1 */
+        unsigned long rank = (phase->count * pct[i] + 99) / 100, seen = 0;
+        int b = 0;
+        while (b < HIST_BUCKETS - 1 && seen + phase->hist[b] < rank)
+            seen += phase->hist[b++];
+        curl_off_t v = hist_upper(b);
+        *out[i] = v > phase->max ? phase->max : v;
+    }
+}
+
+static curl_off_t phase_value(const requests_timing_t *timing,
+                              requests_phase_t phase)
+{
+    switch (phase) {
+    case REQUESTS_PHASE_NAMELOOKUP:    return timing->namelookup_us;
+    case REQUESTS_PHASE_CONNECT:       return timing->connect_us;
+    case REQUESTS_PHASE_APPCONNECT:    return timing->appconnect_us;
+    case REQUESTS_PHASE_PRETRANSFER:   return timing->pretransfer_us;
+    case REQUESTS_PHASE_STARTTRANSFER: return timing->starttransfer_us;
+    case REQUESTS_PHASE_TOTAL:         return timing->total_us;
+    case REQUESTS_PHASE_REDIRECT:      return timing->redirect_us;
+    default:                           return 0;
+    }
+}
+
+static int hist_bucket(curl_off_t us)
+{
+    int msb = 0;
+
+    if (us < 8)
+        return us < 0 ? 0 : (int) us;
+    for (curl_off_t v = us; v > 1; v >>= 1)
+        msb++;
+
+    int b = 8 + (msb - 3) * 4 + (int) ((us >> (msb - 2)) & 3);
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+static curl_off_t hist_upper(int bucket)
+{
+    if (bucket < 8)
+        return bucket;
+
+    int msb = 3 + (bucket - 8) / 4, sub = (bucket - 8) % 4;
+    curl_off_t width = (curl_off_t) 1 << (msb - 2);
+    return (4 + sub) * width + width - 1;
+}
+
+/*
+ * url_host - Finds the authority of `url', host and port, without any
+ * user info.
+ *
+ * Returns a pointer to it within `url' and sets `len', or NULL if `url' has
+ * none.
+ */
+static const char *url_host(const char *url, size_t *len)
+{
+    const char *p = strstr(url, "://"), *end, *at;
+
+    if (p == NULL)
+        return NULL;
+    p += 3;
+    end = p + strcspn(p, "/?#");
+    at = memchr(p, '@', end - p);
+    if (at != NULL)
+        p = at + 1;
+    *len = end - p;
+    return *len > 0 ? p : NULL;
+}
+
+/*
+ * hash_host - FNV-1a, as for header names.
+ */
+static unsigned hash_host(const char *host, size_t len)
+{
+    unsigned hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) host[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,413 @@
+/*
+ * upload.c -- librequests: request bodies from memory of any length, file
+ * descriptors, files and producer callbacks
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "requests.h"
+#include "internal.h"
+
+/* how long a paused producer waits at most before it is asked again */
+#define PRODUCER_RETRY_MS 100
+
+/*
+ * Prototypes
+ */
+static CURLcode upload_data(req_t *req, char *url, const char *data,
+                            size_t len, char **custom_hdrv, int custom_hdrc,
+                            int put_flag);
+static CURLcode upload_fd(req_t *req, char *url, int fd, curl_off_t len,
+                          char **custom_hdrv, int custom_hdrc, int put_flag);
+static CURLcode upload_file(req_t *req, char *url, const char *path,
+                            char **custom_hdrv, int custom_hdrc,
+                            int put_flag);
+static CURLcode upload_producer(req_t *req, char *url,
+                                requests_producer_fn producer, void *userdata,
+                                char **custom_hdrv, int custom_hdrc,
+                                int put_flag);
+static size_t produce(char *buf, size_t size, size_t nitems, void *userdata);
+static size_t upload_read(char *buf, size_t size, size_t nitems,
+                          void *userdata);
+static int upload_seek(void *userdata, curl_off_t offset, int origin);
+
+/*
+ * requests_post_data - Sends a POST whose body is `len' bytes at `data',
+ * which may hold NULL bytes, unlike requests_post(). libcurl sends straight
+ * from `data', so it must stay unchanged until the request returns.
+ *
+ * Returns the CURLcode of the transfer.
+ *
+ * @req:         request struct
+ * @url:         url to send request to
+ * @data:        request body
+ * @len:         length of `data'
+ * @custom_hdrv: char* array of custom headers, or NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode requests_post_data(req_t *req, char *url, const char *data,
+                            size_t len, char **custom_hdrv, int custom_hdrc)
+{
+    return upload_data(req, url, data, len, custom_hdrv, custom_hdrc, 0);
+}
+
+CURLcode requests_put_data(req_t *req, char *url, const char *data,
+                           size_t len, char **custom_hdrv, int custom_hdrc)
+{
+    return upload_data(req, url, data, len, custom_hdrv, custom_hdrc, 1);
+}
+
+/*
+ * requests_post_fd - Sends a POST whose body is read from `fd' as libcurl
+ * sends it, so memory use doesn't depend on the size of the body. Reading
+ * starts at the current offset of `fd', which is left where it was if `fd'
+ * can seek. A body that can't be re-read from a pipe or socket is never
+ * retried. REQUESTS_ENCODE_GZIP doesn't apply; the body goes out as is.
+ *
+ * Returns the CURLcode of the transfer.
+ *
+ * @req:         request struct
+ * @url:         url to send request to
+ * @fd:          file descriptor open for reading, still the caller's
+ * @len:         bytes to send, or -1 for the rest of a regular file, or for
+ *               everything up to end of file otherwise, sent with chunked
+ *               encoding as the length isn't known
+ * @custom_hdrv: char* array of custom headers, or NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode requests_post_fd(req_t *req, char *url, int fd, curl_off_t len,
+                          char **custom_hdrv, int custom_hdrc)
+{
+    return upload_fd(req, url, fd, len, custom_hdrv, custom_hdrc, 0);
+}
+
+CURLcode requests_put_fd(req_t *req, char *url, int fd, curl_off_t len,
+                         char **custom_hdrv, int custom_hdrc)
+{
+    return upload_fd(req, url, fd, len, custom_hdrv, custom_hdrc, 1);
+}
+
+/*
+ * requests_post_file - Sends a POST whose body is the file at `path',
+ * streamed like requests_post_fd() does. With REQUESTS_ENCODE_GZIP the
+ * file is mapped read-only instead and compressed into memory first. The
+ * file must not be truncated while the request runs.
+ *
+ * Returns the CURLcode of the transfer, or CURLE_READ_ERROR if the file
+ * can't be opened or mapped.
+ *
+ * @req:         request struct
+ * @url:         url to send request to
+ * @path:        file to send
+ * @custom_hdrv: char* array of custom headers, or NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode requests_post_file(req_t *req, char *url, const char *path,
+                            char **custom_hdrv, int custom_hdrc)
+{
+    return upload_file(req, url, path, custom_hdrv, custom_hdrc, 0);
+}
+
+CURLcode requests_put_file(req_t *req, char *url, const char *path,
+                           char **custom_hdrv, int custom_hdrc)
+{
+    return upload_file(req, url, path, custom_hdrv, custom_hdrc, 1);
+}
+
+/*
+ * requests_post_producer - Sends a POST whose body `producer' writes bit by
+ * bit while the request runs, for bodies whose length isn't known until
+ * they are complete. Over HTTP/1.1 the body is sent with chunked encoding.
+ * The request is never retried, as the body can't be produced twice.
+ *
+ * When the producer has nothing ready it returns REQUESTS_PRODUCE_PAUSE,
+ * which pauses sending. It is asked again once requests_resume_upload() is
+ * called, or after 100 ms if nobody calls it.
+ *
+ * Returns the CURLcode of the transfer.
+ *
+ * @req:         request struct
+ * @url:         url to send request to
+ * @producer:    writes the body, see requests_producer_fn
+ * @userdata:    passed to `producer'
+ * @custom_hdrv: char* array of custom headers, or NULL
+ * @custom_hdrc: length of `custom_hdrv`
+ */
+CURLcode requests_post_producer(req_t *req, char *url,
+                                requests_producer_fn producer, void *userdata,
+                                char **custom_hdrv, int custom_hdrc)
+{
+    return upload_producer(req, url, producer, userdata, custom_hdrv,
+                           custom_hdrc, 0);
+}
+
+CURLcode requests_put_producer(req_t *req, char *url,
+                               requests_producer_fn producer, void *userdata,
+                               char **custom_hdrv, int custom_hdrc)
+{
+    return upload_producer(req, url, producer, userdata, custom_hdrv,
+                           custom_hdrc, 1);
+}
+
+/*
+ * requests_resume_upload - Has the producer of the upload running on `req'
+ * asked for more right away, e.g. once the data it was waiting for is in.
+ * Unlike everything else on a req_t, it may be called from any thread
+ * while the request runs.
+ *
+ * @req: request struct
+ */
+void requests_resume_upload(req_t *req)
+{
+    if (req->upload_multi != NULL)
+        curl_multi_wakeup(req->upload_multi);
+}
+
+/*
+ * upload_clear - Forgets the body of the last upload, unmapping its file or
+ * freeing its multipart body.
+ */
+void upload_clear(req_t *req)
+{
+    /* unbinds itself from the curl handle, if that is still around */
+    curl_mime_free(req->mime);
+    req->mime = NULL;
+    if (req->upload_map != NULL)
+        munmap(req->upload_map, req->upload_map_len);
+    req->upload_map = NULL;
+    req->upload_map_len = 0;
+    req->upload_fd = -1;
+    req->upload_start = 0;
+    req->upload_pos = 0;
+    req->upload_len = -1;
+    req->producer = NULL;
+    req->producer_data = NULL;
+    req->upload_paused = 0;
+}
+
+static CURLcode upload_data(req_t *req, char *url, const char *data,
+                            size_t len, char **custom_hdrv, int custom_hdrc,
+                            int put_flag)
+{
+    CURLcode rc;
+
+    /* NULL would mean no body at all to req_prepare_data() */
+    rc = req_prepare_data(req, url, data != NULL ? data : "", len,
+                          custom_hdrv, custom_hdrc, put_flag);
+    if (rc != CURLE_OK)
+        return rc;
+    return req_perform(req);
+}
+
+static CURLcode upload_fd(req_t *req, char *url, int fd, curl_off_t len,
+                          char **custom_hdrv, int custom_hdrc, int put_flag)
+{
+    CURL *curl = req->curlhandle;
+    struct stat st;
+    off_t start;
+    CURLcode rc;
+
+    req->url = url;
+    rc = req_prepare_method(req, custom_hdrv, custom_hdrc, put_flag);
+    if (rc != CURLE_OK)
+        return rc;
+
+    start = lseek(fd, 0, SEEK_CUR);
+    if (len < 0 && start >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        len = st.st_size > start ? st.st_size - start : 0;
+
+    req->upload_fd = fd;
+    req->upload_start = start;
+    req->upload_pos = start;
+    req->upload_len = len;
+
+    /* the body comes from the callback rather than POSTFIELDS, and a PUT
+       needs telling that it has one */
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, len);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_read);
+    curl_easy_setopt(curl, CURLOPT_READDATA, req);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, upload_seek);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, req);
+    return req_perform(req);
+}
+
+static CURLcode upload_file(req_t *req, char *url, const char *path,
+                            char **custom_hdrv, int custom_hdrc, int put_flag)
+{
+    struct stat st;
+    void *map = NULL;
+    CURLcode rc;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return CURLE_READ_ERROR;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return CURLE_READ_ERROR;
+    }
+    if (!(req->compression & REQUESTS_ENCODE_GZIP)) {
+        rc = upload_fd(req, url, fd, st.st_size, custom_hdrv, custom_hdrc,
+                       put_flag);
+        close(fd);
+        return rc;
+    }
+
+    /* compression wants the whole body at once; an empty file has nothing
+       to map */
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return CURLE_READ_ERROR;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    rc = req_prepare_data(req, url, map != NULL ? map : "", st.st_size,
+                          custom_hdrv, custom_hdrc, put_flag);
+    /* kept until the next request, like the compressed copy */
+    req->upload_map = map;
+    req->upload_map_len = st.st_size;
+    if (rc != CURLE_OK)
+        return rc;
+    return req_perform(req);
+}
+
+/*
+ * upload_producer - Runs a produced upload on the calling thread through a
+ * multi handle of its own, so a paused transfer can be woken up.
+ */
+static CURLcode upload_producer(req_t *req, char *url,
+                                requests_producer_fn producer, void *userdata,
+                                char **custom_hdrv, int custom_hdrc,
+                                int put_flag)
+{
+    CURL *curl = req->curlhandle;
+    CURLcode rc;
+    int running;
+
+    /* created before the request starts, so requests_resume_upload() never
+       sees it change */
+    if (req->upload_multi == NULL) {
+        req->upload_multi = curl_multi_init();
+        if (req->upload_multi == NULL)
+            return CURLE_OUT_OF_MEMORY;
+    }
+
+    req->url = url;
+    rc = req_prepare_method(req, custom_hdrv, custom_hdrc, put_flag);
+    if (rc != CURLE_OK)
+        return rc;
+
+    req->producer = producer;
+    req->producer_data = userdata;
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) -1);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, produce);
+    curl_easy_setopt(curl, CURLOPT_READDATA, req);
+
+    if (curl_multi_add_handle(req->upload_multi, curl) != CURLM_OK)
+        return CURLE_OUT_OF_MEMORY;
+
+    for (;;) {
+        CURLMsg *msg;
+        int left, done = 0;
+
+        if (curl_multi_perform(req->upload_multi, &running) != CURLM_OK) {
+            rc = CURLE_OUT_OF_MEMORY;
+            break;
+        }
+        while ((msg = curl_multi_info_read(req->upload_multi, &left)))
+            if (msg->msg == CURLMSG_DONE) {
+                rc = msg->data.result;
+                done = 1;
+            }
+        if (done)
+            break;
+
+        curl_multi_poll(req->upload_multi, NULL, 0,
+                        req->upload_paused ? PRODUCER_RETRY_MS : 1000, NULL);
+        /* woken up or timed out: ask the producer again */
+        if (req->upload_paused) {
+            req->upload_paused = 0;
+            curl_easy_pause(curl, CURLPAUSE_CONT);
+        }
+    }
+
+    curl_multi_remove_handle(req->upload_multi, curl);
+    req_finish(req, rc);
+    return rc;
+}
+
+/*
+ * produce - libcurl's read callback for produced bodies.
+ */
+static size_t produce(char *buf, size_t size, size_t nitems, void *userdata)
+{
+    req_t *req = userdata;
+    size_t n = req->producer(buf, size * nitems, req->producer_data);
+
+    if (n == REQUESTS_PRODUCE_PAUSE)
+        req->upload_paused = 1;
+    return n;
+}
+
+/*
+ * upload_read - libcurl's read callback for bodies from a file descriptor.
+ * Reads at the body's own offset where possible, so the caller's file
+ * offset stays put and the body can be sent again.
+ */
+static size_t upload_read(char *buf, size_t size, size_t nitems,
+                          void *userdata)
+{
+    req_t *req = userdata;
+    size_t want = size * nitems;
+    ssize_t n;
+
+    if (req->upload_len >= 0) {
+        curl_off_t left = req->upload_len -
+                          (req->upload_pos - req->upload_start);
+        if (left <= 0)
+            return 0;
+        if ((curl_off_t) want > left)
+            want = left;
+    }
+
+    do {
+        if (req->upload_start >= 0)
+            n = pread(req->upload_fd, buf, want, req->upload_pos);
+        else
+            n = read(req->upload_fd, buf, want);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return CURL_READFUNC_ABORT;
+    req->upload_pos += n;
+    return n;
+}
+
+/*
+ * upload_seek - Rewinds the body for libcurl when it has to send it again,
+ * e.g. after a redirect or a reused connection that turned out dead.
+ */
+static int upload_seek(void *userdata, curl_off_t offset, int origin)
+{
+    req_t *req = userdata;
+
+    if (req->upload_start < 0 || origin != SEEK_SET)
+        return CURL_SEEKFUNC_CANTSEEK;
+    req->upload_pos = req->upload_start + offset;
+    return CURL_SEEKFUNC_OK;
+}
@@ -0,0 +1,955 @@
+/*
+ * server.c -- librequests: loopback HTTP server for tests and benchmarks
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "server.h"
+
+#ifdef TEST_SERVER_TLS
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
+#define CONN_BUF_SIZE  (64 * 1024)
+#define H2_PREFACE     "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_MAX   16384
+
+/* frame types and flags, RFC 9113 section 6 */
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+#define H2_END_STREAM    0x1
+#define H2_ACK           0x1
+#define H2_END_HEADERS   0x4
+
+typedef struct {
+    test_server_t *srv;
+    int fd;
+    char *buf;
+    size_t len;
+#ifdef TEST_SERVER_TLS
+    SSL *ssl;
+#endif
+} conn_t;
+
+typedef struct {
+    unsigned int stream;
+    double due;
+} h2_pending_t;
+
+/*
+ * Prototypes
+ */
+static int server_start(test_server_t *srv, const char *body, long delay_ms);
+static void *accept_thread(void *arg);
+static void *conn_thread(void *arg);
+static void serve_http1(conn_t *c);
+static int respond_http1(conn_t *c, test_route_t *route, const char *head,
+                         size_t head_len, const char *if_none_match,
+                         const char *body, size_t body_len, int head_only,
+                         int close_after);
+static int read_body(conn_t *c, size_t content_len, int chunked,
+                     char **body, size_t *body_len, size_t *body_cap);
+static int read_exact(conn_t *c, size_t n, char **buf, size_t *len,
+                      size_t *cap);
+static int read_line(conn_t *c, char *line, size_t max);
+static int write_body(conn_t *c, const char *body, size_t off, size_t len);
+static test_route_t *find_route(test_server_t *srv, const char *target);
+static const char *reason(int status);
+static void serve_http2(conn_t *c);
+static int conn_fill(conn_t *c, int timeout_ms);
+static void conn_consume(conn_t *c, size_t n);
+static int write_all(conn_t *c, const void *buf, size_t len);
+static int h2_frame(conn_t *c, int type, int flags, unsigned int stream,
+                    const void *payload, size_t len);
+static int h2_respond(conn_t *c, unsigned int stream);
+static double now_ms(void);
+static void sleep_ms(long ms);
+#ifdef TEST_SERVER_TLS
+static SSL_CTX *tls_ctx_new(void);
+#endif
+
+/*
+ * test_server_start - Starts serving plain HTTP on an ephemeral loopback
+ * port, filling in `port' and `url'.
+ *
+ * Returns 0 on success, or -1 on failure.
+ *
+ * @srv:      server struct
+ * @body:     body of every response, must outlive the server
+ * @delay_ms: time to wait before answering each request
+ */
+int test_server_start(test_server_t *srv, const char *body, long delay_ms)
+{
+    srv->tls = NULL;
+    return server_start(srv, body, delay_ms);
+}
+
+/*
+ * test_server_start_tls - Same as test_server_start(), but serves HTTPS with
+ * a throwaway self-signed certificate, offering h2 and http/1.1 via ALPN.
+ * Clients have to skip certificate verification.
+ *
+ * Returns 0 on success, or -1 on failure or if built without OpenSSL.
+ */
+int test_server_start_tls(test_server_t *srv, const char *body,
+                          long delay_ms)
+{
+#ifdef TEST_SERVER_TLS
+    srv->tls = tls_ctx_new();
+    if (srv->tls == NULL)
+        return -1;
+    if (server_start(srv, body, delay_ms) == 0)
+        return 0;
+    SSL_CTX_free(srv->tls);
+#endif
+    return -1;
+}
+
+static int server_start(test_server_t *srv, const char *body, long delay_ms)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+
+    /* a client hanging up mid-response must not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    srv->body = body;
+    srv->delay_ms = delay_ms;
+    srv->max_streams = 1000;
+    atomic_init(&srv->connections, 0);
+    atomic_init(&srv->requests, 0);
+    srv->connv = NULL;
+    srv->connc = 0;
+    srv->conncap = 0;
+    srv->live = 0;
+    srv->routev = NULL;
+    srv->routec = 0;
+    srv->routecap = 0;
+
+    srv->listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv->listenfd < 0)
+        return -1;
+    setsockopt(srv->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(srv->listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(srv->listenfd, 4096) < 0 ||
+        getsockname(srv->listenfd, (struct sockaddr *) &addr, &addrlen) < 0)
+        goto fail;
+
+    srv->port = ntohs(addr.sin_port);
+    snprintf(srv->url, sizeof(srv->url), "%s://127.0.0.1:%d",
+             srv->tls != NULL ? "https" : "http", srv->port);
+
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->idle, NULL);
+    if (pthread_create(&srv->thread, NULL, accept_thread, srv) != 0) {
+        pthread_cond_destroy(&srv->idle);
+        pthread_mutex_destroy(&srv->lock);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(srv->listenfd);
+    return -1;
+}
+
+/*
+ * test_server_route - Adds a scripted response for HTTP/1.1 requests whose
+ * target starts with `route->path'. May be called while the server runs.
+ *
+ * Returns 0 on success, or -1 on memory error.
+ *
+ * @srv:   server struct
+ * @route: the response, which must outlive the server
+ */
+int test_server_route(test_server_t *srv, test_route_t *route)
+{
+    int rc = 0;
+
+    atomic_init(&route->hits, 0);
+    pthread_mutex_lock(&srv->lock);
+    if (srv->routec == srv->routecap) {
+        int cap = srv->routecap ? srv->routecap * 2 : 16;
+        test_route_t **tmp = realloc(srv->routev, cap * sizeof(*tmp));
+        if (tmp == NULL)
+            rc = -1;
+        else {
+            srv->routev = tmp;
+            srv->routecap = cap;
+        }
+    }
+    if (rc == 0)
+        srv->routev[srv->routec++] = route;
+    pthread_mutex_unlock(&srv->lock);
+    return rc;
+}
+
+/*
+ * test_server_stop - Stops accepting, drops every open connection and waits
+ * for their threads to finish.
+ *
+ * @srv: server struct
+ */
+void test_server_stop(test_server_t *srv)
+{
+    /* wakes the accept thread out of accept() */
+    shutdown(srv->listenfd, SHUT_RDWR);
+    pthread_join(srv->thread, NULL);
+    close(srv->listenfd);
+
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->connc; i++)
+        shutdown(srv->connv[i], SHUT_RDWR);
+    while (srv->live > 0)
+        pthread_cond_wait(&srv->idle, &srv->lock);
+    pthread_mutex_unlock(&srv->lock);
+
+    free(srv->connv);
+    free(srv->routev);
+#ifdef TEST_SERVER_TLS
+    SSL_CTX_free(srv->tls);
+#endif
+    pthread_cond_destroy(&srv->idle);
+    pthread_mutex_destroy(&srv->lock);
+}
+
+static void *accept_thread(void *arg)
+{
+    test_server_t *srv = arg;
+    pthread_t thread;
+    int one = 1;
+
+    for (;;) {
+        int fd = accept(srv->listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn_t *c = calloc(1, sizeof(*c));
+        if (c == NULL || (c->buf = malloc(CONN_BUF_SIZE)) == NULL) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->srv = srv;
+        c->fd = fd;
+
+        pthread_mutex_lock(&srv->lock);
+        if (srv->connc == srv->conncap) {
+            int cap = srv->conncap ? srv->conncap * 2 : 16;
+            int *tmp = realloc(srv->connv, cap * sizeof(*tmp));
+            if (tmp == NULL) {
+                pthread_mutex_unlock(&srv->lock);
+                free(c->buf);
+                free(c);
+                close(fd);
+                continue;
+            }
+            srv->connv = tmp;
+            srv->conncap = cap;
+        }
+        srv->connv[srv->connc++] = fd;
+        srv->live++;
+        pthread_mutex_unlock(&srv->lock);
+
+        atomic_fetch_add(&srv->connections, 1);
+        if (pthread_create(&thread, NULL, conn_thread, c) != 0) {
+            conn_thread(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static void *conn_thread(void *arg)
+{
+    conn_t *c = arg;
+    test_server_t *srv = c->srv;
+
+#ifdef TEST_SERVER_TLS
+    if (srv->tls != NULL) {
+        c->ssl = SSL_new(srv->tls);
+        if (c->ssl == NULL || !SSL_set_fd(c->ssl, c->fd) ||
+            SSL_accept(c->ssl) <= 0)
+            goto done;
+    }
+#endif
+
+    /* the first bytes tell HTTP/2 prior knowledge apart from HTTP/1.1 */
+    while (c->len < H2_PREFACE_LEN &&
+           memcmp(c->buf, H2_PREFACE, c->len) == 0)
+        if (conn_fill(c, -1) <= 0)
+            goto done;
+
+    if (memcmp(c->buf, H2_PREFACE, H2_PREFACE_LEN) == 0)
+        serve_http2(c);
+    else
+        serve_http1(c);
+
+done:
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->connc; i++) {
+        if (srv->connv[i] == c->fd) {
+            srv->connv[i] = srv->connv[--srv->connc];
+            break;
+        }
+    }
+    close(c->fd);
+    if (--srv->live == 0)
+        pthread_cond_broadcast(&srv->idle);
+    pthread_mutex_unlock(&srv->lock);
+
+#ifdef TEST_SERVER_TLS
+    SSL_free(c->ssl);
+#endif
+    free(c->buf);
+    free(c);
+    return NULL;
+}
+
+/*
+ * serve_http1 - Answers keep-alive HTTP/1.1 requests until the client
+ * closes the connection, from a matching route if there is one.
+ */
+static void serve_http1(conn_t *c)
+{
+    test_server_t *srv = c->srv;
+    char *body = NULL;
+    size_t body_len, body_cap = 0;
+
+    for (;;) {
+        char *end;
+        while ((end = memmem(c->buf, c->len, "\r\n\r\n", 4)) == NULL)
+            if (c->len == CONN_BUF_SIZE || conn_fill(c, -1) <= 0)
+                goto done;
+
+        /* the head is copied out, the buffer goes on to hold the body */
+        size_t head_len = end + 4 - c->buf;
+        char *head = malloc(head_len + 1);
+        if (head == NULL)
+            goto done;
+        memcpy(head, c->buf, head_len);
+        head[head_len] = '\0';
+        conn_consume(c, head_len);
+
+        char target[2048] = "", if_none_match[256] = "";
+        size_t content_len = 0;
+        int chunked = 0, expect = 0, close_after = 0;
+        int head_only = strncmp(head, "HEAD ", 5) == 0;
+        sscanf(head, "%*s %2047s", target);
+
+        char *line = strstr(head, "\r\n") + 2;
+        while (line < head + head_len - 2) {
+            char *eol = strstr(line, "\r\n");
+            size_t n = eol - line;
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                content_len = strtoul(line + 15, NULL, 10);
+            else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 &&
+                     memmem(line, n, "chunked", 7) != NULL)
+                chunked = 1;
+            else if (strncasecmp(line, "Expect:", 7) == 0 &&
+                     memmem(line, n, "100-continue", 12) != NULL)
+                expect = 1;
+            else if (strncasecmp(line, "Connection:", 11) == 0 &&
+                     memmem(line, n, "close", 5) != NULL)
+                close_after = 1;
+            else if (strncasecmp(line, "If-None-Match:", 14) == 0)
+                sscanf(line + 14, " %255[^\r]", if_none_match);
+            line = eol + 2;
+        }
+
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        int rc = expect ? write_all(c, cont, sizeof(cont) - 1) : 0;
+        if (rc == 0)
+            rc = read_body(c, content_len, chunked, &body, &body_len,
+                           &body_cap);
+        if (rc == 0)
+            rc = respond_http1(c, find_route(srv, target), head, head_len,
+                               if_none_match, body, body_len, head_only,
+                               close_after);
+        free(head);
+        if (rc < 0)
+            goto done;
+        atomic_fetch_add(&srv->requests, 1);
+        if (close_after)
+            goto done;
+    }
+
+done:
+    free(body);
+}
+
+/*
+ * respond_http1 - Sends the response `route' scripts, or the server's
+ * default response if `route' is NULL, for the request whose head and body
+ * are given.
+ *
+ * Returns 0 on success, or -1 if the connection failed.
+ */
+static int respond_http1(conn_t *c, test_route_t *route, const char *head,
+                         size_t head_len, const char *if_none_match,
+                         const char *body, size_t body_len, int head_only,
+                         int close_after)
+{
+    test_server_t *srv = c->srv;
+    const char *headers = "", *src = srv->body;
+    size_t len = strlen(srv->body), chunk = 0;
+    long delay = srv->delay_ms;
+    int status = 200;
+    char *echo = NULL, *out = NULL, etag[300] = "";
+
+    if (route != NULL) {
+        long hit = atomic_fetch_add(&route->hits, 1);
+        status = route->status ? route->status : 200;
+        headers = route->headers ? route->headers : "";
+        src = route->body;
+        len = route->body_len || src == NULL ? route->body_len : strlen(src);
+        delay = route->delay_first && hit > 0 ? 0 : route->delay_ms;
+        if (route->chunked)
+            chunk = route->chunk_size ? route->chunk_size : 4096;
+        if (route->etag != NULL) {
+            snprintf(etag, sizeof(etag), "ETag: %s\r\n", route->etag);
+            if (strcmp(if_none_match, route->etag) == 0)
+                status = 304;
+        }
+        if (route->echo) {
+            echo = malloc(head_len + body_len + 1);
+            if (echo == NULL)
+                return -1;
+            memcpy(echo, head, head_len);
+            if (body_len > 0)
+                memcpy(echo + head_len, body, body_len);
+            src = echo;
+            len = head_len + body_len;
+        }
+        if (hit < route->fail_first) {
+            status = route->fail_status ? route->fail_status : 503;
+            len = 0;
+        }
+    }
+    /* these never have a body */
+    if (status == 204 || status == 304 || (status >= 100 && status < 200))
+        len = 0;
+
+    if (delay > 0)
+        sleep_ms(delay);
+
+    char framing[64];
+    if (chunk)
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n");
+    else
+        snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", len);
+    int n = asprintf(&out, "HTTP/1.1 %d %s\r\n%s%s%s%s\r\n", status,
+                     reason(status), headers, etag, framing,
+                     close_after ? "Connection: close\r\n" : "");
+    int rc = n < 0 ? -1 : write_all(c, out, n);
+
+    if (rc == 0 && !head_only && chunk) {
+        for (size_t off = 0; rc == 0 && off < len; off += chunk) {
+            size_t piece = len - off < chunk ? len - off : chunk;
+            char size_line[32];
+            int m = snprintf(size_line, sizeof(size_line), "%zx\r\n", piece);
+            rc = write_all(c, size_line, m) || write_body(c, src, off, piece) ||
+                 write_all(c, "\r\n", 2) ? -1 : 0;
+        }
+        if (rc == 0)
+            rc = write_all(c, "0\r\n\r\n", 5);
+    } else if (rc == 0 && !head_only) {
+        rc = write_body(c, src, 0, len);
+    }
+
+    if (n >= 0)
+        free(out);
+    free(echo);
+    return rc;
+}
+
+/*
+ * read_body - Reads the request body that follows a head, with either
+ * `content_len' bytes or chunked encoding, into `body', growing it as
+ * needed. Chunk framing and trailers are dropped.
+ *
+ * Returns 0 on success, or -1 if the connection failed.
+ */
+static int read_body(conn_t *c, size_t content_len, int chunked,
+                     char **body, size_t *body_len, size_t *body_cap)
+{
+    char line[256];
+
+    *body_len = 0;
+    if (!chunked)
+        return read_exact(c, content_len, body, body_len, body_cap);
+
+    for (;;) {
+        if (read_line(c, line, sizeof(line)) < 0)
+            return -1;
+        size_t size = strtoul(line, NULL, 16);
+        if (size == 0)
+            break;
+        if (read_exact(c, size, body, body_len, body_cap) < 0 ||
+            read_line(c, line, sizeof(line)) < 0)
+            return -1;
+    }
+    /* trailers, up to the empty line */
+    do {
+        if (read_line(c, line, sizeof(line)) < 0)
+            return -1;
+    } while (line[0] != '\0');
+    return 0;
+}
+
+/*
+ * read_exact - Moves the next `n' bytes off the connection onto the end of
+ * `buf'.
+ */
+static int read_exact(conn_t *c, size_t n, char **buf, size_t *len,
+                      size_t *cap)
+{
+    if (*len + n > *cap) {
+        size_t newcap = *cap ? *cap : 4096;
+        while (newcap < *len + n)
+            newcap *= 2;
+        char *tmp = realloc(*buf, newcap);
+        if (tmp == NULL)
+            return -1;
+        *buf = tmp;
+        *cap = newcap;
+    }
+
+    while (n > 0) {
+        if (c->len == 0 && conn_fill(c, -1) <= 0)
+            return -1;
+        size_t take = n < c->len ? n : c->len;
+        memcpy(*buf + *len, c->buf, take);
+        *len += take;
+        n -= take;
+        conn_consume(c, take);
+    }
+    return 0;
+}
+
+/*
+ * read_line - Takes the next CRLF terminated line off the connection,
+ * without the CRLF, truncated to fit `max'.
+ */
+static int read_line(conn_t *c, char *line, size_t max)
+{
+    char *eol;
+
+    while ((eol = memmem(c->buf, c->len, "\r\n", 2)) == NULL)
+        if (conn_fill(c, -1) <= 0)
+            return -1;
+
+    size_t n = eol - c->buf;
+    snprintf(line, max, "%.*s", (int) n, c->buf);
+    conn_consume(c, n + 2);
+    return 0;
+}
+
+/*
+ * write_body - Sends `len' bytes of a response body from offset `off', of
+ * `body' or, if that is NULL, of test_pattern().
+ */
+static int write_body(conn_t *c, const char *body, size_t off, size_t len)
+{
+    char buf[16384];
+
+    if (body != NULL)
+        return write_all(c, body + off, len);
+
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        for (size_t i = 0; i < n; i++)
+            buf[i] = test_pattern(off + i);
+        if (write_all(c, buf, n) < 0)
+            return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static test_route_t *find_route(test_server_t *srv, const char *target)
+{
+    test_route_t *route = NULL;
+
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->routec && route == NULL; i++)
+        if (strncmp(target, srv->routev[i]->path,
+                    strlen(srv->routev[i]->path)) == 0)
+            route = srv->routev[i];
+    pthread_mutex_unlock(&srv->lock);
+    return route;
+}
+
+static const char *reason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 408: return "Request Timeout";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default:  return "Unknown";
+    }
+}
+
+/*
+ * serve_http2 - Answers HTTP/2 streams on the connection. Each stream is
+ * answered `delay_ms' after its request ends, independently of the others,
+ * so delayed streams overlap the way they would on a real server.
+ */
+static void serve_http2(conn_t *c)
+{
+    test_server_t *srv = c->srv;
+    h2_pending_t *pendv = NULL;
+    int pendc = 0, pendcap = 0;
+    unsigned int cont_stream = 0;   /* ended stream awaiting CONTINUATION */
+    unsigned char settings[6];
+
+    /* our SETTINGS: only the stream limit differs from the defaults */
+    settings[0] = 0;
+    settings[1] = 0x3;              /* SETTINGS_MAX_CONCURRENT_STREAMS */
+    settings[2] = srv->max_streams >> 24;
+    settings[3] = srv->max_streams >> 16;
+    settings[4] = srv->max_streams >> 8;
+    settings[5] = srv->max_streams;
+    if (h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings)) < 0)
+        return;
+
+    memmove(c->buf, c->buf + H2_PREFACE_LEN, c->len - H2_PREFACE_LEN);
+    c->len -= H2_PREFACE_LEN;
+
+    for (;;) {
+        /* parse every complete frame in the buffer */
+        size_t off = 0;
+        while (c->len - off >= 9) {
+            unsigned char *f = (unsigned char *) c->buf + off;
+            size_t len = (f[0] << 16) | (f[1] << 8) | f[2];
+            int type = f[3], flags = f[4];
+            unsigned int stream = ((f[5] & 0x7f) << 24) | (f[6] << 16) |
+                                  (f[7] << 8) | f[8];
+            if (c->len - off < 9 + len)
+                break;
+            off += 9 + len;
+
+            unsigned int ended = 0;
+            switch (type) {
+            case H2_SETTINGS:
+                if (!(flags & H2_ACK) &&
+                    h2_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0) < 0)
+                    goto done;
+                break;
+            case H2_PING:
+                if (!(flags & H2_ACK) &&
+                    h2_frame(c, H2_PING, H2_ACK, 0, f + 9, len) < 0)
+                    goto done;
+                break;
+            case H2_GOAWAY:
+                goto done;
+            case H2_HEADERS:
+                if (flags & H2_END_STREAM) {
+                    if (flags & H2_END_HEADERS)
+                        ended = stream;
+                    else
+                        cont_stream = stream;
+                }
+                break;
+            case H2_CONTINUATION:
+                if ((flags & H2_END_HEADERS) && stream == cont_stream) {
+                    ended = stream;
+                    cont_stream = 0;
+                }
+                break;
+            case H2_DATA:
+                if (flags & H2_END_STREAM)
+                    ended = stream;
+                /* hand the received bytes back to the client's windows */
+                if (len > 0) {
+                    unsigned char inc[4] = {
+                        len >> 24, len >> 16, len >> 8, len
+                    };
+                    if (h2_frame(c, H2_WINDOW_UPDATE, 0, 0, inc, 4) < 0 ||
+                        (!ended && h2_frame(c, H2_WINDOW_UPDATE, 0,
+                                            stream, inc, 4) < 0))
+                        goto done;
+                }
+                break;
+            case H2_RST_STREAM:
+                for (int i = 0; i < pendc; i++)
+                    if (pendv[i].stream == stream)
+                        pendv[i--] = pendv[--pendc];
+                break;
+            default:
+                break;
+            }
+
+            if (ended) {
+                if (pendc == pendcap) {
+                    int cap = pendcap ? pendcap * 2 : 16;
+                    h2_pending_t *tmp = realloc(pendv, cap * sizeof(*tmp));
+                    if (tmp == NULL)
+                        goto done;
+                    pendv = tmp;
+                    pendcap = cap;
+                }
+                pendv[pendc].stream = ended;
+                pendv[pendc].due = now_ms() + srv->delay_ms;
+                pendc++;
+            }
+        }
+        memmove(c->buf, c->buf + off, c->len - off);
+        c->len -= off;
+
+        /* answer streams whose delay is up, then wait for the next one */
+        double now = now_ms(), next = -1;
+        for (int i = 0; i < pendc; i++) {
+            if (pendv[i].due <= now) {
+                if (h2_respond(c, pendv[i].stream) < 0)
+                    goto done;
+                pendv[i--] = pendv[--pendc];
+            } else if (next < 0 || pendv[i].due < next) {
+                next = pendv[i].due;
+            }
+        }
+
+        int timeout = next < 0 ? -1 : (int) (next - now) + 1;
+        if (conn_fill(c, timeout) < 0)
+            goto done;
+    }
+
+done:
+    free(pendv);
+}
+
+/*
+ * h2_respond - Sends a 200 with the server body on `stream' and ends it.
+ */
+static int h2_respond(conn_t *c, unsigned int stream)
+{
+    test_server_t *srv = c->srv;
+    size_t body_len = strlen(srv->body);
+    unsigned char block[32];
+    size_t n = 0;
+
+    /* ":status: 200" is entry 8 of the HPACK static table, content-length
+     * (entry 28) goes out as a literal without indexing */
+    block[n++] = 0x80 | 8;
+    block[n++] = 0x0f;
+    block[n++] = 28 - 15;
+    int digits = snprintf((char *) block + n + 1, sizeof(block) - n - 1,
+                          "%zu", body_len);
+    block[n] = digits;
+    n += 1 + digits;
+
+    if (h2_frame(c, H2_HEADERS, body_len ? H2_END_HEADERS :
+                 H2_END_HEADERS | H2_END_STREAM, stream, block, n) < 0)
+        return -1;
+
+    for (size_t off = 0; off < body_len; off += H2_FRAME_MAX) {
+        size_t len = body_len - off < H2_FRAME_MAX ? body_len - off :
+                     H2_FRAME_MAX;
+        int flags = off + len == body_len ? H2_END_STREAM : 0;
+        if (h2_frame(c, H2_DATA, flags, stream, srv->body + off, len) < 0)
+            return -1;
+    }
+    atomic_fetch_add(&srv->requests, 1);
+    return 0;
+}
+
+static int h2_frame(conn_t *c, int type, int flags, unsigned int stream,
+                    const void *payload, size_t len)
+{
+    unsigned char head[9] = {
+        len >> 16, len >> 8, len, type, flags,
+        (stream >> 24) & 0x7f, stream >> 16, stream >> 8, stream
+    };
+    if (write_all(c, head, sizeof(head)) < 0)
+        return -1;
+    return write_all(c, payload, len);
+}
+
+/*
+ * conn_fill - Reads whatever is available into the connection buffer,
+ * waiting at most `timeout_ms' (-1 for no limit).
+ *
+ * Returns the number of bytes read, 0 on timeout, or -1 when the connection
+ * is closed or fails.
+ */
+static int conn_fill(conn_t *c, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+
+    if (c->len == CONN_BUF_SIZE)
+        return -1;
+
+    /* TLS may already hold decrypted bytes the socket no longer shows */
+    int ready = 1;
+#ifdef TEST_SERVER_TLS
+    if (c->ssl == NULL || !SSL_has_pending(c->ssl))
+#endif
+        ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0)
+        return errno == EINTR ? 0 : -1;
+    if (ready == 0)
+        return 0;
+
+    ssize_t n;
+#ifdef TEST_SERVER_TLS
+    if (c->ssl != NULL)
+        n = SSL_read(c->ssl, c->buf + c->len, CONN_BUF_SIZE - c->len);
+    else
+#endif
+        n = read(c->fd, c->buf + c->len, CONN_BUF_SIZE - c->len);
+    if (n <= 0)
+        return -1;
+    c->len += n;
+    return n;
+}
+
+static void conn_consume(conn_t *c, size_t n)
+{
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+}
+
+static int write_all(conn_t *c, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n;
+#ifdef TEST_SERVER_TLS
+        if (c->ssl != NULL) {
+            n = SSL_write(c->ssl, p, len);
+            if (n <= 0)
+                return -1;
+        } else
+#endif
+        n = send(c->fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+#ifdef TEST_SERVER_TLS
+static int alpn_select(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg)
+{
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+
+    if (SSL_select_next_proto((unsigned char **) out, outlen, protos,
+                              sizeof(protos) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * tls_ctx_new - A server context with a fresh P-256 key and a self-signed
+ * certificate for 127.0.0.1, valid for a day.
+ */
+static SSL_CTX *tls_ctx_new(void)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+
+    if (ctx == NULL || key == NULL || cert == NULL)
+        goto fail;
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *) "127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+    if (!X509_sign(cert, key, EVP_sha256()) ||
+        !SSL_CTX_use_certificate(ctx, cert) ||
+        !SSL_CTX_use_PrivateKey(ctx, key))
+        goto fail;
+
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+
+fail:
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+#endif
@@ -0,0 +1,96 @@
+/*
+ * server.h -- librequests: loopback HTTP server for tests and benchmarks
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Mark Mossberg <mark.mossberg@gmail.com>
+ *
+ * See requests.h for the full license text.
+ */
+
+#ifndef __TEST_SERVER_H
+#define __TEST_SERVER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * test_route_t -- a scripted HTTP/1.1 response for requests whose target
+ * starts with `path'. Fields left zero take the defaults, so a route only
+ * spells out what it changes. Routes are matched in the order they were
+ * added and must outlive the server.
+ */
+typedef struct {
+    const char *path;          /* prefix of the request target */
+    int status;                /* 0 for 200 */
+    const char *headers;       /* extra header lines, each ending in "\r\n" */
+    const char *body;          /* NULL for `body_len' bytes of test_pattern() */
+    size_t body_len;           /* 0 for strlen(body) */
+    long delay_ms;             /* wait before answering */
+    int delay_first;           /* only the first request waits `delay_ms' */
+    int chunked;               /* send the body with chunked encoding */
+    size_t chunk_size;         /* bytes per chunk, 0 for 4096 */
+    const char *etag;          /* sent as ETag, and a request whose
+                                  If-None-Match matches gets a 304 */
+    int echo;                  /* the body is the request as received, with a
+                                  chunked request body decoded */
+    int fail_first;            /* answer the first this many requests with
+                                  `fail_status' and no body */
+    int fail_status;           /* 0 for 503 */
+    atomic_long hits;          /* requests answered so far */
+} test_route_t;
+
+/*
+ * test_server_t -- a small HTTP server on an ephemeral 127.0.0.1 port. Each
+ * connection gets its own thread. Connections speak HTTP/1.1, or HTTP/2 if
+ * they open with the HTTP/2 connection preface (h2c with prior knowledge).
+ * Requests that match no route added with test_server_route() are answered
+ * with 200 and `body' after `delay_ms'. Started with
+ * test_server_start_tls(), it does the same over TLS, where HTTP/2 is
+ * negotiated through ALPN.
+ *
+ * HTTP/1.1 requests may carry bodies of any size, with Content-Length or
+ * chunked, and "Expect: 100-continue" is honoured. HTTP/2 support is just
+ * enough for curl: request header blocks are not decoded, so routes don't
+ * apply, and flow control is not enforced, so bodies must stay below the
+ * initial 64 KiB window.
+ */
+typedef struct {
+    int listenfd;
+    int port;
+    char url[64];              /* "http[s]://127.0.0.1:<port>" */
+    const char *body;          /* response body, see test_server_start */
+    long delay_ms;             /* wait before answering each request */
+    long max_streams;          /* HTTP/2 concurrent stream limit advertised */
+    atomic_long connections;   /* connections accepted so far */
+    atomic_long requests;      /* requests answered so far */
+    void *tls;                 /* private: SSL_CTX, NULL for plain HTTP */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int *connv;                /* open connection sockets */
+    int connc;
+    int conncap;
+    int live;                  /* connection threads still running */
+    test_route_t **routev;
+    int routec;
+    int routecap;
+} test_server_t;
+
+int test_server_start(test_server_t *srv, const char *body, long delay_ms);
+int test_server_start_tls(test_server_t *srv, const char *body,
+                          long delay_ms);
+int test_server_route(test_server_t *srv, test_route_t *route);
+void test_server_stop(test_server_t *srv);
+
+/*
+ * test_pattern - Byte `i' of the body served by routes without one, so
+ * large responses can be checked without keeping a copy around.
+ */
+static inline char test_pattern(size_t i)
+{
+    return 'a' + i % 26;
+}
+
+#endif
@@ -1,5 +1,10 @@
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "requests.h"
+#include "server.h"
 #include "greatest.h"
 
 #ifdef NDEBUG
@@ -8,9 +13,93 @@
 # define DEBUG(M, ...) fprintf(stderr, "DEBUG %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 #endif
 
-char *example = "https://gist.githubusercontent.com/mossberg/91093537c33e69e4da2c/raw/librequests_test.txt";
+/* every test talks to this server, so the suite runs offline */
+test_server_t server;
+char example[96];
 char *example_text = "Simple test file for librequests.";
-char *posttestserver = "http://posttestserver.com/post.php";
+char posttestserver[96];
+
+/* a response that caches and revalidates, like a file on a CDN */
+test_route_t example_route = {
+    .path = "/example",
+    .headers = "Cache-Control: max-age=300\r\n",
+    .etag = "\"v1\""
+};
+/* answers with the request it got, as a form handler would */
+test_route_t post_route = { .path = "/post", .echo = 1 };
+test_route_t gzip_route = {
+    .path = "/gzip",
+    .headers = "Content-Encoding: gzip\r\n"
+};
+test_route_t redirect_route = {
+    .path = "/redirect",
+    .status = 302,
+    .headers = "Location: /example\r\n"
+};
+test_route_t chunked_route = {
+    .path = "/chunked",
+    .body_len = 100000,
+    .chunked = 1,
+    .chunk_size = 1000
+};
+test_route_t large_route = { .path = "/large", .body_len = 4 << 20 };
+test_route_t missing_route = { .path = "/missing", .status = 404 };
+test_route_t cookies_route = {
+    .path = "/cookies",
+    .body = "crumbs",
+    .headers = "Set-Cookie: a=1\r\nX-Crumb: yes\r\nSet-Cookie: b=2\r\n"
+};
+test_route_t vary_route = {
+    .path = "/vary",
+    .body = "varied",
+    .headers = "Cache-Control: max-age=300\r\nVary: X-Tenant\r\n"
+};
+/* headers of a response that is followed must not leak into the index */
+test_route_t hop_route = {
+    .path = "/hop",
+    .status = 302,
+    .headers = "Location: /cookies\r\nSet-Cookie: stale=1\r\nX-Hop: 1\r\n"
+};
+test_route_t flaky_route = {
+    .path = "/flaky",
+    .body = "finally",
+    .fail_first = 2,
+    .headers = "Retry-After: 0\r\n"
+};
+
+/* the library and libcurl allocate through these, see main() */
+atomic_long allocations;
+
+static void *count_malloc(size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return realloc(ptr, size);
+}
+
+static char *count_strdup(const char *str)
+{
+    atomic_fetch_add(&allocations, 1);
+    return strdup(str);
+}
+
+static void *count_calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return calloc(nmemb, size);
+}
+
+requests_allocator_t counting_allocator = {
+    count_malloc, free, count_realloc, count_strdup, count_calloc
+};
+
+/* the pattern body of the gzip route, before compression */
+#define GZIP_PLAIN_LEN 65536
 
 void test_print(req_t *req)
 {
@@ -37,6 +126,60 @@ TEST get()
     ASSERT(strcmp(example_text, req.text) == 0);
     ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
     ASSERT_EQ(1, req.ok);
+    /* Content-Length is known, so the body buffer is allocated once */
+    ASSERT_EQ(1, req.text_reallocs);
+    ASSERT(req.text_cap >= size + 1);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_header_lookup()
+{
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    requests_get(&req, example);
+
+    ASSERT_EQ(11, requests_http_version(&req));
+    ASSERT(strcmp("OK", requests_reason(&req)) == 0);
+    ASSERT(strcmp("33", requests_header(&req, "content-length")) == 0);
+    ASSERT(strcmp("33", requests_header(&req, "CONTENT-LENGTH")) == 0);
+    ASSERT_EQ(NULL, requests_header(&req, "x-not-there"));
+
+    int i = requests_header_first(&req, "Content-Length");
+    ASSERT(i >= 0);
+    ASSERT_EQ(-1, requests_header_next(&req, i));
+
+    /* a repeated header chains its values in arrival order */
+    char url[128];
+    snprintf(url, sizeof(url), "%s/cookies", server.url);
+    requests_reset(&req);
+    requests_get(&req, url);
+    i = requests_header_first(&req, "set-cookie");
+    ASSERT(i >= 0);
+    ASSERT(strcmp("a=1", requests_header_value(&req, i)) == 0);
+    i = requests_header_next(&req, i);
+    ASSERT(i >= 0);
+    ASSERT(strcmp("b=2", requests_header_value(&req, i)) == 0);
+    ASSERT_EQ(-1, requests_header_next(&req, i));
+    ASSERT(strcmp("a=1", requests_header(&req, "Set-Cookie")) == 0);
+
+    /* after a redirect only the final response is indexed */
+    snprintf(url, sizeof(url), "%s/hop", server.url);
+    requests_reset(&req);
+    requests_get(&req, url);
+    ASSERT_EQ(200, req.code);
+    ASSERT(strcmp("OK", requests_reason(&req)) == 0);
+    ASSERT_EQ(NULL, requests_header(&req, "x-hop"));
+    ASSERT(strcmp("yes", requests_header(&req, "x-crumb")) == 0);
+    i = requests_header_first(&req, "set-cookie");
+    ASSERT(i >= 0);
+    ASSERT(strcmp("a=1", requests_header_value(&req, i)) == 0);
+    i = requests_header_next(&req, i);
+    ASSERT(i >= 0);
+    ASSERT(strcmp("b=2", requests_header_value(&req, i)) == 0);
+    ASSERT_EQ(-1, requests_header_next(&req, i));
 
     requests_close(&req);
     PASS();
@@ -84,10 +227,11 @@ TEST post()
 
     ASSERT_EQ(code, req.code);
     ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
-    ASSERT(strstr(req.text, "Successfully") != NULL);
+    ASSERT(strncmp(req.text, "POST /post ", 11) == 0);
+    ASSERT(strstr(req.text, "\r\n\r\napple=red&banana=yellow") != NULL);
     ASSERT_EQ(1, req.ok);
 
-    curl_free(body);
+    requests_free(body);
     requests_close(&req);
     PASS();
 }
@@ -102,7 +246,8 @@ TEST post_nodata()
 
     ASSERT_EQ(code, req.code);
     ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
-    ASSERT(strstr(req.text, "Successfully") != NULL);
+    ASSERT(strncmp(req.text, "POST /post ", 11) == 0);
+    ASSERT(strstr(req.text, "Content-Length: 0\r\n") != NULL);
     ASSERT_EQ(1, req.ok);
 
     requests_close(&req);
@@ -126,7 +271,7 @@ TEST post_headers()
     ASSERT_EQ(code, req.code);
     ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
     ASSERT(strcmp(req.req_hdrv[1], "Content-Type: application/json") == 0);
-    ASSERT(strstr(req.text, "Successfully") != NULL);
+    ASSERT(strstr(req.text, "Content-Hype: dude\r\n") != NULL);
     ASSERT_EQ(1, req.ok);
     ASSERT_EQ(3, req.req_hdrc);
 
@@ -150,14 +295,246 @@ TEST put()
 
     ASSERT_EQ(code, req.code);
     ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
-    ASSERT(strstr(req.text, "Successfully") != NULL);
+    ASSERT(strncmp(req.text, "PUT /post ", 10) == 0);
+    ASSERT(strstr(req.text, "\r\n\r\napple=red&banana=yellow") != NULL);
     ASSERT_EQ(1, req.ok);
 
-    curl_free(body);
+    requests_free(body);
     requests_close(&req);
     PASS();
 }
 
+/*
+ * echoed_body - The body the echo route got, after the request head it
+ * sends back first.
+ */
+static const char *echoed_body(req_t *req, size_t *len)
+{
+    const char *body = strstr(req->text, "\r\n\r\n");
+
+    if (body == NULL)
+        return NULL;
+    body += 4;
+    *len = req->size - (body - req->text);
+    return body;
+}
+
+TEST upload_file()
+{
+    char path[] = "/tmp/librequests-upload-XXXXXX";
+    size_t len = 1 << 20, got;
+    char *data = malloc(len);
+    const char *body;
+    int fd = mkstemp(path);
+
+    if (data == NULL || fd < 0)
+        FAIL();
+    /* NULL bytes and all */
+    for (size_t i = 0; i < len; i++)
+        data[i] = i % 1000 == 0 ? '\0' : test_pattern(i);
+    if (write(fd, data, len) != (ssize_t) len)
+        FAIL();
+    close(fd);
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+
+    ASSERT_EQ(CURLE_OK, requests_put_file(&req, posttestserver, path, NULL,
+                                          0));
+    ASSERT_EQ(200, req.code);
+    ASSERT(strncmp(req.text, "PUT /post ", 10) == 0);
+    ASSERT(strstr(req.text, "Content-Length: 1048576\r\n") != NULL);
+    body = echoed_body(&req, &got);
+    ASSERT_EQ(len, got);
+    ASSERT(memcmp(data, body, len) == 0);
+
+    requests_reset(&req);
+    ASSERT_EQ(CURLE_OK, requests_post_data(&req, posttestserver, data, 2001,
+                                           NULL, 0));
+    body = echoed_body(&req, &got);
+    ASSERT_EQ(2001, got);
+    ASSERT(memcmp(data, body, 2001) == 0);
+
+    requests_close(&req);
+    unlink(path);
+    free(data);
+    PASS();
+}
+
+TEST upload_fd()
+{
+    char path[] = "/tmp/librequests-upload-XXXXXX";
+    char data[] = "skip me|send me\0and me";
+    size_t got;
+    const char *body;
+    int fd = mkstemp(path), pipefd[2];
+
+    if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data))
+        FAIL();
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+
+    /* the rest of the file from its offset, which stays where it is */
+    lseek(fd, 8, SEEK_SET);
+    ASSERT_EQ(CURLE_OK, requests_post_fd(&req, posttestserver, fd, -1, NULL,
+                                         0));
+    ASSERT_EQ(200, req.code);
+    ASSERT_EQ(8, lseek(fd, 0, SEEK_CUR));
+    body = echoed_body(&req, &got);
+    ASSERT_EQ(sizeof(data) - 8, got);
+    ASSERT(memcmp(data + 8, body, got) == 0);
+
+    /* a pipe has no length up front, so the body goes out chunked */
+    if (pipe(pipefd) || write(pipefd[1], data, sizeof(data)) != sizeof(data))
+        FAIL();
+    close(pipefd[1]);
+    requests_reset(&req);
+    ASSERT_EQ(CURLE_OK, requests_put_fd(&req, posttestserver, pipefd[0], -1,
+                                        NULL, 0));
+    ASSERT(strncmp(req.text, "PUT /post ", 10) == 0);
+    ASSERT(strstr(req.text, "Transfer-Encoding: chunked\r\n") != NULL);
+    body = echoed_body(&req, &got);
+    ASSERT_EQ(sizeof(data), got);
+    ASSERT(memcmp(data, body, got) == 0);
+
+    requests_close(&req);
+    close(pipefd[0]);
+    close(fd);
+    unlink(path);
+    PASS();
+}
+
+/* hands out the pieces another thread makes ready, one call at a time */
+typedef struct {
+    req_t *req;
+    const char *pieces[3];
+    atomic_int ready;   /* pieces made ready so far */
+    int sent;
+    int pauses;
+} producer_state_t;
+
+static size_t produce_pieces(char *buf, size_t len, void *userdata)
+{
+    producer_state_t *st = userdata;
+
+    if (st->sent == 3)
+        return 0;
+    if (st->sent == atomic_load(&st->ready)) {
+        st->pauses++;
+        return REQUESTS_PRODUCE_PAUSE;
+    }
+    size_t n = strlen(st->pieces[st->sent]);
+    if (n > len)
+        return REQUESTS_PRODUCE_ABORT;
+    memcpy(buf, st->pieces[st->sent++], n);
+    return n;
+}
+
+static void *make_pieces(void *arg)
+{
+    producer_state_t *st = arg;
+    struct timespec ts = { 0, 20 * 1000000 };
+
+    for (int i = 0; i < 3; i++) {
+        nanosleep(&ts, NULL);
+        atomic_fetch_add(&st->ready, 1);
+        requests_resume_upload(st->req);
+    }
+    return NULL;
+}
+
+TEST upload_producer()
+{
+    req_t req;
+    producer_state_t st = {
+        &req, { "first,", "second,", "third" }, 0, 0, 0
+    };
+    pthread_t thread;
+    size_t got;
+
+    if (requests_init(&req))
+        FAIL();
+    if (pthread_create(&thread, NULL, make_pieces, &st))
+        FAIL();
+    ASSERT_EQ(CURLE_OK, requests_post_producer(&req, posttestserver,
+                                               produce_pieces, &st, NULL, 0));
+    pthread_join(thread, NULL);
+
+    ASSERT_EQ(200, req.code);
+    ASSERT(st.pauses > 0);
+    ASSERT(strstr(req.text, "Transfer-Encoding: chunked\r\n") != NULL);
+    const char *body = echoed_body(&req, &got);
+    ASSERT_EQ(strlen("first,second,third"), got);
+    ASSERT(memcmp("first,second,third", body, got) == 0);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST upload_multipart()
+{
+    char path[] = "/tmp/librequests-form-XXXXXX";
+    const char meta[] = "{\"name\": \"artifact\"}";
+    const char blob[] = "one\0two";
+    const char meta_part[] = "name=\"meta\"\r\nContent-Type: application/json"
+                             "\r\n\r\n{\"name\": \"artifact\"}\r\n";
+    const char blob_part[] = "name=\"blob\"\r\n\r\none\0two\r\n";
+    const char file_part[] = "name=\"file\"; filename=\"artifact.bin\"";
+    size_t len = 300000, got;
+    char *data = malloc(len);
+    const char *body;
+    requests_multipart_t form;
+    req_t req;
+    int fd = mkstemp(path);
+
+    if (data == NULL || fd < 0)
+        FAIL();
+    for (size_t i = 0; i < len; i++)
+        data[i] = test_pattern(i);
+    if (write(fd, data, len) != (ssize_t) len)
+        FAIL();
+    close(fd);
+
+    if (requests_init(&req))
+        FAIL();
+    ASSERT_EQ(0, requests_multipart_init(&form));
+    ASSERT_EQ(0, requests_multipart_add(&form, "meta", meta, strlen(meta),
+                                        "application/json"));
+    ASSERT_EQ(0, requests_multipart_add(&form, "blob", blob,
+                                        sizeof(blob) - 1, NULL));
+    ASSERT_EQ(0, requests_multipart_add_file(&form, "file", path,
+                                             "artifact.bin",
+                                             "application/octet-stream"));
+    ASSERT_EQ(-1, requests_multipart_add_file(&form, "gone", "/nonexistent",
+                                              NULL, NULL));
+    ASSERT_EQ(3, form.partc);
+
+    /* the same form twice, read from the start each time */
+    for (int i = 0; i < 2; i++) {
+        requests_reset(&req);
+        ASSERT_EQ(CURLE_OK, requests_post_multipart(&req, posttestserver,
+                                                    &form, NULL, 0));
+        ASSERT_EQ(200, req.code);
+        ASSERT(strstr(req.text, "Content-Type: multipart/form-data; "
+                                "boundary=") != NULL);
+        body = echoed_body(&req, &got);
+        ASSERT(body != NULL);
+        ASSERT(memmem(body, got, meta_part, sizeof(meta_part) - 1) != NULL);
+        ASSERT(memmem(body, got, blob_part, sizeof(blob_part) - 1) != NULL);
+        ASSERT(memmem(body, got, file_part, sizeof(file_part) - 1) != NULL);
+        ASSERT(memmem(body, got, data, len) != NULL);
+    }
+
+    requests_close(&req);
+    requests_multipart_close(&form);
+    unlink(path);
+    free(data);
+    PASS();
+}
+
 TEST urlencode()
 {
     req_t req;
@@ -167,36 +544,1121 @@ TEST urlencode()
         "banana", "yellow"
     };
     int data_size = sizeof(data)/sizeof(char*);
-    char *ideal = "apple%3Dred%26banana%3Dyellow";
+    char *ideal = "apple=red&banana=yellow";
     char *test = requests_url_encode(&req, data, data_size);
 
     ASSERT(strcmp(ideal, test) == 0);
 
-    curl_free(test);
+    requests_free(test);
+    requests_close(&req);
+
+    PASS();
+}
+
+TEST reset()
+{
+    long code = 200;
+    size_t size = 33;
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+
+    char **resp_hdrv = NULL;
+    for (int i = 0; i < 2; i++) {
+        requests_reset(&req);
+        requests_get(&req, example);
+
+        /* header storage is kept and reused across requests */
+        if (i > 0)
+            ASSERT_EQ(resp_hdrv, req.resp_hdrv);
+        resp_hdrv = req.resp_hdrv;
+
+        ASSERT_EQ(code, req.code);
+        ASSERT_EQ(size, req.size);
+        ASSERT(strcmp(example_text, req.text) == 0);
+        ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
+        ASSERT_EQ(1, req.ok);
+    }
+
+    /* the second request reused the first one's connection */
+    long connects;
+    curl_easy_getinfo(req.curlhandle, CURLINFO_NUM_CONNECTS, &connects);
+    ASSERT_EQ(0, connects);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST shared()
+{
+    long code = 200;
+    long connects;
+    requests_share_t share;
+    req_t first, second;
+
+    if (requests_share_init(&share,
+                            REQUESTS_SHARE_ALL | REQUESTS_SHARE_CONNECT))
+        FAIL();
+    if (requests_init_shared(&first, &share))
+        FAIL();
+    if (requests_init_shared(&second, &share))
+        FAIL();
+
+    requests_get(&first, example);
+    requests_get(&second, example);
+
+    ASSERT_EQ(code, first.code);
+    ASSERT_EQ(code, second.code);
+    ASSERT(strcmp(example_text, second.text) == 0);
+
+    /* the second handle picked up the first one's connection */
+    curl_easy_getinfo(second.curlhandle, CURLINFO_NUM_CONNECTS, &connects);
+    ASSERT_EQ(0, connects);
+
+    /* pooled handles run on many threads, so they can't share connections */
+    requests_pool_t pool;
+    ASSERT_EQ(-1, requests_pool_init(&pool, 2, 0, &share));
+
+    requests_close(&first);
+    requests_close(&second);
+    requests_share_close(&share);
+    PASS();
+}
+
+TEST pool()
+{
+    long code = 200;
+    requests_pool_t pool;
+    requests_pool_stats_t stats;
+    requests_retry_t retry;
+
+    requests_retry_init(&retry);
+    if (requests_pool_init(&pool, 2, 1, NULL))
+        FAIL();
+
+    req_t *first = requests_pool_acquire(&pool);
+    req_t *second = requests_pool_acquire(&pool);
+    ASSERT(first != NULL && second != NULL && first != second);
+
+    requests_set_compression(first, REQUESTS_DECODE);
+    requests_set_retry(first, &retry);
+    requests_get(first, example);
+    ASSERT_EQ(code, first->code);
+    ASSERT(strcmp(example_text, first->text) == 0);
+    requests_pool_release(&pool, first);
+
+    /* the handle comes back reset, settings and all, and is handed out
+       again */
+    req_t *again = requests_pool_acquire(&pool);
+    ASSERT_EQ(first, again);
+    ASSERT_EQ(0, again->size);
+    ASSERT_EQ(0, again->resp_hdrc);
+    ASSERT_EQ(0, again->compression);
+    ASSERT(again->retry == NULL);
+    requests_pool_release(&pool, again);
+    requests_pool_release(&pool, second);
+
+    requests_pool_stats(&pool, &stats);
+    ASSERT_EQ(2, stats.hits);
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(0, stats.waits);
+    ASSERT_EQ(0, stats.in_use);
+    ASSERT_EQ(2, stats.high_water);
+
+    requests_pool_close(&pool);
+    PASS();
+}
+
+TEST prepared()
+{
+    long code = 200;
+    size_t size = 33;
+    char *custom_hdrv[] = {
+        "Content-Type: application/json",
+        "Content-Hype: dude"
+    };
+    int headers_size = sizeof(custom_hdrv)/sizeof(char*);
+    requests_prepared_t prep;
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    if (requests_prepare(&prep, REQUESTS_GET, example, NULL, custom_hdrv,
+                         headers_size))
+        FAIL();
+
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(CURLE_OK, requests_prepared_perform(&req, &prep));
+        ASSERT_EQ(code, req.code);
+        ASSERT_EQ(size, req.size);
+        ASSERT(strcmp(example_text, req.text) == 0);
+        ASSERT(strcmp(req.resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
+        ASSERT_EQ(1, req.ok);
+    }
+
+    /* prepared again in the same struct, it must not pass for the old one */
+    requests_prepared_close(&prep);
+    if (requests_prepare(&prep, REQUESTS_POST, posttestserver, "fruit=apple",
+                         NULL, 0))
+        FAIL();
+    ASSERT_EQ(CURLE_OK, requests_prepared_perform(&req, &prep));
+    ASSERT_EQ(code, req.code);
+    ASSERT(strncmp(req.text, "POST /post ", 11) == 0);
+    ASSERT(strstr(req.text, "Content-Hype") == NULL);
+    size_t got;
+    const char *body = echoed_body(&req, &got);
+    ASSERT(body != NULL);
+    ASSERT_EQ(strlen("fruit=apple"), got);
+    ASSERT(memcmp("fruit=apple", body, got) == 0);
+
     requests_close(&req);
+    requests_prepared_close(&prep);
+    PASS();
+}
 
+static size_t count_sink(const char *chunk, size_t len, void *userdata)
+{
+    *(size_t *) userdata += len;
+    return len;
+}
+
+TEST get_sink()
+{
+    long code = 200;
+    size_t size = 33;
+    size_t streamed = 0;
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    requests_set_sink(&req, count_sink, &streamed);
+    requests_get(&req, example);
+
+    ASSERT_EQ(code, req.code);
+    ASSERT_EQ(size, streamed);
+    ASSERT_EQ(size, req.size);
+    ASSERT(strcmp("", req.text) == 0);
+    ASSERT_EQ(1, req.ok);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_compressed()
+{
+    long code = 200;
+    size_t size = GZIP_PLAIN_LEN;
+    char url[128];
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    requests_set_compression(&req, REQUESTS_DECODE);
+    snprintf(url, sizeof(url), "%s/gzip", server.url);
+    requests_get(&req, url);
+
+    ASSERT_EQ(code, req.code);
+    ASSERT_EQ(size, req.size);
+    ASSERT_EQ(gzip_route.body_len, req.wire_size);
+    for (size_t i = 0; i < size; i++)
+        if (req.text[i] != test_pattern(i))
+            FAILm("decoded body differs");
+    ASSERT_EQ(1, req.ok);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST post_compressed()
+{
+    long code = 200;
+    char *data = "apple=red&banana=yellow&cherry=red&apple=red&banana=yellow";
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    requests_set_compression(&req, REQUESTS_ENCODE_GZIP);
+    requests_post(&req, posttestserver, data);
+
+    ASSERT_EQ(code, req.code);
+    ASSERT_EQ(1, req.req_hdrc);
+    ASSERT(strcmp("Content-Encoding: gzip", req.req_hdrv[0]) == 0);
+    ASSERT(strstr(req.text, "Content-Encoding: gzip\r\n") != NULL);
+    /* the body arrived compressed */
+    ASSERT(strstr(req.text, data) == NULL);
+    ASSERT_EQ(1, req.ok);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_cached()
+{
+    long code = 200;
+    size_t size = 33;
+    requests_cache_t cache;
+    requests_cache_stats_t stats;
+
+    if (requests_cache_init(&cache, 1 << 20))
+        FAIL();
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    requests_set_cache(&req, &cache);
+
+    for (int i = 0; i < 2; i++) {
+        requests_reset(&req);
+        requests_get(&req, example);
+        ASSERT_EQ(code, req.code);
+        ASSERT_EQ(size, req.size);
+        ASSERT(strcmp(example_text, req.text) == 0);
+    }
+
+    /* the second body came from the cache, fresh or revalidated */
+    requests_cache_stats(&cache, &stats);
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(1, stats.hits + stats.revalidations);
+    ASSERT_EQ(size, stats.bytes_saved);
+    ASSERT_EQ(1, stats.entries);
+
+    requests_close(&req);
+    requests_cache_close(&cache);
+    PASS();
+}
+
+typedef struct {
+    requests_cache_t *cache;
+    atomic_int done;        /* the other thread's request has finished */
+    int finished_in_sink;   /* ...while the sink was still running */
+    size_t got;
+    pthread_t thread;
+} cache_sink_state_t;
+
+static void *cached_get(void *arg)
+{
+    cache_sink_state_t *st = arg;
+    req_t req;
+
+    if (requests_init(&req) == 0) {
+        requests_set_cache(&req, st->cache);
+        requests_get(&req, example);
+        requests_close(&req);
+    }
+    atomic_store(&st->done, 1);
+    return NULL;
+}
+
+/* holds up the replay until another thread has been through the cache */
+static size_t blocking_sink(const char *chunk, size_t len, void *userdata)
+{
+    cache_sink_state_t *st = userdata;
+    struct timespec ts = { 0, 1000000 };
+
+    if (st->got == 0 &&
+        pthread_create(&st->thread, NULL, cached_get, st) == 0) {
+        for (int i = 0; i < 2000 && !atomic_load(&st->done); i++)
+            nanosleep(&ts, NULL);
+        st->finished_in_sink = atomic_load(&st->done);
+    }
+    st->got += len;
+    return len;
+}
+
+TEST get_cached_sink()
+{
+    requests_cache_t cache;
+    requests_cache_stats_t stats;
+    cache_sink_state_t st = { &cache, 0, 0, 0 };
+    req_t req;
+
+    if (requests_cache_init(&cache, 1 << 20))
+        FAIL();
+    if (requests_init(&req))
+        FAIL();
+    requests_set_cache(&req, &cache);
+    ASSERT_EQ(CURLE_OK, requests_get(&req, example));
+
+    requests_reset(&req);
+    requests_set_sink(&req, blocking_sink, &st);
+    ASSERT_EQ(CURLE_OK, requests_get(&req, example));
+    pthread_join(st.thread, NULL);
+    ASSERT_EQ(strlen(example_text), st.got);
+    ASSERT(st.finished_in_sink);
+
+    requests_cache_stats(&cache, &stats);
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(2, stats.hits);
+
+    requests_close(&req);
+    requests_cache_close(&cache);
+    PASS();
+}
+
+TEST get_cached_vary()
+{
+    requests_cache_t cache;
+    requests_cache_stats_t stats;
+    char url[128];
+    char tenant[2048 + 16];
+    char *hdrv[] = { tenant };
+    req_t req;
+
+    if (requests_cache_init(&cache, 1 << 20))
+        FAIL();
+    if (requests_init(&req))
+        FAIL();
+    requests_set_cache(&req, &cache);
+    snprintf(url, sizeof(url), "%s/vary", server.url);
+
+    /* a Vary'd header far longer than any fixed key buffer */
+    strcpy(tenant, "X-Tenant: ");
+    memset(tenant + 10, 'a', 2048);
+    tenant[10 + 2048] = '\0';
+    for (int i = 0; i < 3; i++) {
+        /* the third request differs in the last byte only */
+        if (i == 2)
+            tenant[10 + 2047] = 'b';
+        requests_reset(&req);
+        ASSERT_EQ(CURLE_OK, requests_get_headers(&req, url, hdrv, 1));
+        ASSERT_EQ(200, req.code);
+        ASSERT(strcmp("varied", req.text) == 0);
+    }
+
+    requests_cache_stats(&cache, &stats);
+    ASSERT_EQ(2, stats.misses);
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(2, stats.entries);
+
+    requests_close(&req);
+    requests_cache_close(&cache);
+    PASS();
+}
+
+/*
+ * remove_dir - Deletes a directory of plain files, like the disk cache's.
+ */
+static void remove_dir(const char *dir)
+{
+    char path[512];
+    struct dirent *ent;
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+        return;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+TEST get_disk_cached()
+{
+    long code = 200;
+    size_t size = 33;
+    char dir[] = "/tmp/librequests-test-XXXXXX";
+    requests_disk_cache_t cache;
+    requests_cache_stats_t stats;
+
+    if (mkdtemp(dir) == NULL ||
+        requests_disk_cache_init(&cache, dir, 1 << 20))
+        FAIL();
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    requests_set_disk_cache(&req, &cache);
+
+    for (int i = 0; i < 2; i++) {
+        requests_reset(&req);
+        requests_get(&req, example);
+        ASSERT_EQ(code, req.code);
+        ASSERT_EQ(size, req.size);
+        ASSERT(strcmp(example_text, req.text) == 0);
+    }
+    requests_close(&req);
+    requests_disk_cache_close(&cache);
+
+    /* a second opener of the directory sees the same entry */
+    if (requests_disk_cache_init(&cache, dir, 1 << 20))
+        FAIL();
+    requests_disk_cache_stats(&cache, &stats);
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(1, stats.hits + stats.revalidations);
+    ASSERT_EQ(size, stats.bytes_saved);
+    ASSERT_EQ(1, stats.entries);
+    requests_disk_cache_close(&cache);
+    remove_dir(dir);
+    PASS();
+}
+
+TEST disk_cache_corrupt()
+{
+    char dir[] = "/tmp/librequests-test-XXXXXX";
+    char path[sizeof(dir) + 8];
+    requests_disk_cache_t cache;
+    /* magic, version and slot count of an index header, 72 bytes in all,
+       followed by that many 48 byte slots */
+    uint32_t slotcv[] = { 0, 3 };
+
+    if (mkdtemp(dir) == NULL)
+        FAIL();
+    snprintf(path, sizeof(path), "%s/index", dir);
+
+    for (int i = 0; i < 2; i++) {
+        uint32_t head[18] = { 0x4351524cu, 1, slotcv[i] };
+        FILE *f = fopen(path, "w");
+        if (f == NULL)
+            FAIL();
+        fwrite(head, sizeof(head), 1, f);
+        for (uint32_t j = 0; j < slotcv[i] * 48; j++)
+            fputc(0, f);
+        fclose(f);
+        ASSERT_EQ(-1, requests_disk_cache_init(&cache, dir, 1 << 20));
+    }
+    remove_dir(dir);
+    PASS();
+}
+
+TEST get_retry()
+{
+    requests_retry_t policy;
+    req_t req;
+
+    requests_retry_init(&policy);
+    policy.base_ms = 1;
+    if (requests_init(&req))
+        FAIL();
+    requests_set_retry(&req, &policy);
+
+    /* a success takes one try */
+    requests_get(&req, example);
+    ASSERT_EQ(200, req.code);
+    ASSERT_EQ(1, req.attempts);
+    ASSERT_EQ(0, req.retry_wait_ms);
+
+    /* the route fails twice with 503 before answering */
+    char url[128];
+    snprintf(url, sizeof(url), "%s/flaky", server.url);
+    requests_reset(&req);
+    ASSERT_EQ(CURLE_OK, requests_get(&req, url));
+    ASSERT_EQ(200, req.code);
+    ASSERT_EQ(3, req.attempts);
+    ASSERT(strcmp("finally", req.text) == 0);
+
+    /* nothing listens on port 1; connecting is safe to retry, even a POST */
+    requests_reset(&req);
+    ASSERT_EQ(CURLE_COULDNT_CONNECT,
+              requests_post(&req, "http://127.0.0.1:1/", "a=1"));
+    ASSERT_EQ(policy.max_attempts, req.attempts);
+
+    requests_set_retry(&req, NULL);
+    requests_reset(&req);
+    requests_get(&req, "http://127.0.0.1:1/");
+    ASSERT_EQ(1, req.attempts);
+
+    requests_close(&req);
+    PASS();
+}
+
+/* the first request, the primary, takes 300 ms; the hedge is answered at
+   once */
+test_route_t slow_first_route = {
+    .path = "/slow-first",
+    .delay_ms = 300,
+    .delay_first = 1
+};
+
+TEST get_hedged()
+{
+    test_server_t srv;
+    requests_hedge_t hedge;
+    requests_hedge_stats_t stats;
+    char url[128];
+    req_t req;
+
+    slow_first_route.body = example_text;
+    if (test_server_start(&srv, example_text, 0) ||
+        test_server_route(&srv, &slow_first_route))
+        FAIL();
+    if (requests_hedge_init(&hedge, 10) || requests_init(&req))
+        FAIL();
+    requests_set_hedge(&req, &hedge);
+    snprintf(url, sizeof(url), "%s/slow-first", srv.url);
+
+    ASSERT_EQ(CURLE_OK, requests_get(&req, url));
+    ASSERT_EQ(200, req.code);
+    ASSERT(strcmp(example_text, req.text) == 0);
+    ASSERT_EQ(2, atomic_load(&srv.connections));
+
+    requests_hedge_stats(&hedge, &stats);
+    ASSERT_EQ(1, stats.requests);
+    ASSERT_EQ(1, stats.issued);
+    ASSERT_EQ(1, stats.won);
+    ASSERT_EQ(10, stats.delay_ms);
+
+    /* what was adopted from the spare is its own, not the primary's */
+    ASSERT_EQ(strlen(example_text), req.wire_size);
+    ASSERT(req.timing.total_us > 0);
+    ASSERT(req.timing.total_us < 300000);
+
+    requests_close(&req);
+    requests_hedge_close(&hedge);
+    test_server_stop(&srv);
+    PASS();
+}
+
+/* the same, but cacheable */
+test_route_t slow_cached_route = {
+    .path = "/slow-cached",
+    .headers = "Cache-Control: max-age=300\r\n",
+    .delay_ms = 300,
+    .delay_first = 1
+};
+
+TEST get_hedged_cached()
+{
+    test_server_t srv;
+    requests_cache_t cache;
+    requests_cache_stats_t cstats;
+    requests_hedge_t hedge;
+    requests_hedge_stats_t stats;
+    char url[128];
+    req_t req;
+
+    slow_cached_route.body = example_text;
+    if (test_server_start(&srv, example_text, 0) ||
+        test_server_route(&srv, &slow_cached_route))
+        FAIL();
+    if (requests_cache_init(&cache, 1 << 20) ||
+        requests_hedge_init(&hedge, 10) || requests_init(&req))
+        FAIL();
+    requests_set_cache(&req, &cache);
+    requests_set_hedge(&req, &hedge);
+    snprintf(url, sizeof(url), "%s/slow-cached", srv.url);
+
+    /* the miss goes to the network, hedged; the hit doesn't */
+    for (int i = 0; i < 2; i++) {
+        requests_reset(&req);
+        ASSERT_EQ(CURLE_OK, requests_get(&req, url));
+        ASSERT_EQ(200, req.code);
+        ASSERT(strcmp(example_text, req.text) == 0);
+    }
+    ASSERT_EQ(2, atomic_load(&slow_cached_route.hits));
+
+    requests_hedge_stats(&hedge, &stats);
+    ASSERT_EQ(1, stats.requests);
+    ASSERT_EQ(1, stats.issued);
+    ASSERT_EQ(1, stats.won);
+    requests_cache_stats(&cache, &cstats);
+    ASSERT_EQ(1, cstats.misses);
+    ASSERT_EQ(1, cstats.hits);
+
+    requests_close(&req);
+    requests_hedge_close(&hedge);
+    requests_cache_close(&cache);
+    test_server_stop(&srv);
+    PASS();
+}
+
+TEST get_timing()
+{
+    test_server_t srv;
+    requests_latency_t agg;
+    requests_latency_summary_t summary;
+    req_t req;
+
+    if (test_server_start(&srv, example_text, 20))
+        FAIL();
+    if (requests_latency_init(&agg) || requests_init(&req))
+        FAIL();
+    requests_set_latency(&req, &agg);
+
+    for (int i = 0; i < 3; i++) {
+        requests_reset(&req);
+        ASSERT_EQ(CURLE_OK, requests_get(&req, srv.url));
+    }
+
+    /* phases are cumulative, and the server sits on each request 20 ms */
+    requests_timing_t *t = &req.timing;
+    ASSERT(t->connect_us <= t->pretransfer_us);
+    ASSERT(t->pretransfer_us <= t->starttransfer_us);
+    ASSERT(t->starttransfer_us <= t->total_us);
+    ASSERT(t->starttransfer_us >= 20000);
+    ASSERT(t->bytes_up > 0);
+    ASSERT(t->bytes_down > (curl_off_t) req.size);
+
+    /* the host is filed as it appears in the URL */
+    ASSERT_EQ(0, requests_latency_summary(&agg, srv.url + strlen("http://"),
+                                          REQUESTS_PHASE_TOTAL, &summary));
+    ASSERT_EQ(3, summary.count);
+    ASSERT(summary.min_us >= 20000);
+    ASSERT(summary.min_us <= summary.p50_us);
+    ASSERT(summary.p99_us <= summary.max_us);
+    /* only the first request had to connect */
+    ASSERT_EQ(0, requests_latency_summary(&agg, srv.url + strlen("http://"),
+                                          REQUESTS_PHASE_CONNECT, &summary));
+    ASSERT_EQ(1, summary.count);
+
+    requests_close(&req);
+    requests_latency_close(&agg);
+    test_server_stop(&srv);
+    PASS();
+}
+
+TEST get_redirect()
+{
+    char url[128];
+    long redirects;
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    snprintf(url, sizeof(url), "%s/redirect", server.url);
+    requests_get(&req, url);
+
+    ASSERT_EQ(200, req.code);
+    ASSERT(strcmp(example_text, req.text) == 0);
+    curl_easy_getinfo(req.curlhandle, CURLINFO_REDIRECT_COUNT, &redirects);
+    ASSERT_EQ(1, redirects);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_chunked()
+{
+    char url[128];
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    snprintf(url, sizeof(url), "%s/chunked", server.url);
+    requests_get(&req, url);
+
+    ASSERT_EQ(200, req.code);
+    ASSERT_EQ(chunked_route.body_len, req.size);
+    ASSERT(strcmp("chunked", requests_header(&req, "transfer-encoding")) == 0);
+    for (size_t i = 0; i < req.size; i++)
+        if (req.text[i] != test_pattern(i))
+            FAILm("body differs");
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_large()
+{
+    char url[128];
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    snprintf(url, sizeof(url), "%s/large", server.url);
+    requests_get(&req, url);
+
+    ASSERT_EQ(200, req.code);
+    ASSERT_EQ(large_route.body_len, req.size);
+    /* Content-Length sizes the buffer up front, however big the body */
+    ASSERT_EQ(1, req.text_reallocs);
+    for (size_t i = 0; i < req.size; i++)
+        if (req.text[i] != test_pattern(i))
+            FAILm("body differs");
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_status()
+{
+    char url[128];
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    snprintf(url, sizeof(url), "%s/missing", server.url);
+    ASSERT_EQ(CURLE_OK, requests_get(&req, url));
+
+    ASSERT_EQ(404, req.code);
+    ASSERT(strcmp("Not Found", requests_reason(&req)) == 0);
+    ASSERT_EQ(0, req.ok);
+
+    requests_close(&req);
+    PASS();
+}
+
+TEST get_memory()
+{
+    char url[128];
+    long before;
+
+    req_t req;
+    if (requests_init(&req))
+        FAIL();
+    before = atomic_load(&allocations);
+    requests_get(&req, example);
+
+    ASSERT_EQ(200, req.code);
+    ASSERT(atomic_load(&allocations) > before);
+    ASSERT(req.mem.bytes >= req.text_cap);
+    ASSERT(req.mem.peak >= req.mem.bytes);
+
+    /* a reset keeps the buffers and starts a new peak */
+    size_t held = req.mem.bytes;
+    requests_reset(&req);
+    ASSERT_EQ(held, req.mem.bytes);
+    ASSERT_EQ(held, req.mem.peak);
+
+    snprintf(url, sizeof(url), "%s/large", server.url);
+    requests_get(&req, url);
+    ASSERT(req.mem.peak >= large_route.body_len);
+
+    requests_close(&req);
+    ASSERT_EQ(0, req.mem.bytes);
+    PASS();
+}
+
+TEST form_encode()
+{
+    char *data[] = {
+        "a b", "x&y=z",
+        "caf\xc3\xa9", "~-._"
+    };
+    int data_size = sizeof(data)/sizeof(char*);
+    char *ideal = "a+b=x%26y%3Dz&caf%C3%A9=~-._";
+    char buf[64];
+    char small[4];
+
+    ASSERT_EQ((ssize_t) strlen(ideal),
+              requests_form_encode(NULL, 0, data, data_size));
+    ASSERT_EQ((ssize_t) strlen(ideal),
+              requests_form_encode(buf, sizeof(buf), data, data_size));
+    ASSERT(strcmp(ideal, buf) == 0);
+
+    /* too small: nothing partial is written */
+    ASSERT_EQ((ssize_t) strlen(ideal),
+              requests_form_encode(small, sizeof(small), data, data_size));
+    ASSERT(strcmp("", small) == 0);
+
+    ASSERT_EQ(-1, requests_form_encode(buf, sizeof(buf), data, 3));
+    PASS();
+}
+
+TEST batch()
+{
+    long code = 200;
+    size_t size = 33;
+    int n = 4;
+    req_t reqs[4];
+
+    requests_batch_t batch;
+    if (requests_batch_init(&batch))
+        FAIL();
+
+    for (int i = 0; i < n; i++) {
+        if (requests_init(&reqs[i]))
+            FAIL();
+        ASSERT_EQ(CURLE_OK, requests_batch_get(&batch, &reqs[i], example));
+    }
+    ASSERT_EQ(CURLM_OK, requests_batch_perform(&batch));
+
+    for (int i = 0; i < n; i++) {
+        req_t *req = requests_batch_req(&batch, i);
+        ASSERT_EQ(&reqs[i], req);
+        ASSERT_EQ(CURLE_OK, requests_batch_result(&batch, i));
+        ASSERT_EQ(code, req->code);
+        ASSERT_EQ(size, req->size);
+        ASSERT(strcmp(example_text, req->text) == 0);
+        ASSERT(strcmp(req->resp_hdrv[0], "HTTP/1.1 200 OK\r\n") == 0);
+        ASSERT_EQ(1, req->ok);
+    }
+
+    requests_batch_close(&batch);
+    for (int i = 0; i < n; i++)
+        requests_close(&reqs[i]);
+    PASS();
+}
+
+TEST get_http_version()
+{
+    test_server_t srv;
+    req_t req;
+
+    if (test_server_start_tls(&srv, example_text, 0))
+        SKIPm("test server built without TLS");
+    if (requests_init(&req))
+        FAIL();
+
+    /* left alone, libcurl offers HTTP/2 over TLS by itself */
+    curl_easy_setopt(req.curlhandle, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(req.curlhandle, CURLOPT_SSL_VERIFYHOST, 0L);
+    ASSERT_EQ(CURLE_OK, requests_get(&req, srv.url));
+    ASSERT_EQ(20, requests_http_version(&req));
+
+    requests_reset(&req);
+    requests_set_http2(&req, REQUESTS_HTTP1);
+    curl_easy_setopt(req.curlhandle, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(req.curlhandle, CURLOPT_SSL_VERIFYHOST, 0L);
+    ASSERT_EQ(CURLE_OK, requests_get(&req, srv.url));
+    ASSERT_EQ(11, requests_http_version(&req));
+    ASSERT(strcmp(example_text, req.text) == 0);
+
+    requests_close(&req);
+    test_server_stop(&srv);
+    PASS();
+}
+
+TEST batch_http2()
+{
+    int n = 8;
+    req_t reqs[8];
+    test_server_t srv;
+
+    if (test_server_start_tls(&srv, example_text, 50))
+        SKIPm("test server built without TLS");
+
+    requests_batch_t batch;
+    if (requests_batch_init(&batch))
+        FAIL();
+    requests_batch_set_max_connections(&batch, 1);
+    requests_batch_set_max_streams(&batch, n);
+
+    for (int i = 0; i < n; i++) {
+        if (requests_init(&reqs[i]))
+            FAIL();
+        requests_set_http2(&reqs[i], REQUESTS_HTTP2);
+        ASSERT_EQ(CURLE_OK, requests_batch_get(&batch, &reqs[i], srv.url));
+        curl_easy_setopt(reqs[i].curlhandle, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(reqs[i].curlhandle, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+    ASSERT_EQ(CURLM_OK, requests_batch_perform(&batch));
+
+    /* every request rode the same connection as its own stream */
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(CURLE_OK, requests_batch_result(&batch, i));
+        ASSERT_EQ(200, reqs[i].code);
+        ASSERT_EQ(20, requests_http_version(&reqs[i]));
+        ASSERT(strcmp(example_text, reqs[i].text) == 0);
+    }
+    ASSERT_EQ(1, atomic_load(&srv.connections));
+
+    requests_batch_close(&batch);
+    for (int i = 0; i < n; i++)
+        requests_close(&reqs[i]);
+    test_server_stop(&srv);
+    PASS();
+}
+
+static void count_done(req_t *req, CURLcode rc, void *userdata)
+{
+    if (rc == CURLE_OK)
+        (*(int *) userdata)++;
+}
+
+TEST loop()
+{
+    long code = 200;
+    size_t size = 33;
+    int n = 4;
+    int done = 0;
+    req_t reqs[4];
+
+    requests_loop_t loop;
+    if (requests_loop_init(&loop, NULL, NULL, NULL))
+        FAIL();
+
+    for (int i = 0; i < n; i++) {
+        if (requests_init(&reqs[i]))
+            FAIL();
+        ASSERT_EQ(CURLE_OK, requests_loop_get(&loop, &reqs[i], example,
+                                              count_done, &done));
+    }
+    ASSERT_EQ(CURLM_OK, requests_loop_run(&loop));
+    ASSERT_EQ(n, done);
+    ASSERT_EQ(0, requests_loop_running(&loop));
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(code, reqs[i].code);
+        ASSERT_EQ(size, reqs[i].size);
+        ASSERT(strcmp(example_text, reqs[i].text) == 0);
+        ASSERT_EQ(1, reqs[i].ok);
+    }
+
+    requests_loop_close(&loop);
+    for (int i = 0; i < n; i++)
+        requests_close(&reqs[i]);
+    PASS();
+}
+
+TEST async()
+{
+    long code = 200;
+    size_t size = 33;
+    int n = 4;
+    req_t reqs[4];
+    req_t *done[4];
+    int reaped = 0;
+
+    requests_async_t ctx;
+    if (requests_async_init(&ctx))
+        FAIL();
+
+    for (int i = 0; i < n; i++) {
+        if (requests_init(&reqs[i]))
+            FAIL();
+        ASSERT_EQ(CURLE_OK, requests_submit_get(&ctx, &reqs[i], example));
+    }
+    ASSERT_EQ(n, requests_async_outstanding(&ctx));
+
+    while (reaped < n) {
+        int got = requests_async_reap(&ctx, done + reaped, n - reaped, 10000);
+        if (got == 0)
+            FAIL();
+        reaped += got;
+    }
+    ASSERT_EQ(0, requests_async_outstanding(&ctx));
+    ASSERT_EQ(NULL, requests_async_poll(&ctx));
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(CURLE_OK, done[i]->result);
+        ASSERT_EQ(code, done[i]->code);
+        ASSERT_EQ(size, done[i]->size);
+        ASSERT(strcmp(example_text, done[i]->text) == 0);
+    }
+
+    requests_async_close(&ctx);
+    for (int i = 0; i < n; i++)
+        requests_close(&reqs[i]);
     PASS();
 }
 
 SUITE(tests)
 {
     RUN_TEST(get);
+    RUN_TEST(get_header_lookup);
+    RUN_TEST(get_redirect);
+    RUN_TEST(get_chunked);
+    RUN_TEST(get_large);
+    RUN_TEST(get_status);
+    RUN_TEST(get_memory);
     RUN_TEST(get_headers);
     RUN_TEST(post);
     RUN_TEST(post_nodata);
     RUN_TEST(post_headers);
     RUN_TEST(put);
+    RUN_TEST(upload_file);
+    RUN_TEST(upload_fd);
+    RUN_TEST(upload_producer);
+    RUN_TEST(upload_multipart);
     RUN_TEST(urlencode);
+    RUN_TEST(form_encode);
+    RUN_TEST(reset);
+    RUN_TEST(shared);
+    RUN_TEST(pool);
+    RUN_TEST(prepared);
+    RUN_TEST(get_sink);
+    RUN_TEST(get_compressed);
+    RUN_TEST(post_compressed);
+    RUN_TEST(get_cached);
+    RUN_TEST(get_cached_sink);
+    RUN_TEST(get_cached_vary);
+    RUN_TEST(get_disk_cached);
+    RUN_TEST(disk_cache_corrupt);
+    RUN_TEST(get_retry);
+    RUN_TEST(get_hedged);
+    RUN_TEST(get_hedged_cached);
+    RUN_TEST(get_timing);
+    RUN_TEST(batch);
+    RUN_TEST(get_http_version);
+    RUN_TEST(batch_http2);
+    RUN_TEST(loop);
+    RUN_TEST(async);
 }
 
 GREATEST_MAIN_DEFS();
 
-int main(int argc, char **argv)
+/* GREATEST_MAIN_END() returns, so the suite gets a function of its own */
+static int run_tests(int argc, char **argv)
 {
-    DEBUG("Compiled with debug.");
-
     GREATEST_MAIN_BEGIN();
     RUN_SUITE(tests);
     GREATEST_MAIN_END();
-    return 0;
+}
+
+/*
+ * gzip_pattern - Compresses GZIP_PLAIN_LEN bytes of test_pattern() into a
+ * gzip member for the gzip route.
+ *
+ * Returns the malloc'ed member, or NULL on failure.
+ */
+static char *gzip_pattern(size_t *len)
+{
+    char *plain = malloc(GZIP_PLAIN_LEN);
+    char *out = malloc(GZIP_PLAIN_LEN);
+    z_stream zs = { 0 };
+
+    if (plain == NULL || out == NULL ||
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(plain);
+        free(out);
+        return NULL;
+    }
+    for (size_t i = 0; i < GZIP_PLAIN_LEN; i++)
+        plain[i] = test_pattern(i);
+    zs.next_in = (Bytef *) plain;
+    zs.avail_in = GZIP_PLAIN_LEN;
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = GZIP_PLAIN_LEN;
+    int rc = deflate(&zs, Z_FINISH);
+    *len = zs.total_out;
+    deflateEnd(&zs);
+    free(plain);
+    if (rc != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    test_route_t *routev[] = {
+        &example_route, &post_route, &gzip_route, &redirect_route,
+        &chunked_route, &large_route, &missing_route, &flaky_route,
+        &cookies_route, &hop_route, &vary_route
+    };
+    char *gzip_body;
+
+    DEBUG("Compiled with debug.");
+
+    if (requests_global_init(&counting_allocator)) {
+        fprintf(stderr, "could not set up libcurl\n");
+        return 1;
+    }
+    example_route.body = example_text;
+    gzip_body = gzip_pattern(&gzip_route.body_len);
+    gzip_route.body = gzip_body;
+    if (gzip_body == NULL || test_server_start(&server, "", 0)) {
+        fprintf(stderr, "could not start the test server\n");
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(routev) / sizeof(routev[0]); i++)
+        if (test_server_route(&server, routev[i])) {
+            fprintf(stderr, "could not add a test route\n");
+            return 1;
+        }
+    snprintf(example, sizeof(example), "%s/example", server.url);
+    snprintf(posttestserver, sizeof(posttestserver), "%s/post", server.url);
+
+    int rc = run_tests(argc, argv);
+    test_server_stop(&server);
+    free(gzip_body);
+    requests_global_cleanup();
+    return rc;
 }